@@ -0,0 +1,37 @@
+#ifndef ALLOC_HPP
+#define ALLOC_HPP
+
+#include <new>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Cache line size assumed for alignment and padding
+static const size_t CACHE_LINE = 64;
+
+// Aligned heap block; throws std::bad_alloc like new does
+inline void* aligned_malloc(size_t bytes, size_t alignment = CACHE_LINE) {
+    if (bytes == 0)
+        bytes = alignment;
+#ifdef _WIN32
+    void* p = _aligned_malloc(bytes, alignment);
+#else
+    void* p = NULL;
+    if (posix_memalign(&p, alignment, bytes) != 0)
+        p = NULL;
+#endif
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+inline void aligned_free(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+#endif
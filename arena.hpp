@@ -0,0 +1,59 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <vector>
+#include <stddef.h>
+#include <gmp.h>
+#include <mpfr.h>
+
+#include "alloc.hpp"
+
+// Bump allocator for MPFR limbs. Values initialised from an arena take their
+// limbs from a few large blocks instead of one heap block each and are all
+// released together when the arena is destroyed. Such values keep the
+// precision they were made with: never mpfr_clear or mpfr_set_prec them.
+// An arena is not thread-safe; give each worker its own.
+class MpfrArena {
+public:
+    explicit MpfrArena(size_t block_bytes_in = 16384) : block_bytes(block_bytes_in), used(block_bytes_in) {}
+
+    ~MpfrArena() {
+        for (size_t b = 0; b < blocks.size(); b++)
+            aligned_free(blocks[b]);
+    }
+
+    // Limb-aligned storage that lives as long as the arena
+    void* alloc(size_t bytes) {
+        bytes = (bytes + 2 * sizeof(mp_limb_t) - 1) / (2 * sizeof(mp_limb_t)) * (2 * sizeof(mp_limb_t));
+        if (bytes > block_bytes) {
+            // Oversized requests get a block of their own; keep filling the current one
+            void* p = aligned_malloc(bytes);
+            blocks.insert(blocks.end() - (blocks.empty() ? 0 : 1), p);
+            return p;
+        }
+        if (used + bytes > block_bytes) {
+            blocks.push_back(aligned_malloc(block_bytes));
+            used = 0;
+        }
+        void* p = (char*)blocks.back() + used;
+        used += bytes;
+        return p;
+    }
+
+    // x = +0 with `prec` bits of limbs from the arena
+    void init(mpfr_ptr x, mpfr_prec_t prec) {
+        void* limbs = alloc(mpfr_custom_get_size(prec));
+        mpfr_custom_init(limbs, prec);
+        mpfr_custom_init_set(x, MPFR_ZERO_KIND, 0, prec, limbs);
+    }
+
+private:
+    std::vector<void*> blocks;       // The last one is being filled
+    size_t block_bytes;
+    size_t used;                     // Bytes taken from the last block
+
+    MpfrArena(const MpfrArena&);
+    MpfrArena& operator=(const MpfrArena&);
+};
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef BEAM_HPP
+#define BEAM_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <gmp.h>
+#include <mpfr.h>
+
+#include "quaternion.hpp"
+#include "prng.hpp"
+
+// Arithmetic a beam is iterated in, cheapest first
+enum PrecisionTier {
+    PRECISION_DOUBLE = 0,
+    PRECISION_DOUBLE_DOUBLE,
+    PRECISION_MPFR,
+    PRECISION_PERTURBATION           // MPFR reference orbit, double offsets from it
+};
+static const char* const precision_tiers[] = { "double", "double-double", "MPFR", "perturbation" };
+
+// Bits kept on top of the dynamic range to absorb rounding error growth
+// along an orbit
+static const int PRECISION_GUARD_BITS = 8;
+
+// Smallest sigma exponent whose offsets a double still holds to 53 bits,
+// clear of the subnormals
+static const mpfr_exp_t PERTURBATION_MIN_EXP = -960;
+
+// How a beam draws its starting points
+enum SamplingMode {
+    SAMPLING_GAUSSIAN = 0,           // Independent draws from the Gaussian
+    SAMPLING_METROPOLIS              // Markov chain favouring points seen on the plates
+};
+static const char* const sampling_modes[] = { "Gaussian", "Metropolis-Hastings" };
+
+// Expected count a Metropolis step adds over all plates. A chain state whose
+// orbit lands g times in view deposits each of those points with weight
+// MH_STEP_WEIGHT / g, rounded stochastically, so the chain's preference for
+// bright seeds is divided out again.
+static const double MH_STEP_WEIGHT = 64.0;
+
+// Steps of one Metropolis chain. A fresh chain starts at every multiple of
+// this sample index, so where a run is split between workers does not
+// change what the chains do.
+static const int64_t MH_CHAIN_STEPS = 1024;
+
+// Half-open range [begin, end) of sample indices
+struct SampleRange {
+    int64_t begin, end;
+};
+
+struct PrecisionChoice {
+    PrecisionTier tier;
+    mpfr_prec_t bits;
+    PrecisionChoice() : tier(PRECISION_DOUBLE), bits(53) {}
+};
+
+// Beam class with Quaternion for mu and sigma
+// A beam is a 4D Gaussian cloud of starting points; each component of a
+// sample is drawn independently as mu + sigma * N(0, 1). Sample N is drawn
+// from a counter-based generator keyed by seed_start and N, so a run is
+// reproducible whatever the number of threads, and resuming only needs to
+// know which indices are done. When the engine finds the model and the
+// beam symmetric under flipping some components (see symmetric_axes),
+// sample N is instead draw N - N % images with the flips picked by
+// N % images applied, so one orbit serves `images` samples.
+//
+// In Metropolis mode the beam runs Markov chains instead, whose
+// stationary density is the Gaussian times g, the number of orbit points
+// landing on the plates. A proposal is either a fresh Gaussian draw (with
+// probability mh_large_step) or the current seed moved by
+// sigma * N(0, 1) * s, with s log-uniform in [2^-24, 1] * mh_mutation.
+// Deposits are weighted by 1 / g so each step adds MH_STEP_WEIGHT on
+// average; the Gaussian draws also estimate E[g], so a chain of N steps is
+// worth N * MH_STEP_WEIGHT / E[g] plain Gaussian samples. Each chain covers
+// MH_CHAIN_STEPS sample indices.
+//
+// A sharded render runs `shards` processes, each sampling only its own
+// slice of the indices below samples_total (shard_range()); samples_current
+// and the pending ranges then count within that slice.
+class Beam {
+public:
+    Quaternion mu;                  // Quaternion for mu parameters
+    Quaternion sigma;               // Quaternion for sigma parameters
+    int64_t samples_total;
+    std::atomic<int64_t> samples_current; // Advanced by the sampling workers
+    std::string seed_start; // String seed
+    // Indices a stopped run left undone; all lie below samples_current plus
+    // their count, and everything above that was never handed out
+    std::vector<SampleRange> pending;
+    PrecisionChoice precision;      // Picked by the engine when sampling starts
+    int images;                     // Samples per orbit iterated, from the symmetry the engine found
+
+    SamplingMode mode;
+    double mh_large_step;           // Probability of an independent proposal
+    double mh_mutation;             // Largest small step, in units of sigma
+    int shard, shards;              // This process samples slice `shard` of `shards`
+    // Chain statistics, advanced by the sampling workers
+    std::atomic<int64_t> mh_proposals, mh_accepted;
+    std::atomic<int64_t> mh_large_steps, mh_large_hits; // Estimate of E[g] under the Gaussian
+
+    Beam() : samples_total(0), samples_current(0), seed_start(""), images(1), mode(SAMPLING_GAUSSIAN), mh_large_step(0.1), mh_mutation(0.05),
+        shard(0), shards(1), mh_proposals(0), mh_accepted(0), mh_large_steps(0), mh_large_hits(0) {
+        // initialize quaternion variables
+        mpfr_set_d(mu.r, 0.0, MPFR_RNDN);
+        mpfr_set_d(mu.i, 0.0, MPFR_RNDN);
+        mpfr_set_d(mu.j, 0.0, MPFR_RNDN);
+        mpfr_set_d(mu.k, 0.0, MPFR_RNDN);
+
+        mpfr_set_d(sigma.r, 0.0, MPFR_RNDN);
+        mpfr_set_d(sigma.i, 0.0, MPFR_RNDN);
+        mpfr_set_d(sigma.j, 0.0, MPFR_RNDN);
+        mpfr_set_d(sigma.k, 0.0, MPFR_RNDN);
+    }
+
+    ~Beam() {
+        // Destructor to clean up if needed
+    }
+
+    double acceptance_rate() const {
+        int64_t p = mh_proposals.load(std::memory_order_relaxed);
+        return p ? (double)mh_accepted.load(std::memory_order_relaxed) / p : 0.0;
+    }
+
+    // Plain Gaussian samples this beam's deposits are worth so far
+    double effective_samples() const {
+        double n = (double)samples_current.load(std::memory_order_relaxed);
+        if (mode == SAMPLING_GAUSSIAN)
+            return n;
+        int64_t large = mh_large_steps.load(std::memory_order_relaxed);
+        int64_t hits = mh_large_hits.load(std::memory_order_relaxed);
+        if (large == 0 || hits == 0)
+            return 0.0;
+        return n * MH_STEP_WEIGHT / ((double)hits / large);
+    }
+
+    int64_t samples_remaining() const {
+        SampleRange slice = shard_range();
+        int64_t left = slice.end - slice.begin - samples_current.load(std::memory_order_relaxed);
+        return left > 0 ? left : 0;
+    }
+
+    // Start of slice i of `shards`: the indices below samples_total cut
+    // into nearly equal runs, rounded up to whole Metropolis chains
+    int64_t shard_cut(int i) const {
+        if (i >= shards)
+            return samples_total;
+        int64_t cut = samples_total / shards * i + samples_total % shards * i / shards;
+        int64_t grain = mode == SAMPLING_METROPOLIS ? MH_CHAIN_STEPS : 1;
+        return std::min((cut + grain - 1) / grain * grain, samples_total);
+    }
+
+    // Indices this process samples; all of them unless sharded
+    SampleRange shard_range() const {
+        SampleRange slice = { shard_cut(shard), shard_cut(shard + 1) };
+        return slice;
+    }
+
+    // Key of the sample generator
+    uint64_t seed_key() const {
+        return prng_key(seed_start);
+    }
+
+    // Indices still to sample, in order: what a stopped run left, then
+    // everything never handed out, up to the end of the slice
+    void unsampled(std::vector<SampleRange>& out) const {
+        out.clear();
+        SampleRange slice = shard_range();
+        int64_t issued = slice.begin + samples_current.load();
+        for (size_t r = 0; r < pending.size(); r++)
+            issued += pending[r].end - pending[r].begin;
+        for (size_t r = 0; r < pending.size(); r++) {
+            SampleRange c = pending[r];
+            c.end = std::min(c.end, slice.end);
+            if (c.end > c.begin)
+                out.push_back(c);
+        }
+        if (issued < slice.end) {
+            SampleRange tail = { issued, slice.end };
+            out.push_back(tail);
+        }
+    }
+
+    // Components whose sign flip leaves the distribution of samples as it
+    // is: zero mean and some spread. Bit c for component c of (r, i, j, k).
+    unsigned symmetric_axes() const {
+        mpfr_srcptr m[4] = { mu.r, mu.i, mu.j, mu.k };
+        mpfr_srcptr s[4] = { sigma.r, sigma.i, sigma.j, sigma.k };
+        unsigned axes = 0;
+        for (int c = 0; c < 4; c++)
+            if (mpfr_zero_p(m[c]) && !mpfr_zero_p(s[c]))
+                axes |= 1u << c;
+        return axes;
+    }
+
+    // Cheapest arithmetic that still resolves this beam. pixel_exp is log2
+    // of the finest plate pixel in sample space. The dynamic range runs from
+    // the largest coordinate a sample reaches (mu, a few sigma, and the
+    // [-2, 2] box where orbits live) down to a fraction of the smaller of
+    // sigma and the pixel size.
+    //
+    // With `perturbation` (the model allows it), a beam that needs MPFR only
+    // because sigma is tiny, while the plates are coarse enough for a
+    // double, is iterated as double offsets from an MPFR orbit of mu.
+    PrecisionChoice choose_precision(mpfr_exp_t pixel_exp, bool perturbation = false) const {
+        mpfr_srcptr m[4] = { mu.r, mu.i, mu.j, mu.k };
+        mpfr_srcptr s[4] = { sigma.r, sigma.i, sigma.j, sigma.k };
+        mpfr_exp_t hi = 2;
+        mpfr_exp_t lo = pixel_exp - 4;
+        mpfr_exp_t sigma_lo = 0;
+        for (int c = 0; c < 4; c++) {
+            if (mpfr_regular_p(m[c]) && mpfr_get_exp(m[c]) > hi)
+                hi = mpfr_get_exp(m[c]);
+            if (mpfr_regular_p(s[c])) {
+                if (mpfr_get_exp(s[c]) + 2 > hi)
+                    hi = mpfr_get_exp(s[c]) + 2;
+                if (mpfr_get_exp(s[c]) - 4 < lo)
+                    lo = mpfr_get_exp(s[c]) - 4;
+                sigma_lo = std::min(sigma_lo, mpfr_get_exp(s[c]));
+            }
+        }
+
+        PrecisionChoice choice;
+        choice.bits = (mpfr_prec_t)(hi - lo) + PRECISION_GUARD_BITS;
+        if (choice.bits <= 53) {
+            choice.tier = PRECISION_DOUBLE;
+            choice.bits = 53;
+        } else if (choice.bits <= 104) {
+            choice.tier = PRECISION_DOUBLE_DOUBLE;
+            choice.bits = 106;
+        } else {
+            choice.tier = PRECISION_MPFR;
+            choice.bits = (choice.bits + 63) / 64 * 64;
+            if (perturbation && hi - (pixel_exp - 4) + PRECISION_GUARD_BITS <= 53 && sigma_lo >= PERTURBATION_MIN_EXP)
+                choice.tier = PRECISION_PERTURBATION;
+        }
+        return choice;
+    }
+
+    // log of the Gaussian density at c, up to a constant; t is scratch at
+    // c's precision or more. Components with zero sigma are left out.
+    double log_prior(const Quaternion& c, mpfr_t t) const {
+        mpfr_srcptr cs[4] = { c.r, c.i, c.j, c.k };
+        mpfr_srcptr m[4] = { mu.r, mu.i, mu.j, mu.k };
+        mpfr_srcptr s[4] = { sigma.r, sigma.i, sigma.j, sigma.k };
+        double sum = 0.0;
+        for (int k = 0; k < 4; k++) {
+            if (mpfr_zero_p(s[k]))
+                continue;
+            mpfr_sub(t, cs[k], m[k], MPFR_RNDN);
+            mpfr_div(t, t, s[k], MPFR_RNDN);
+            double d = mpfr_get_d(t, MPFR_RNDN);
+            sum += d * d;
+        }
+        return -0.5 * sum;
+    }
+
+    // out = c + scale * sigma * N(0, 1), the symmetric small step of the
+    // Metropolis chain. `out` must not alias `c`.
+    void mutate(Quaternion& out, const Quaternion& c, double scale, CounterRng& rng) const {
+        mpfr_set_d(out.r, scale * rng.normal(), MPFR_RNDN);
+        mpfr_set_d(out.i, scale * rng.normal(), MPFR_RNDN);
+        mpfr_set_d(out.j, scale * rng.normal(), MPFR_RNDN);
+        mpfr_set_d(out.k, scale * rng.normal(), MPFR_RNDN);
+
+        mpfr_fma(out.r, out.r, sigma.r, c.r, MPFR_RNDN);
+        mpfr_fma(out.i, out.i, sigma.i, c.i, MPFR_RNDN);
+        mpfr_fma(out.j, out.j, sigma.j, c.j, MPFR_RNDN);
+        mpfr_fma(out.k, out.k, sigma.k, c.k, MPFR_RNDN);
+    }
+
+    // Draw one sample into `out`. This only reads mu and sigma and is safe
+    // to call from several threads. The normal deviates are doubles: sigma
+    // times 53 bits already resolves far below a pixel.
+    void get_sample(Quaternion& out, CounterRng& rng) const {
+        mpfr_set_d(out.r, rng.normal(), MPFR_RNDN);
+        mpfr_set_d(out.i, rng.normal(), MPFR_RNDN);
+        mpfr_set_d(out.j, rng.normal(), MPFR_RNDN);
+        mpfr_set_d(out.k, rng.normal(), MPFR_RNDN);
+
+        mpfr_fma(out.r, out.r, sigma.r, mu.r, MPFR_RNDN);
+        mpfr_fma(out.i, out.i, sigma.i, mu.i, MPFR_RNDN);
+        mpfr_fma(out.j, out.j, sigma.j, mu.j, MPFR_RNDN);
+        mpfr_fma(out.k, out.k, sigma.k, mu.k, MPFR_RNDN);
+    }
+
+    // Same in double form, for the double tier: the same draws, with mu and
+    // sigma rounded to double
+    void get_sample(double out[4], CounterRng& rng) const {
+        mpfr_srcptr m[4] = { mu.r, mu.i, mu.j, mu.k };
+        mpfr_srcptr s[4] = { sigma.r, sigma.i, sigma.j, sigma.k };
+        for (int c = 0; c < 4; c++) {
+            double n = rng.normal();
+            out[c] = fma(n, mpfr_get_d(s[c], MPFR_RNDN), mpfr_get_d(m[c], MPFR_RNDN));
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,382 @@
+// Microbenchmarks of the sampling hot paths: quaternion square-add per
+// backend, orbit iteration per model and through the batched escape
+// kernels, Gaussian sample generation, and
+// projection plus splat with 1..N threads. Results go to a JSON file, one
+// case per line, and can be compared against a stored baseline of the same
+// format; any case slower than the tolerance fails the run.
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <gmp.h>
+#include <mpfr.h>
+
+#include "quaternion.hpp"
+#include "beam.hpp"
+#include "plate.hpp"
+#include "models.hpp"
+#include "simd.hpp"
+#include "prng.hpp"
+#include "tilecache.hpp"
+#include "telemetry.hpp"
+
+static const int BENCH_POINTS = 4096;        // Inputs per case, cycled through
+static const int BENCH_MAX_ITERATIONS = 256; // Per orbit
+static const double BENCH_R2 = 16.0;
+static const int BENCH_PLATE_SIZE = 1024;
+
+struct BenchResult {
+    std::string name;
+    double rate;
+    const char* unit;
+};
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -t N     most threads for the splat cases (default: all cores)\n"
+            "  -s SEC   time per case (default: 0.5)\n"
+            "  -f TEXT  only run cases whose name contains TEXT\n"
+            "  -o PATH  write the results to PATH (default: bench.json)\n"
+            "  -b PATH  compare against the results in PATH\n"
+            "  -x PCT   slowdown against the baseline that fails the run (default: 10)\n",
+            argv0);
+}
+
+static int64_t bench_ns = 500000000;
+static volatile double bench_sink;  // Keeps results the compiler would drop
+
+// Call step(), which returns the operations it did, until bench_ns have
+// passed; returns operations per second. The first call warms up.
+template <typename F>
+static double measure(F step) {
+    step();
+    int64_t ops = 0;
+    int64_t start = steady_ns(), now;
+    do {
+        ops += step();
+        now = steady_ns();
+    } while (now - start < bench_ns);
+    return ops * 1e9 / (double)(now - start);
+}
+
+// Points of a Gaussian around mu, the same on every run
+static void gaussian_points(std::vector<double>& out, double mu_r, double sigma, uint64_t index) {
+    CounterRng rng(prng_key("bench"), index);
+    out.resize(4 * BENCH_POINTS);
+    for (int p = 0; p < BENCH_POINTS; p++)
+        for (int c = 0; c < 4; c++)
+            out[4 * p + c] = (c == 0 ? mu_r : 0.0) + sigma * rng.normal();
+}
+
+// z <- z^2 + c and |z|^2 over backend B. c is inside the main cardioid,
+// so z stays bounded and never turns into infinities.
+template <typename B>
+static double bench_square_add(mpfr_prec_t prec) {
+    MpfrArena arena;
+    QuaternionT<B> z(prec, arena), c(prec, arena);
+    typename B::value t, u, norm;
+    B::init_pooled(t, prec, arena);
+    B::init_pooled(u, prec, arena);
+    B::init_pooled(norm, prec, arena);
+    B::set_d(c.r, -0.5);
+    B::set_d(c.i, 0.1);
+    B::set_d(c.j, 0.05);
+    B::set_d(c.k, 0.0);
+    quaternion_set_zero(z);
+    double sum = 0.0;
+    double rate = measure([&]() -> int64_t {
+        for (int n = 0; n < 1024; n++) {
+            quaternion_sqr(z, z, t, u);
+            quaternion_add(z, z, c);
+            quaternion_norm2(norm, z);
+        }
+        sum += B::get_d(norm);
+        return 1024;
+    });
+    bench_sink = sum;
+    return rate;
+}
+
+// Escape-time iteration of model M over backend B; returns iterations/s
+template <typename M, typename B>
+static double bench_orbits(mpfr_prec_t prec, const std::vector<double>& points) {
+    MpfrArena arena;
+    QuaternionT<B> z(prec, arena), c(prec, arena);
+    ModelScratch<B> ms(prec, arena);
+    typename B::value norm;
+    B::init_pooled(norm, prec, arena);
+    B::set_d(ms.julia_c.r, -0.8);
+    B::set_d(ms.julia_c.i, 0.156);
+    B::set_d(ms.julia_c.j, 0.0);
+    B::set_d(ms.julia_c.k, 0.0);
+    int next = 0;
+    return measure([&]() -> int64_t {
+        int64_t iterations = 0;
+        for (int s = 0; s < 64; s++) {
+            const double* p = &points[4 * next];
+            next = (next + 1) % BENCH_POINTS;
+            B::set_d(c.r, p[0]);
+            B::set_d(c.i, p[1]);
+            B::set_d(c.j, p[2]);
+            B::set_d(c.k, p[3]);
+            M::begin(z, c, ms);
+            int n = 1;
+            for (; n <= BENCH_MAX_ITERATIONS; n++) {
+                M::step(z, c, ms);
+                quaternion_norm2(norm, z);
+                if (M::template escaped<B>(norm, BENCH_R2))
+                    break;
+            }
+            iterations += n > BENCH_MAX_ITERATIONS ? BENCH_MAX_ITERATIONS : n;
+        }
+        return iterations;
+    });
+}
+
+struct OrbitCases {
+    const std::vector<double>* points;
+    double rate;
+    template <typename M> void run() {
+        rate = bench_orbits<M, DoubleBackend>(53, *points);
+    }
+};
+
+// Escape times of z^2 + c through a batched kernel, as the engine runs
+// the double tier, BENCH_POINTS lanes per call; returns iterations/s
+static double bench_escape_kernel(EscapeKernelFn kernel, const std::vector<double>& points) {
+    std::vector<double> cr(BENCH_POINTS), ci(BENCH_POINTS), cj(BENCH_POINTS), ck(BENCH_POINTS);
+    std::vector<int> out(BENCH_POINTS);
+    for (int p = 0; p < BENCH_POINTS; p++) {
+        cr[p] = points[4 * p];
+        ci[p] = points[4 * p + 1];
+        cj[p] = points[4 * p + 2];
+        ck[p] = points[4 * p + 3];
+    }
+    const double cycle_tol = ldexp(MandelbrotModel::cycle_ulps, -53);
+    int64_t sum = 0;
+    double rate = measure([&]() -> int64_t {
+        int64_t iterations = kernel(&cr[0], &ci[0], &cj[0], &ck[0], BENCH_POINTS, BENCH_MAX_ITERATIONS, BENCH_R2, cycle_tol, &out[0]);
+        sum += out[0];
+        return iterations;
+    });
+    bench_sink = (double)sum;
+    return rate;
+}
+
+// Gaussian draws of a beam into a sample of `bits`, or into doubles at 0
+static double bench_samples(const Beam& beam, mpfr_prec_t bits) {
+    uint64_t key = prng_key(beam.seed_start);
+    int64_t s = 0;
+    if (bits == 0) {
+        double out[4];
+        return measure([&]() -> int64_t {
+            for (int n = 0; n < 1024; n++) {
+                CounterRng rng(key, (uint64_t)s++);
+                beam.get_sample(out, rng);
+            }
+            return 1024;
+        });
+    }
+    Quaternion out(bits);
+    return measure([&]() -> int64_t {
+        for (int n = 0; n < 1024; n++) {
+            CounterRng rng(key, (uint64_t)s++);
+            beam.get_sample(out, rng);
+        }
+        return 1024;
+    });
+}
+
+// Every thread projects its own points onto all plates through its own
+// tile cache, as the workers do; returns points per second over all threads
+static double bench_splat(const std::vector<Plate*>& plates, int threads) {
+    std::vector<std::unique_ptr<PixelTransform> > views;
+    std::vector<const PixelTransform*> view_ptrs;
+    for (size_t p = 0; p < plates.size(); p++) {
+        views.push_back(std::unique_ptr<PixelTransform>(new PixelTransform(53)));
+        plates[p]->pixel_transform(*views.back());
+        view_ptrs.push_back(views.back().get());
+    }
+    std::vector<int64_t> done(threads, 0);
+    std::vector<std::thread> pool;
+    int64_t start = steady_ns();
+    int64_t deadline = start + bench_ns;
+    for (int t = 0; t < threads; t++) {
+        pool.push_back(std::thread([&plates, &view_ptrs, &done, t, deadline]() {
+            MpfrArena arena;
+            PlateProjections<DoubleBackend> proj(view_ptrs, 53, arena);
+            TileCache cache(plates, 1 << 20, 250);
+            QuaternionT<DoubleBackend> z(53, arena);
+            std::vector<double> points;
+            gaussian_points(points, -0.5, 0.7, (uint64_t)t);
+            int64_t n = 0;
+            while (steady_ns() < deadline) {
+                for (int p = 0; p < BENCH_POINTS; p++) {
+                    z.set(points[4 * p], points[4 * p + 1], points[4 * p + 2], points[4 * p + 3]);
+                    proj.project(z, [&cache](uint32_t plate, int x, int y) { cache.deposit(plate, x, y); });
+                    cache.maybe_flush();
+                }
+                n += BENCH_POINTS;
+            }
+            cache.flush_all();
+            done[t] = n;
+        }));
+    }
+    int64_t total = 0;
+    for (int t = 0; t < threads; t++) {
+        pool[t].join();
+        total += done[t];
+    }
+    return total * 1e9 / (double)(steady_ns() - start);
+}
+
+static void write_results(FILE* f, const std::vector<BenchResult>& results) {
+    fprintf(f, "{\"bench\":[\n");
+    for (size_t r = 0; r < results.size(); r++)
+        fprintf(f, "{\"name\":\"%s\",\"rate\":%.6g,\"unit\":\"%s\"}%s\n",
+                results[r].name.c_str(), results[r].rate, results[r].unit, r + 1 < results.size() ? "," : "");
+    fprintf(f, "]}\n");
+}
+
+// Reads back what write_results() wrote
+static bool read_baseline(const char* path, std::map<std::string, double>& out) {
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return false;
+    char line[512], name[256];
+    double rate;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "{\"name\":\"%255[^\"]\",\"rate\":%lf", name, &rate) == 2)
+            out[name] = rate;
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = (int)std::thread::hardware_concurrency();
+    std::string filter, out_path = "bench.json", baseline_path;
+    double tolerance = 10.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:f:o:b:x:h")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 's': bench_ns = (int64_t)(atof(optarg) * 1e9); break;
+        case 'f': filter = optarg; break;
+        case 'o': out_path = optarg; break;
+        case 'b': baseline_path = optarg; break;
+        case 'x': tolerance = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (max_threads < 1)
+        max_threads = 1;
+
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty() && !read_baseline(baseline_path.c_str(), baseline)) {
+        fprintf(stderr, "%s: cannot open\n", baseline_path.c_str());
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    int regressions = 0;
+    auto run = [&](const std::string& name, const char* unit, std::function<double()> f) {
+        if (!filter.empty() && name.find(filter) == std::string::npos)
+            return;
+        BenchResult r = { name, f(), unit };
+        results.push_back(r);
+        std::map<std::string, double>::const_iterator b = baseline.find(name);
+        if (b == baseline.end() || b->second <= 0.0) {
+            fprintf(stderr, "%-36s %12.4g %s\n", name.c_str(), r.rate, unit);
+            return;
+        }
+        double change = 100.0 * (r.rate / b->second - 1.0);
+        bool slower = change < -tolerance;
+        regressions += slower;
+        fprintf(stderr, "%-36s %12.4g %s  %+6.1f%%%s\n", name.c_str(), r.rate, unit, change, slower ? "  REGRESSION" : "");
+    };
+
+    run("quaternion/sqr_add/double", "ops/s", []() { return bench_square_add<DoubleBackend>(53); });
+    run("quaternion/sqr_add/double-double", "ops/s", []() { return bench_square_add<DoubleDoubleBackend>(106); });
+    static const int mpfr_bits[] = { 64, 128, 256, 512, 1024 };
+    for (int p = 0; p < 5; p++) {
+        int bits = mpfr_bits[p];
+        run("quaternion/sqr_add/mpfr-" + std::to_string(bits), "ops/s", [bits]() { return bench_square_add<MpfrBackend>(bits); });
+    }
+
+    std::vector<double> points;
+    gaussian_points(points, -0.5, 1.0, 0);
+    for (int m = 0; m < MODEL_COUNT; m++) {
+        // Quadratic is Mandelbrot again
+        if (!model_supported(m) || m == MODEL_QUADRATIC)
+            continue;
+        run(std::string("orbit/") + models[m] + "/double", "iterations/s", [m, &points]() {
+            OrbitCases v = { &points, 0.0 };
+            model_dispatch(m, v);
+            return v.rate;
+        });
+    }
+    // The kernel the engine picks for this CPU, and the scalar one it
+    // falls back to
+    run("orbit/Mandelbrot/kernel", "iterations/s", [&points]() { return bench_escape_kernel(escape_kernel().run, points); });
+    run("orbit/Mandelbrot/kernel-scalar", "iterations/s", [&points]() { return bench_escape_kernel(escape_kernel_scalar, points); });
+    run("orbit/Mandelbrot/double-double", "iterations/s", [&points]() { return bench_orbits<MandelbrotModel, DoubleDoubleBackend>(106, points); });
+    run("orbit/Mandelbrot/mpfr-128", "iterations/s", [&points]() { return bench_orbits<MandelbrotModel, MpfrBackend>(128, points); });
+
+    Beam beam;
+    beam.seed_start = "bench";
+    beam.mu.set("-0.5", "0", "0", "0");
+    beam.sigma.set("1", "1", "0.5", "0.5");
+    run("sample/gaussian/double", "samples/s", [&beam]() { return bench_samples(beam, 0); });
+    run("sample/gaussian/mpfr-128", "samples/s", [&beam]() { return bench_samples(beam, 128); });
+    run("sample/gaussian/mpfr-1024", "samples/s", [&beam]() { return bench_samples(beam, 1024); });
+
+    Plate rows(BENCH_PLATE_SIZE, BENCH_PLATE_SIZE), curve(BENCH_PLATE_SIZE, BENCH_PLATE_SIZE, true);
+    std::vector<Plate*> plates;
+    plates.push_back(&rows);
+    plates.push_back(&curve);
+    for (int t = 1; ; t *= 2) {
+        int threads = std::min(t, max_threads);
+        run("splat/threads-" + std::to_string(threads), "points/s", [&plates, threads]() { return bench_splat(plates, threads); });
+        if (threads == max_threads)
+            break;
+    }
+    Plate sparse_rows(BENCH_PLATE_SIZE, BENCH_PLATE_SIZE, false, true), sparse_curve(BENCH_PLATE_SIZE, BENCH_PLATE_SIZE, true, true);
+    std::vector<Plate*> sparse_plates;
+    sparse_plates.push_back(&sparse_rows);
+    sparse_plates.push_back(&sparse_curve);
+    for (int t = 1; ; t *= 2) {
+        int threads = std::min(t, max_threads);
+        run("splat/sparse/threads-" + std::to_string(threads), "points/s", [&sparse_plates, threads]() { return bench_splat(sparse_plates, threads); });
+        if (threads == max_threads)
+            break;
+    }
+
+    FILE* f = fopen(out_path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "%s: cannot open\n", out_path.c_str());
+        return 1;
+    }
+    write_results(f, results);
+    fclose(f);
+    fprintf(stderr, "Wrote %s\n", out_path.c_str());
+    if (regressions) {
+        fprintf(stderr, "%d cases more than %.0f%% slower than %s\n", regressions, tolerance, baseline_path.c_str());
+        return 1;
+    }
+    return 0;
+}
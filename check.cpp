@@ -0,0 +1,457 @@
+// Headless checks of what the renderer promises: the same plates whatever
+// the thread count, a run resumed from a checkpoint equal to one that was
+// never interrupted, merged shards equal to one process, and PNG and TIFF
+// exports that decode to the tone-mapped counts. Prints one line per check
+// and exits non-zero if any fails; `make check` runs it.
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <map>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gmp.h>
+#include <mpfr.h>
+
+#include "scene.hpp"
+#include "checkpoint.hpp"
+#include "shard.hpp"
+#include "export.hpp"
+
+// Small enough to run in a second or two on one core; a Gaussian and a
+// Metropolis beam, and a plate of every storage kind. The first plate is
+// one TIFF tile, the second two.
+static const char* CHECK_SCENE =
+    "max_iterations 200\n"
+    "beam\n"
+    "samples 400000\n"
+    "seed check\n"
+    "mu -0.5 0 0 0\n"
+    "sigma 1 1 0 0\n"
+    "beam\n"
+    "samples 40000\n"
+    "seed check-mh\n"
+    "mode metropolis\n"
+    "mu -0.5 0 0 0\n"
+    "sigma 1 1 0.2 0\n"
+    "plate\n"
+    "size 200 150\n"
+    "plate\n"
+    "size 400 256\n"
+    "colormap Viridis\n"
+    "tone sqrt\n"
+    "plate\n"
+    "size 300 300\n"
+    "morton 1\n"
+    "plate\n"
+    "size 640 480\n"
+    "sparse 1\n";
+
+static int failures = 0;
+
+static void report(bool ok, const char* name, const std::string& detail = std::string()) {
+    fprintf(stderr, "%s %s%s%s\n", ok ? "ok  " : "FAIL", name, detail.empty() ? "" : ": ", detail.c_str());
+    if (!ok)
+        failures++;
+}
+
+// FNV-1a over the size and the counts row by row, so tile order and
+// storage kind do not matter
+static uint64_t plate_hash(const Plate& plate) {
+    uint64_t h = 14695981039346656037ull;
+    std::vector<int64_t> row(plate.width);
+    int64_t size[2] = { plate.width, plate.height };
+    for (int y = -1; y < plate.height; y++) {
+        const int64_t* v = size;
+        size_t n = 2;
+        if (y >= 0) {
+            plate.read_row(y, &row[0]);
+            v = &row[0];
+            n = row.size();
+        }
+        const unsigned char* b = (const unsigned char*)v;
+        for (size_t i = 0; i < n * sizeof(int64_t); i++)
+            h = (h ^ b[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static std::vector<uint64_t> scene_hashes(const Scene& scene) {
+    std::vector<uint64_t> h;
+    for (size_t p = 0; p < scene.plates.size(); p++)
+        h.push_back(plate_hash(*scene.plates[p]));
+    return h;
+}
+
+static std::string hash_list(const std::vector<uint64_t>& h) {
+    std::string s;
+    for (size_t i = 0; i < h.size(); i++) {
+        char t[24];
+        snprintf(t, sizeof(t), "%s%016llx", i ? " " : "", (unsigned long long)h[i]);
+        s += t;
+    }
+    return s;
+}
+
+static std::string scene_path;
+
+static void load(Scene& scene, int threads) {
+    std::string error;
+    if (!load_scene(scene_path.c_str(), scene, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(2);
+    }
+    scene.settings.threads = threads;
+}
+
+static std::vector<Beam*> beams_of(const Scene& scene) {
+    std::vector<Beam*> v;
+    for (size_t b = 0; b < scene.beams.size(); b++)
+        v.push_back(scene.beams[b].get());
+    return v;
+}
+
+static std::vector<Plate*> plates_of(const Scene& scene) {
+    std::vector<Plate*> v;
+    for (size_t p = 0; p < scene.plates.size(); p++)
+        v.push_back(scene.plates[p].get());
+    return v;
+}
+
+// Sample what is left of every beam
+static void render(Scene& scene) {
+    Engine engine;
+    if (!engine.start(beams_of(scene), plates_of(scene), scene.settings))
+        return;
+    while (!engine.finished())
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    engine.stop();
+}
+
+static void check_threads(const std::vector<uint64_t>& reference) {
+    Scene scene;
+    load(scene, 8);
+    render(scene);
+    std::vector<uint64_t> h = scene_hashes(scene);
+    report(h == reference, "same plates on 1 and 8 threads", h == reference ? "" : hash_list(reference) + " vs " + hash_list(h));
+}
+
+// Checkpoint mid-run, sample on past it, then drop everything as a crash
+// would; a run resumed from the files must end where one run does
+static void check_resume(const std::vector<uint64_t>& reference, const std::string& dir) {
+    CheckpointFiles files(dir + "/resume");
+    std::string error;
+    bool interrupted;
+    {
+        Scene scene;
+        load(scene, 2);
+        std::vector<Beam*> beams = beams_of(scene);
+        std::vector<Plate*> plates = plates_of(scene);
+        Engine engine;
+        engine.start(beams, plates, scene.settings);
+        // The third checkpoint updates the first one's files in place
+        for (int c = 0; c < 3; c++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (!checkpoint(engine, beams, plates, scene.settings, files, error)) {
+                report(false, "resume from a checkpoint", error);
+                return;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        interrupted = engine.running() && !engine.finished();
+        engine.stop();
+    }
+    Scene scene;
+    load(scene, 2);
+    if (!resume_checkpoint(files, beams_of(scene), plates_of(scene), error)) {
+        report(false, "resume from a checkpoint", error);
+        return;
+    }
+    render(scene);
+    std::vector<uint64_t> h = scene_hashes(scene);
+    report(h == reference, "resume from a checkpoint",
+           h == reference ? (interrupted ? "" : "run ended before the crash, too fast to test") : hash_list(reference) + " vs " + hash_list(h));
+}
+
+static void check_shards(const std::vector<uint64_t>& reference, const std::string& dir) {
+    const int shards = 2;
+    std::string error;
+    std::vector<std::vector<std::string> > files(reference.size());
+    for (int s = 0; s < shards; s++) {
+        Scene scene;
+        load(scene, 2);
+        shard_scene(scene, s, shards);
+        render(scene);
+        for (size_t p = 0; p < scene.plates.size(); p++) {
+            files[p].push_back(dir + "/shard" + std::to_string(s) + "_" + std::to_string(p) + ".plate");
+            if (!scene.plates[p]->save_tiles(files[p].back().c_str(), error)) {
+                report(false, "merged shards equal one process", error);
+                return;
+            }
+        }
+    }
+    std::vector<uint64_t> h;
+    for (size_t p = 0; p < files.size(); p++) {
+        std::string merged = dir + "/merged_" + std::to_string(p) + ".plate";
+        Plate plate(1, 1);
+        if (!merge_shards(files[p], merged.c_str(), 2, error) || !plate.open_file(merged.c_str(), error)) {
+            report(false, "merged shards equal one process", error);
+            return;
+        }
+        h.push_back(plate_hash(plate));
+    }
+    report(h == reference, "merged shards equal one process", h == reference ? "" : hash_list(reference) + " vs " + hash_list(h));
+}
+
+static bool read_file(const std::string& path, std::vector<unsigned char>& out) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    out.clear();
+    unsigned char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        out.insert(out.end(), buffer, buffer + n);
+    fclose(f);
+    return true;
+}
+
+static uint32_t be32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// 16-bit RGB of a PNG as export_png() writes it: every chunk's CRC, the
+// zlib stream and the row filters are checked
+static bool decode_png(const std::vector<unsigned char>& f, int& w, int& h, std::vector<uint16_t>& rgb, std::string& why) {
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    if (f.size() < 8 || memcmp(&f[0], signature, 8) != 0) {
+        why = "no PNG signature";
+        return false;
+    }
+    std::vector<unsigned char> packed;
+    bool header = false, end = false;
+    for (size_t at = 8; !end;) {
+        if (at + 12 > f.size() || at + 12 + be32(&f[at]) > f.size()) {
+            why = "truncated chunk";
+            return false;
+        }
+        uint32_t n = be32(&f[at]);
+        const unsigned char* type = &f[at + 4];
+        const unsigned char* data = &f[at + 8];
+        if (crc32(crc32(0, Z_NULL, 0), type, n + 4) != be32(data + n)) {
+            why = "bad CRC";
+            return false;
+        }
+        if (memcmp(type, "IHDR", 4) == 0) {
+            w = (int)be32(data);
+            h = (int)be32(data + 4);
+            if (n != 13 || data[8] != 16 || data[9] != 2 || data[12] != 0) {
+                why = "not 16-bit RGB";
+                return false;
+            }
+            header = true;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            packed.insert(packed.end(), data, data + n);
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            end = true;
+        }
+        at += 12 + n;
+    }
+    if (!header) {
+        why = "no IHDR";
+        return false;
+    }
+    const size_t row_bytes = 1 + 6 * (size_t)w;
+    std::vector<unsigned char> raw((size_t)h * row_bytes + 1);
+    uLongf n = (uLongf)raw.size();
+    if (uncompress(&raw[0], &n, &packed[0], (uLong)packed.size()) != Z_OK || n != (uLongf)h * row_bytes) {
+        why = "bad zlib stream";
+        return false;
+    }
+    rgb.assign((size_t)w * h * 3, 0);
+    for (int y = 0; y < h; y++) {
+        unsigned char* row = &raw[y * row_bytes];
+        const unsigned char* up = y ? row - row_bytes : NULL;
+        for (size_t i = 1; i < row_bytes; i++) {
+            int a = i > 6 ? row[i - 6] : 0, b = up ? up[i] : 0, c = up && i > 6 ? up[i - 6] : 0;
+            switch (row[0]) {
+            case 0: break;
+            case 1: row[i] += a; break;
+            case 2: row[i] += b; break;
+            case 3: row[i] += (a + b) / 2; break;
+            case 4: {
+                int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                row[i] += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                break;
+            }
+            default:
+                why = "bad filter";
+                return false;
+            }
+        }
+        for (int i = 0; i < 3 * w; i++)
+            rgb[(size_t)y * 3 * w + i] = (uint16_t)(row[1 + 2 * i] << 8 | row[2 + 2 * i]);
+    }
+    return true;
+}
+
+// 16-bit RGB of a tiled classic TIFF as export_tiff() writes it; every
+// entry is read as the TIFF spec lays it out, values that fit in the
+// entry held there
+static bool decode_tiff(const std::vector<unsigned char>& f, int& w, int& h, std::vector<uint16_t>& rgb, std::string& why) {
+    if (f.size() < 8 || !((f[0] == 'I' && f[1] == 'I') || (f[0] == 'M' && f[1] == 'M'))) {
+        why = "no TIFF byte order";
+        return false;
+    }
+    const bool little = f[0] == 'I';
+    auto u16 = [&](size_t at) -> uint32_t {
+        return little ? f[at] | f[at + 1] << 8 : f[at] << 8 | f[at + 1];
+    };
+    auto u32 = [&](size_t at) -> uint32_t {
+        return little ? u16(at) | u16(at + 2) << 16 : u16(at) << 16 | u16(at + 2);
+    };
+    if (u16(2) != 42) {
+        why = "not a classic TIFF";
+        return false;
+    }
+    size_t ifd = u32(4);
+    if (ifd + 2 > f.size() || ifd + 2 + 12 * (size_t)u16(ifd) + 4 > f.size()) {
+        why = "directory past the end";
+        return false;
+    }
+    std::map<uint32_t, std::vector<uint32_t> > tags;
+    for (uint32_t i = 0, n = u16(ifd); i < n; i++) {
+        size_t e = ifd + 2 + 12 * i;
+        uint32_t tag = u16(e), type = u16(e + 2), count = u32(e + 4);
+        size_t size = type == 3 ? 2 : type == 4 ? 4 : 0;
+        if (!size) {
+            why = "tag " + std::to_string(tag) + " of unexpected type " + std::to_string(type);
+            return false;
+        }
+        size_t at = count * size <= 4 ? e + 8 : u32(e + 8);
+        if (at + count * size > f.size()) {
+            why = "tag " + std::to_string(tag) + " past the end";
+            return false;
+        }
+        for (uint32_t c = 0; c < count; c++)
+            tags[tag].push_back(size == 2 ? u16(at + 2 * c) : u32(at + 4 * c));
+    }
+    static const uint32_t needed[] = { 256, 257, 258, 259, 262, 277, 284, 322, 323, 324, 325 };
+    for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (tags[needed[i]].empty()) {
+            why = "no tag " + std::to_string(needed[i]);
+            return false;
+        }
+    }
+    w = (int)tags[256][0];
+    h = (int)tags[257][0];
+    const uint32_t tw = tags[322][0], th = tags[323][0];
+    if (tags[258] != std::vector<uint32_t>(3, 16) || tags[259][0] != 1 || tags[262][0] != 2 || tags[277][0] != 3 ||
+        tags[284][0] != 1 || tw == 0 || th == 0) {
+        why = "not uncompressed 16-bit RGB tiles";
+        return false;
+    }
+    const size_t across = (w + tw - 1) / tw, down = (h + th - 1) / th;
+    const std::vector<uint32_t>& offsets = tags[324];
+    const std::vector<uint32_t>& counts = tags[325];
+    if (offsets.size() != across * down || counts.size() != offsets.size()) {
+        why = std::to_string(offsets.size()) + " tile offsets for " + std::to_string(across * down) + " tiles";
+        return false;
+    }
+    for (size_t t = 0; t < offsets.size(); t++) {
+        if (counts[t] != tw * th * 6 || (size_t)offsets[t] + counts[t] > f.size()) {
+            why = "tile " + std::to_string(t) + " at " + std::to_string(offsets[t]) + ", " + std::to_string(counts[t]) + " bytes";
+            return false;
+        }
+    }
+    rgb.assign((size_t)w * h * 3, 0);
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            for (int k = 0; k < 3; k++)
+                rgb[((size_t)y * w + x) * 3 + k] =
+                    (uint16_t)u16(offsets[(y / th) * across + x / tw] + (((y % th) * tw + x % tw) * 3 + k) * 2);
+    return true;
+}
+
+// Export every plate as PNG and TIFF and decode the files back: they must
+// hold the counts as the plate's tone map colours them
+static void check_exports(const Scene& scene, const std::string& dir) {
+    for (int format = EXPORT_PNG; format <= EXPORT_TIFF; format++) {
+        std::string name = std::string(export_formats[format]) + " exports decode to the tone-mapped plates";
+        std::string why;
+        for (size_t p = 0; why.empty() && p < scene.plates.size(); p++) {
+            const Plate& plate = *scene.plates[p];
+            std::string path = dir + "/export_" + std::to_string(p) + "." + export_extensions[format];
+            std::vector<unsigned char> file;
+            std::vector<uint16_t> rgb;
+            int w = 0, h = 0;
+            if (!export_plate(plate, plate.tone, path.c_str(), format, 2, why))
+                break;
+            if (!read_file(path, file) || !(format == EXPORT_PNG ? decode_png(file, w, h, rgb, why) : decode_tiff(file, w, h, rgb, why))) {
+                why = path + ": " + why;
+                break;
+            }
+            ToneStats stats;
+            plate_tone_stats(plate, 1, stats);
+            ToneMap tone;
+            tone.prepare(plate.tone, stats, true);
+            std::vector<int64_t> counts(plate.width);
+            std::vector<uint16_t> expected(3 * (size_t)plate.width);
+            bool same = w == plate.width && h == plate.height;
+            for (int y = 0; same && y < h; y++) {
+                plate.read_row(y, &counts[0]);
+                tone.map16(&counts[0], &expected[0], w);
+                same = memcmp(&expected[0], &rgb[(size_t)y * 3 * w], expected.size() * sizeof(uint16_t)) == 0;
+            }
+            if (!same)
+                why = path + ": pixels differ from the plate";
+        }
+        report(why.empty(), name.c_str(), why);
+    }
+}
+
+static void remove_dir(const std::string& dir) {
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return;
+    while (struct dirent* e = readdir(d))
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            remove((dir + "/" + e->d_name).c_str());
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+int main() {
+    const char* tmp = getenv("TMPDIR");
+    std::string pattern = std::string(tmp && *tmp ? tmp : "/tmp") + "/rainbrot9-check-XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    if (!mkdtemp(&name[0])) {
+        fprintf(stderr, "%s: cannot create\n", pattern.c_str());
+        return 2;
+    }
+    std::string dir = &name[0];
+    scene_path = dir + "/check.scene";
+    FILE* f = fopen(scene_path.c_str(), "w");
+    if (!f || fputs(CHECK_SCENE, f) < 0 || fclose(f) != 0) {
+        fprintf(stderr, "%s: cannot write\n", scene_path.c_str());
+        return 2;
+    }
+
+    Scene scene;
+    load(scene, 1);
+    render(scene);
+    std::vector<uint64_t> reference = scene_hashes(scene);
+
+    check_threads(reference);
+    check_resume(reference, dir);
+    check_shards(reference, dir);
+    check_exports(scene, dir);
+
+    remove_dir(dir);
+    fprintf(stderr, "%d check%s failed\n", failures, failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,200 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "beam.hpp"
+#include "plate.hpp"
+#include "engine.hpp"
+
+// Sampling progress of every beam, kept next to the checkpointed plates.
+// With counter-based samples the generator position is just the set of
+// indices done: samples_current and the pending ranges. After a header
+// naming the generation of plate files that goes with it, one line per
+// beam:
+//
+//   beam <seed key> <samples_current> <mh_proposals> <mh_accepted>
+//        <mh_large_steps> <mh_large_hits> <pending count> <begin> <end> ...
+//
+// The file is written next to `path`, synced and renamed over it.
+inline bool save_progress(const char* path, const std::vector<Beam*>& beams, int generation, std::string& error) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        error = tmp + ": cannot create";
+        return false;
+    }
+    fprintf(f, "rainbrot9-progress 2 %zu %d\n", beams.size(), generation);
+    for (size_t b = 0; b < beams.size(); b++) {
+        const Beam* beam = beams[b];
+        fprintf(f, "beam %016" PRIx64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %zu",
+                beam->seed_key(), beam->samples_current.load(), beam->mh_proposals.load(), beam->mh_accepted.load(),
+                beam->mh_large_steps.load(), beam->mh_large_hits.load(), beam->pending.size());
+        for (size_t r = 0; r < beam->pending.size(); r++)
+            fprintf(f, " %" PRId64 " %" PRId64, beam->pending[r].begin, beam->pending[r].end);
+        fprintf(f, "\n");
+    }
+    bool ok = fflush(f) == 0 && !ferror(f);
+#ifndef _WIN32
+    ok = ok && fsync(fileno(f)) == 0;
+#endif
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    remove(path);
+#endif
+    if (ok)
+        ok = rename(tmp.c_str(), path) == 0;
+    if (!ok) {
+        remove(tmp.c_str());
+        error = std::string(path) + ": cannot write";
+    }
+#ifndef _WIN32
+    // The rename itself lasts once the directory is synced
+    std::string dir = path;
+    size_t slash = dir.find_last_of('/');
+    dir = slash == std::string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash);
+    int fd = ok ? open(dir.c_str(), O_RDONLY) : -1;
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+    return ok;
+}
+
+// Restore what save_progress() wrote. The beams must be the same, in the
+// same order, with the same seeds.
+inline bool load_progress(const char* path, const std::vector<Beam*>& beams, int& generation, std::string& error) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        error = std::string(path) + ": cannot open";
+        return false;
+    }
+    size_t count = 0;
+    bool ok = fscanf(f, "rainbrot9-progress 2 %zu %d", &count, &generation) == 2 && count == beams.size() &&
+              (generation == 0 || generation == 1);
+    if (!ok)
+        error = std::string(path) + ": not a progress file for " + std::to_string(beams.size()) + " beams";
+    for (size_t b = 0; ok && b < beams.size(); b++) {
+        uint64_t key;
+        int64_t current, proposals, accepted, large_steps, large_hits;
+        size_t pending;
+        ok = fscanf(f, " beam %" SCNx64 " %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNd64 " %zu",
+                    &key, &current, &proposals, &accepted, &large_steps, &large_hits, &pending) == 7;
+        if (ok && key != beams[b]->seed_key()) {
+            error = std::string(path) + ": beam " + std::to_string(b) + " has another seed";
+            fclose(f);
+            return false;
+        }
+        std::vector<SampleRange> ranges;
+        for (size_t r = 0; ok && r < pending; r++) {
+            SampleRange s;
+            ok = fscanf(f, " %" SCNd64 " %" SCNd64, &s.begin, &s.end) == 2 && s.end >= s.begin;
+            ranges.push_back(s);
+        }
+        if (!ok) {
+            error = std::string(path) + ": bad line for beam " + std::to_string(b);
+            break;
+        }
+        beams[b]->samples_current.store(current);
+        beams[b]->mh_proposals.store(proposals);
+        beams[b]->mh_accepted.store(accepted);
+        beams[b]->mh_large_steps.store(large_steps);
+        beams[b]->mh_large_hits.store(large_hits);
+        beams[b]->pending = ranges;
+    }
+    fclose(f);
+    return ok;
+}
+
+// Where a checkpointed run keeps its state: PREFIX.progress and two
+// generations of plate files, PREFIX_i.0.plate and PREFIX_i.1.plate.
+// Checkpoints alternate between the generations and the progress file
+// names the last one written in full, so a crash while writing one leaves
+// the other, and the progress that goes with it, as they were. The plates
+// themselves stay in private memory; the files only ever hold what a
+// checkpoint wrote.
+struct CheckpointFiles {
+    std::string prefix;
+    int generation;                  // Of the last checkpoint, -1 before the first
+    bool current[2];                 // Generation g's files hold the counts of its last checkpoint
+
+    explicit CheckpointFiles(const std::string& path_prefix) : prefix(path_prefix), generation(-1) {
+        current[0] = current[1] = false;
+    }
+
+    std::string progress_path() const {
+        return prefix + ".progress";
+    }
+
+    std::string plate_path(size_t plate, int g) const {
+        return prefix + "_" + std::to_string(plate) + "." + std::to_string(g) + ".plate";
+    }
+};
+
+// Take the plates and progress back from the last checkpoint in `files`.
+// Each plate is mapped copy-on-write from its file, which must match its
+// size and tile order.
+inline bool resume_checkpoint(CheckpointFiles& files, const std::vector<Beam*>& beams, const std::vector<Plate*>& plates,
+                              std::string& error) {
+    int g = -1;
+    if (!load_progress(files.progress_path().c_str(), beams, g, error))
+        return false;
+    for (size_t p = 0; p < plates.size(); p++) {
+        Plate& plate = *plates[p];
+        std::string path = files.plate_path(p, g);
+        int width = plate.width, height = plate.height;
+        bool morton = plate.morton;
+        ShardStamp stamp = plate.stamp;
+        if (!plate.open_file(path.c_str(), error))
+            return false;
+        if (plate.width != width || plate.height != height || (!plate.sparse && plate.morton != morton) ||
+            plate.stamp.scene_hash != stamp.scene_hash || plate.stamp.shard != stamp.shard || plate.stamp.shards != stamp.shards) {
+            error = path + ": not a plate file of this size, tile order and shard";
+            return false;
+        }
+        // The file of this generation holds every count now
+        for (int ty = 0; ty < plate.tiles_y(); ty++)
+            for (int tx = 0; tx < plate.tiles_x(); tx++)
+                plate.take_dirty(tx, ty, PLATE_DIRTY_CHECKPOINT << g);
+    }
+    files.generation = g;
+    files.current[g] = true;
+    files.current[1 - g] = false;
+    return true;
+}
+
+// Bring plates and progress on disk to the same point: stop the engine, so
+// every buffered hit is merged and every beam knows what is left, write
+// the tiles merged into since the other generation was written to its
+// files and sync them, then name that generation in the progress file,
+// and start again if the engine was running, whether or not the files
+// were written. A run resumed from the files carries on exactly from the
+// last checkpoint that succeeded, whenever it crashed.
+inline bool checkpoint(Engine& engine, const std::vector<Beam*>& beams, const std::vector<Plate*>& plates,
+                       const RenderSettings& settings, CheckpointFiles& files, std::string& error) {
+    bool was_running = engine.running() && !engine.finished();
+    engine.stop();
+    int g = files.generation == 0 ? 1 : 0;
+    bool ok = true;
+    for (size_t p = 0; ok && p < plates.size(); p++)
+        ok = plates[p]->write_tiles(files.plate_path(p, g).c_str(), PLATE_DIRTY_CHECKPOINT << g, files.current[g], error);
+    files.current[g] = ok;
+    if (ok && save_progress(files.progress_path().c_str(), beams, g, error))
+        files.generation = g;
+    else
+        ok = false;
+    if (was_running)
+        engine.start(beams, plates, settings);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,309 @@
+// Headless batch renderer: loads a scene, samples it to a sample or time
+// budget and writes the plates. Links no GUI libraries, so it runs on
+// machines without a display.
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+#include <gmp.h>
+#include <mpfr.h>
+
+#include "scene.hpp"
+#include "checkpoint.hpp"
+#include "export.hpp"
+#include "shard.hpp"
+
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_signal(int sig) {
+    stop_signal = sig;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] scene\n"
+            "The scene is a text scene or a binary one written by -s or the GUI.\n"
+            "  -t N     worker threads (default: all cores)\n"
+            "  -n N     samples per beam, overriding the scene\n"
+            "  -T SEC   stop after SEC seconds\n"
+            "  -o PATH  output prefix; plate i goes to PATH_i.rb9 (default: plate)\n"
+            "  -S I/N   render shard I of N, 0 <= I < N: sample slice I of every beam\n"
+            "           and write plate i to PATH_i.plate for rainbrot9-merge\n"
+            "  -s PATH  also save the scene with its progress and counts as a binary\n"
+            "           scene at PATH, which the GUI opens without reading the counts\n"
+            "  -e FMT   also export plate i as an image, PATH_i.png, .tif or .raw;\n"
+            "           FMT is png, tiff or raw\n"
+            "  -P       pin each worker thread to one CPU\n"
+            "  -R       with several NUMA nodes, give each node its own copy of every\n"
+            "           dense plate, merged into the plates at the end and at\n"
+            "           checkpoints\n"
+            "  -c SEC   checkpoint every SEC seconds: the plates to PATH_i.0.plate\n"
+            "           and PATH_i.1.plate in turn, the progress to PATH.progress\n"
+            "  -r       resume from the last checkpoint\n"
+            "  -m PATH  append telemetry to PATH as one JSON line per interval\n"
+            "           and a last one at the end; - is stdout\n"
+            "  -M SEC   telemetry interval (default: 1)\n"
+            "  -q       no progress reports\n"
+            "SIGINT or SIGTERM stops sampling and writes what is there.\n",
+            argv0);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+static bool write_plates(const Scene& scene, const std::string& prefix) {
+    bool ok = true;
+    for (size_t p = 0; p < scene.plates.size(); p++) {
+        std::string path = prefix + "_" + std::to_string(p) + ".rb9";
+        if (scene.plates[p]->save(path.c_str())) {
+            fprintf(stderr, "Wrote %s (%dx%d, %.1f MB of counts)\n", path.c_str(), scene.plates[p]->width, scene.plates[p]->height,
+                    scene.plates[p]->memory() / 1048576.0);
+        } else {
+            fprintf(stderr, "Cannot write %s\n", path.c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static bool write_shards(const Scene& scene, const std::string& prefix) {
+    bool ok = true;
+    for (size_t p = 0; p < scene.plates.size(); p++) {
+        std::string path = prefix + "_" + std::to_string(p) + ".plate";
+        std::string error;
+        if (scene.plates[p]->save_tiles(path.c_str(), error)) {
+            fprintf(stderr, "Wrote shard %u of %u to %s\n", scene.plates[p]->stamp.shard, scene.plates[p]->stamp.shards, path.c_str());
+        } else {
+            fprintf(stderr, "Cannot write %s\n", error.c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static bool export_plates(const Scene& scene, const std::string& prefix, int format, int threads) {
+    bool ok = true;
+    for (size_t p = 0; p < scene.plates.size(); p++) {
+        std::string path = prefix + "_" + std::to_string(p) + "." + export_extensions[format];
+        std::string error;
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        if (export_plate(*scene.plates[p], scene.plates[p]->tone, path.c_str(), format, threads, error)) {
+            fprintf(stderr, "Exported %s in %.1fs\n", path.c_str(), seconds_since(started));
+        } else {
+            fprintf(stderr, "Cannot export %s: %s\n", path.c_str(), error.c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int threads = (int)std::thread::hardware_concurrency();
+    long long samples = -1;
+    double seconds = 0.0;
+    std::string prefix = "plate";
+    double checkpoint_every = 0.0;
+    bool resume = false;
+    bool quiet = false;
+    std::string metrics_path;
+    double metrics_every = 1.0;
+    int export_format = -1;
+    std::string scene_path;
+    int shard = 0, shards = 1;
+    bool pin_threads = false, node_replicas = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:T:o:S:s:e:PRc:rm:M:qh")) != -1) {
+        switch (opt) {
+        case 't': threads = atoi(optarg); break;
+        case 'n': samples = atoll(optarg); break;
+        case 'T': seconds = atof(optarg); break;
+        case 'o': prefix = optarg; break;
+        case 'S':
+            if (sscanf(optarg, "%d/%d", &shard, &shards) != 2 || shards < 1 || shard < 0 || shard >= shards) {
+                fprintf(stderr, "Bad shard %s, expected I/N with 0 <= I < N\n", optarg);
+                return 2;
+            }
+            break;
+        case 's': scene_path = optarg; break;
+        case 'e':
+            for (int f = 0; f < EXPORT_FORMAT_COUNT; f++)
+                if (strcasecmp(optarg, export_formats[f]) == 0 || strcasecmp(optarg, export_extensions[f]) == 0)
+                    export_format = f;
+            if (export_format < 0) {
+                fprintf(stderr, "Unknown image format %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'P': pin_threads = true; break;
+        case 'R': node_replicas = true; break;
+        case 'c': checkpoint_every = atof(optarg); break;
+        case 'r': resume = true; break;
+        case 'm': metrics_path = optarg; break;
+        case 'M': metrics_every = atof(optarg); break;
+        case 'q': quiet = true; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (shards > 1 && !scene_path.empty()) {
+        fprintf(stderr, "A shard cannot be saved as a scene; merge the shards instead\n");
+        return 2;
+    }
+
+    Scene scene;
+    std::string error;
+    if (!load_scene(argv[optind], scene, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    if (scene.beams.empty() || scene.plates.empty()) {
+        fprintf(stderr, "%s: needs at least one beam and one plate\n", argv[optind]);
+        return 1;
+    }
+    if (!model_supported(scene.settings.model)) {
+        fprintf(stderr, "Model %s cannot be sampled yet\n", models[scene.settings.model]);
+        return 1;
+    }
+    scene.settings.threads = threads > 0 ? threads : 1;
+    scene.settings.pin_threads = pin_threads;
+    scene.settings.node_replicas = node_replicas;
+    if (samples >= 0)
+        for (size_t b = 0; b < scene.beams.size(); b++)
+            scene.beams[b]->samples_total = samples;
+    if (shards > 1)
+        shard_scene(scene, shard, shards);
+
+    std::vector<Beam*> run_beams;
+    for (size_t b = 0; b < scene.beams.size(); b++)
+        run_beams.push_back(scene.beams[b].get());
+    std::vector<Plate*> run_plates;
+    for (size_t p = 0; p < scene.plates.size(); p++)
+        run_plates.push_back(scene.plates[p].get());
+
+    bool checkpointed = checkpoint_every > 0.0 || resume;
+    CheckpointFiles checkpoint_files(prefix);
+    if (resume && !resume_checkpoint(checkpoint_files, run_beams, run_plates, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    FILE* metrics = NULL;
+    if (metrics_path == "-") {
+        metrics = stdout;
+    } else if (!metrics_path.empty()) {
+        metrics = fopen(metrics_path.c_str(), "a");
+        if (!metrics) {
+            fprintf(stderr, "%s: cannot open\n", metrics_path.c_str());
+            return 1;
+        }
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    // A resumed run with nothing left was stopped after its last
+    // checkpoint, before or after its outputs; it writes them again
+    Engine engine;
+    bool sampling = engine.start(run_beams, run_plates, scene.settings);
+    if (!sampling && !resume) {
+        fprintf(stderr, "Nothing to sample\n");
+        return 1;
+    }
+    if (!sampling && !quiet)
+        fprintf(stderr, "Nothing left to sample\n");
+    if (sampling && !quiet && (pin_threads || node_replicas)) {
+        const NumaTopology& topology = numa_topology();
+        for (size_t n = 0; n < topology.nodes.size(); n++)
+            fprintf(stderr, "NUMA node %d%s: CPUs %s, %.1f GB\n", topology.nodes[n].id, topology.from_sys ? "" : " (no topology in /sys)",
+                    format_cpulist(topology.nodes[n].cpus).c_str(), topology.nodes[n].memory / 1073741824.0);
+        if (engine.replica_memory())
+            fprintf(stderr, "Node replicas: %.1f MB\n", engine.replica_memory() / 1048576.0);
+    }
+    if (sampling && !quiet)
+        fprintf(stderr, "Sampling %zu beams onto %zu plates with %d threads, %s kernel%s\n",
+                run_beams.size(), run_plates.size(), scene.settings.threads, escape_kernel().name,
+                shards > 1 ? (", shard " + std::to_string(shard) + " of " + std::to_string(shards)).c_str() : "");
+
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    double last_report = 0.0, last_checkpoint = 0.0, last_metrics_at = 0.0;
+    TelemetrySnapshot last_metrics;
+    while (engine.running() && !engine.finished() && !stop_signal) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        double elapsed = seconds_since(started);
+        if (seconds > 0.0 && elapsed >= seconds)
+            break;
+        if (checkpoint_every > 0.0 && elapsed - last_checkpoint >= checkpoint_every) {
+            last_checkpoint = elapsed;
+            if (!checkpoint(engine, run_beams, run_plates, scene.settings, checkpoint_files, error))
+                fprintf(stderr, "Checkpoint failed: %s\n", error.c_str());
+        }
+        if (metrics && elapsed - last_metrics_at >= metrics_every) {
+            last_metrics_at = elapsed;
+            TelemetrySnapshot now;
+            engine.telemetry(now);
+            telemetry_json(metrics, last_metrics, now);
+            fflush(metrics);
+            last_metrics = now;
+        }
+        if (!quiet && elapsed - last_report >= 10.0) {
+            last_report = elapsed;
+            int64_t done = 0, total = 0;
+            for (size_t b = 0; b < run_beams.size(); b++) {
+                done += run_beams[b]->samples_current.load();
+                SampleRange slice = run_beams[b]->shard_range();
+                total += slice.end - slice.begin;
+            }
+            fprintf(stderr, "%.0fs: %lld / %lld samples\n", elapsed, (long long)done, (long long)total);
+        }
+    }
+    // Joins the workers, which flush their buffers into the plates
+    engine.stop();
+    if (metrics) {
+        TelemetrySnapshot now;
+        engine.telemetry(now);
+        telemetry_json(metrics, last_metrics, now);
+        if (metrics != stdout)
+            fclose(metrics);
+        else
+            fflush(metrics);
+    }
+    if (sampling && !quiet) {
+        RejectStats r = engine.rejects();
+        fprintf(stderr, "Stopped after %.1fs%s; bounded: cardioid %lld, bulb %lld, cycle %lld, max iterations %lld\n",
+                seconds_since(started), stop_signal ? " by signal" : "",
+                (long long)r.cardioid, (long long)r.bulb, (long long)r.cycle, (long long)r.max_iterations);
+    }
+
+    if (checkpointed) {
+        if (!checkpoint(engine, run_beams, run_plates, scene.settings, checkpoint_files, error)) {
+            fprintf(stderr, "Checkpoint failed: %s\n", error.c_str());
+            return 1;
+        }
+        if (!quiet)
+            fprintf(stderr, "Checkpointed to %s\n", checkpoint_files.progress_path().c_str());
+    }
+    if (shards > 1 ? !write_shards(scene, prefix) : !write_plates(scene, prefix))
+        return 1;
+    if (!scene_path.empty()) {
+        if (!save_scene_file(scene_path.c_str(), scene.settings, scene.beams, scene.plates, error)) {
+            fprintf(stderr, "Cannot save the scene: %s\n", error.c_str());
+            return 1;
+        }
+        if (!quiet)
+            fprintf(stderr, "Saved %s\n", scene_path.c_str());
+    }
+    if (export_format >= 0 && !export_plates(scene, prefix, export_format, scene.settings.threads))
+        return 1;
+    return stop_signal ? 128 + stop_signal : 0;
+}
@@ -0,0 +1,492 @@
+#ifndef COLORMAP_HPP
+#define COLORMAP_HPP
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include <stdint.h>
+
+#include "simd.hpp"
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Tone mapping: plate counts to RGBA. A curve (linear, log, sqrt or
+// histogram equalization) takes a count to t in [0, 1], scaled so that the
+// clip count (the max, or a percentile of the lit cells) is 1, and a
+// palette takes t to a colour. Both are folded into one table from count
+// to colour for the counts below TONE_LUT_SIZE, which covers nearly every
+// cell of a plate; larger counts go through the curve one by one.
+//
+// Statistics are a parallel reduction over the counts: the max and a
+// histogram, exact for small counts and in 16 steps per octave above, from
+// which the percentiles and the equalization curve are read.
+
+static const char* const colormaps[] = { "Rainbow", "Grayscale", "Hot", "Cool", "Spring", "Summer", "Autumn", "Winter", "Bone", "Copper", "Pink", "Jet", "Hsv", "Flag", "Prism", "Ocean", "Cubehelix", "Turbo", "Viridis", "Plasma", "Inferno", "Magma", "Cividis" };
+enum {
+    COLORMAP_RAINBOW, COLORMAP_GRAYSCALE, COLORMAP_HOT, COLORMAP_COOL, COLORMAP_SPRING, COLORMAP_SUMMER,
+    COLORMAP_AUTUMN, COLORMAP_WINTER, COLORMAP_BONE, COLORMAP_COPPER, COLORMAP_PINK, COLORMAP_JET, COLORMAP_HSV,
+    COLORMAP_FLAG, COLORMAP_PRISM, COLORMAP_OCEAN, COLORMAP_CUBEHELIX, COLORMAP_TURBO, COLORMAP_VIRIDIS,
+    COLORMAP_PLASMA, COLORMAP_INFERNO, COLORMAP_MAGMA, COLORMAP_CIVIDIS, COLORMAP_COUNT
+};
+
+enum ToneCurve { TONE_LINEAR, TONE_LOG, TONE_SQRT, TONE_EQUALIZE, TONE_CURVE_COUNT };
+static const char* const tone_curves[] = { "Linear", "Log", "Sqrt", "Equalize" };
+
+static const int PALETTE_SIZE = 4096;        // Colours per palette table
+static const int PALETTE16_SIZE = 65536;     // Colours per 16-bit palette table, for export
+static const int64_t TONE_LUT_SIZE = 1 << 16; // Counts looked up directly; also the exact histogram bins
+static const int TONE_OCTAVE_BINS = 16;      // Histogram bins per octave above TONE_LUT_SIZE
+static const int TONE_BINS = TONE_LUT_SIZE + (63 - 16 + 1) * TONE_OCTAVE_BINS;
+
+// How a plate's counts become colours
+struct ToneSettings {
+    int colormap;                    // Index into colormaps[]
+    int curve;                       // ToneCurve
+    float percentile;                // Of the lit cells, mapped to the top colour; 100 is the max
+
+    ToneSettings() : colormap(COLORMAP_GRAYSCALE), curve(TONE_LOG), percentile(100.0f) {}
+
+    bool operator==(const ToneSettings& o) const {
+        return colormap == o.colormap && curve == o.curve && percentile == o.percentile;
+    }
+    bool operator!=(const ToneSettings& o) const {
+        return !(*this == o);
+    }
+};
+
+inline double tone_clamp(double x) {
+    return x < 0.0 ? 0.0 : x > 1.0 ? 1.0 : x;
+}
+
+// c0 + t (c1 + t (c2 + ...)) per channel, for the polynomial fits below
+inline void tone_poly(const double c[][3], int n, double t, double rgb[3]) {
+    for (int k = 0; k < 3; k++) {
+        double v = c[n - 1][k];
+        for (int i = n - 2; i >= 0; i--)
+            v = v * t + c[i][k];
+        rgb[k] = v;
+    }
+}
+
+// Piecewise linear through `n` evenly spaced colours
+inline void tone_stops(const double c[][3], int n, double t, double rgb[3]) {
+    double x = t * (n - 1);
+    int i = std::min((int)x, n - 2);
+    double f = x - i;
+    for (int k = 0; k < 3; k++)
+        rgb[k] = c[i][k] + f * (c[i + 1][k] - c[i][k]);
+}
+
+// Colour of palette `map` at t in [0, 1]. The matplotlib/gnuplot palettes
+// use their defining formulas; Turbo, Viridis, Plasma, Inferno and Magma
+// are the usual polynomial fits; Cividis goes through five of its colours.
+inline void colormap_rgb(int map, double t, double rgb[3]) {
+    static const double pi = 3.14159265358979323846;
+    switch (map) {
+    case COLORMAP_RAINBOW:
+        rgb[0] = fabs(2.0 * t - 0.5); rgb[1] = sin(pi * t); rgb[2] = cos(0.5 * pi * t);
+        break;
+    case COLORMAP_HOT:
+        rgb[0] = 3.0 * t; rgb[1] = 3.0 * t - 1.0; rgb[2] = 3.0 * t - 2.0;
+        break;
+    case COLORMAP_COOL:
+        rgb[0] = t; rgb[1] = 1.0 - t; rgb[2] = 1.0;
+        break;
+    case COLORMAP_SPRING:
+        rgb[0] = 1.0; rgb[1] = t; rgb[2] = 1.0 - t;
+        break;
+    case COLORMAP_SUMMER:
+        rgb[0] = t; rgb[1] = 0.5 + 0.5 * t; rgb[2] = 0.4;
+        break;
+    case COLORMAP_AUTUMN:
+        rgb[0] = 1.0; rgb[1] = t; rgb[2] = 0.0;
+        break;
+    case COLORMAP_WINTER:
+        rgb[0] = 0.0; rgb[1] = t; rgb[2] = 1.0 - 0.5 * t;
+        break;
+    case COLORMAP_BONE: {
+        // (7 gray + reversed hot) / 8
+        double hot[3] = { 3.0 * t - 2.0, 3.0 * t - 1.0, 3.0 * t };
+        for (int k = 0; k < 3; k++)
+            rgb[k] = (7.0 * t + tone_clamp(hot[k])) / 8.0;
+        break;
+    }
+    case COLORMAP_COPPER:
+        rgb[0] = 1.25 * t; rgb[1] = 0.7812 * t; rgb[2] = 0.4975 * t;
+        break;
+    case COLORMAP_PINK: {
+        double hot[3] = { 3.0 * t, 3.0 * t - 1.0, 3.0 * t - 2.0 };
+        for (int k = 0; k < 3; k++)
+            rgb[k] = sqrt((2.0 * t + tone_clamp(hot[k])) / 3.0);
+        break;
+    }
+    case COLORMAP_JET:
+        rgb[0] = 1.5 - fabs(4.0 * t - 3.0); rgb[1] = 1.5 - fabs(4.0 * t - 2.0); rgb[2] = 1.5 - fabs(4.0 * t - 1.0);
+        break;
+    case COLORMAP_HSV: {
+        double h = 6.0 * t;
+        rgb[0] = fabs(h - 3.0) - 1.0; rgb[1] = 2.0 - fabs(h - 2.0); rgb[2] = 2.0 - fabs(h - 4.0);
+        break;
+    }
+    case COLORMAP_FLAG:
+        rgb[0] = 0.75 * sin((31.5 * t + 0.25) * pi) + 0.5;
+        rgb[1] = sin(31.5 * t * pi);
+        rgb[2] = 0.75 * sin((31.5 * t - 0.25) * pi) + 0.5;
+        break;
+    case COLORMAP_PRISM:
+        rgb[0] = 0.75 * sin((20.9 * t + 0.25) * pi) + 0.67;
+        rgb[1] = 0.75 * sin((20.9 * t - 0.25) * pi) + 0.33;
+        rgb[2] = -1.1 * sin(20.9 * t * pi);
+        break;
+    case COLORMAP_OCEAN:
+        rgb[0] = 3.0 * t - 2.0; rgb[1] = fabs((3.0 * t - 1.0) * 0.5); rgb[2] = t;
+        break;
+    case COLORMAP_CUBEHELIX: {
+        // Green (2011): start 0.5, rotations -1.5, hue 1, gamma 1
+        double phi = 2.0 * pi * (0.5 / 3.0 - 1.5 * t);
+        double a = 0.5 * t * (1.0 - t);
+        double cp = cos(phi), sp = sin(phi);
+        rgb[0] = t + a * (-0.14861 * cp + 1.78277 * sp);
+        rgb[1] = t + a * (-0.29227 * cp - 0.90649 * sp);
+        rgb[2] = t + a * (1.97294 * cp);
+        break;
+    }
+    case COLORMAP_TURBO: {
+        static const double c[6][3] = {
+            { 0.13572138, 0.09140261, 0.10667330 }, { 4.61539260, 2.19418839, 12.64194608 },
+            { -42.66032258, 4.84296658, -60.58204836 }, { 132.13108234, -14.18503333, 110.36276771 },
+            { -152.94239396, 4.27729857, -89.90310912 }, { 59.28637943, 2.82956604, 27.34824973 } };
+        tone_poly(c, 6, t, rgb);
+        break;
+    }
+    case COLORMAP_VIRIDIS: {
+        static const double c[7][3] = {
+            { 0.2777273272234177, 0.005407344544966578, 0.3340998053353061 },
+            { 0.1050930431085774, 1.404613529898575, 1.384590162594685 },
+            { -0.3308618287255563, 0.214847559468213, 0.09509516302823659 },
+            { -4.634230498983486, -5.799100973351585, -19.33244095627987 },
+            { 6.228269936347081, 14.17993336680509, 56.69055260068105 },
+            { 4.776384997670288, -13.74514537774601, -65.35303263337234 },
+            { -5.435455855934631, 4.645852612178535, 26.3124352495832 } };
+        tone_poly(c, 7, t, rgb);
+        break;
+    }
+    case COLORMAP_PLASMA: {
+        static const double c[7][3] = {
+            { 0.05873234392399702, 0.02333670892565664, 0.5433401826748754 },
+            { 2.176514634195958, 0.2383834171260182, 0.7539604599784036 },
+            { -2.689460476458034, -7.455851135738909, 3.110799939717086 },
+            { 6.130348345893603, 42.3461881477227, -28.51885465332158 },
+            { -11.10743619062271, -82.66631109428045, 60.13984767418263 },
+            { 10.02306557647065, 71.41361770095349, -54.07218655560067 },
+            { -3.658713842777788, -22.93153465461149, 18.19190778539828 } };
+        tone_poly(c, 7, t, rgb);
+        break;
+    }
+    case COLORMAP_INFERNO: {
+        static const double c[7][3] = {
+            { 0.0002189403691192265, 0.001651004631001012, -0.01948089843709184 },
+            { 0.1065134194856116, 0.5639564367884091, 3.932712388889277 },
+            { 11.60249308247187, -3.972853965665698, -15.9423941062914 },
+            { -41.70399613139459, 17.43639888205313, 44.35414519872813 },
+            { 77.162935699427, -33.40235894210092, -81.80730925738993 },
+            { -71.31942824499214, 32.62606426397723, 73.20951985803202 },
+            { 25.13112622477341, -12.24266895238567, -23.07032500287172 } };
+        tone_poly(c, 7, t, rgb);
+        break;
+    }
+    case COLORMAP_MAGMA: {
+        static const double c[7][3] = {
+            { -0.002136485053939582, -0.000749655052795221, -0.005386127855323933 },
+            { 0.2516605407371642, 0.6775232436837668, 2.494026599312351 },
+            { 8.353717279216625, -3.577719514958484, 0.3144679030132573 },
+            { -27.66873308576866, 14.26473078096533, -13.64921318813922 },
+            { 52.17613981234068, -27.94360607168351, 12.94416944238394 },
+            { -50.76852536473588, 29.04658282127291, 4.23415299384598 },
+            { 18.65570506591883, -11.48977351997711, -5.601961508734096 } };
+        tone_poly(c, 7, t, rgb);
+        break;
+    }
+    case COLORMAP_CIVIDIS: {
+        static const double c[5][3] = {
+            { 0.000, 0.135, 0.305 }, { 0.208, 0.271, 0.424 }, { 0.486, 0.482, 0.471 },
+            { 0.737, 0.686, 0.435 }, { 0.996, 0.910, 0.220 } };
+        tone_stops(c, 5, t, rgb);
+        break;
+    }
+    default:
+        rgb[0] = rgb[1] = rgb[2] = t;
+        break;
+    }
+    for (int k = 0; k < 3; k++)
+        rgb[k] = tone_clamp(rgb[k]);
+}
+
+// R in the low byte, as GL_RGBA / GL_UNSIGNED_BYTE reads it
+inline uint32_t tone_pack(const double rgb[3]) {
+    uint32_t r = (uint32_t)(rgb[0] * 255.0 + 0.5), g = (uint32_t)(rgb[1] * 255.0 + 0.5), b = (uint32_t)(rgb[2] * 255.0 + 0.5);
+    return 0xFF000000u | b << 16 | g << 8 | r;
+}
+
+// Histogram bin of count n > 0
+inline int tone_bin(int64_t n) {
+    if (n < TONE_LUT_SIZE)
+        return (int)n;
+    int e = 63 - __builtin_clzll((uint64_t)n);
+    return (int)TONE_LUT_SIZE + (e - 16) * TONE_OCTAVE_BINS + (int)((n >> (e - 4)) & (TONE_OCTAVE_BINS - 1));
+}
+
+// Largest count that falls in bin b
+inline int64_t tone_bin_top(int b) {
+    if (b < TONE_LUT_SIZE)
+        return b;
+    int o = (b - (int)TONE_LUT_SIZE) / TONE_OCTAVE_BINS, s = (b - (int)TONE_LUT_SIZE) % TONE_OCTAVE_BINS;
+    int e = o + 16;
+    uint64_t top = ((uint64_t)(TONE_OCTAVE_BINS + s + 1) << (e - 4)) - 1;
+    return top > (uint64_t)INT64_MAX ? INT64_MAX : (int64_t)top;
+}
+
+// Distribution of the counts of one plate
+struct ToneStats {
+    int64_t max;
+    int64_t lit;                     // Cells with a nonzero count
+    std::vector<int64_t> histogram;  // TONE_BINS bins; bin 0 is not counted
+
+    ToneStats() : max(0), lit(0) {}
+
+    // Take in n more counts, read with relaxed atomic loads so this may
+    // run while workers merge
+    void add(const int64_t* counts, size_t n) {
+        if (histogram.empty())
+            histogram.assign(TONE_BINS, 0);
+        for (size_t i = 0; i < n; i++) {
+            int64_t c = __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+            if (c <= 0)
+                continue;
+            max = std::max(max, c);
+            histogram[tone_bin(c)]++;
+            lit++;
+        }
+    }
+
+    void add(const ToneStats& o) {
+        if (o.histogram.empty())
+            return;
+        if (histogram.empty())
+            histogram.assign(TONE_BINS, 0);
+        max = std::max(max, o.max);
+        lit += o.lit;
+        for (int b = 0; b < TONE_BINS; b++)
+            histogram[b] += o.histogram[b];
+    }
+
+    // Smallest count that at least p percent of the lit cells do not exceed
+    int64_t percentile(double p) const {
+        if (lit == 0 || p >= 100.0)
+            return max;
+        int64_t want = (int64_t)ceil(lit * p / 100.0), seen = 0;
+        for (int b = 1; b < (int)histogram.size(); b++) {
+            seen += histogram[b];
+            if (seen >= want)
+                return std::min(tone_bin_top(b), max);
+        }
+        return max;
+    }
+};
+
+// Call f(part, begin, end) for `threads` even parts of [0, n), the first
+// on the calling thread
+template <typename F>
+inline void tone_parallel(size_t n, int threads, F f) {
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++)
+        pool.push_back(std::thread(f, t, n * t / threads, n * (t + 1) / threads));
+    f(0, (size_t)0, n / threads);
+    for (size_t t = 0; t < pool.size(); t++)
+        pool[t].join();
+}
+
+// ToneStats of n counts on up to `threads` threads
+inline void tone_stats(const int64_t* counts, size_t n, int threads, ToneStats& out) {
+    threads = std::max(1, std::min(threads, (int)(n / TONE_LUT_SIZE) + 1));
+    std::vector<ToneStats> part(threads);
+    tone_parallel(n, threads, [counts, &part](int t, size_t begin, size_t end) {
+        part[t].add(counts + begin, end - begin);
+    });
+    out = ToneStats();
+    for (int t = 0; t < threads; t++)
+        out.add(part[t]);
+}
+
+typedef void (*ToneRowFn)(const int64_t* counts, uint32_t* out, int n, const uint32_t* lut, int64_t lut_size);
+
+// out[i] = lut[counts[i]] where the count is in the table; the others are
+// left alone for the caller
+inline void tone_row_scalar(const int64_t* counts, uint32_t* out, int n, const uint32_t* lut, int64_t lut_size) {
+    for (int i = 0; i < n; i++)
+        if (counts[i] < lut_size)
+            out[i] = lut[counts[i] < 0 ? 0 : counts[i]];
+}
+
+#ifdef SIMD_X86
+// Four counts per gather; counts past the table are clamped into it for
+// the gather and then not stored
+__attribute__((target("avx2"))) inline void tone_row_avx2(const int64_t* counts, uint32_t* out, int n, const uint32_t* lut, int64_t lut_size) {
+    const __m256i top = _mm256_set1_epi64x(lut_size - 1);
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(counts + i));
+        __m256i over = _mm256_cmpgt_epi64(c, top);
+        __m256i idx = _mm256_blendv_epi8(c, top, over);
+        idx = _mm256_blendv_epi8(idx, zero, _mm256_cmpgt_epi64(zero, idx));
+        __m128i rgba = _mm256_i64gather_epi32((const int*)lut, idx, 4);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(over));
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i*)(out + i), rgba);
+        } else {
+            uint32_t v[4];
+            _mm_storeu_si128((__m128i*)v, rgba);
+            for (int l = 0; l < 4; l++)
+                if (!(mask & (1 << l)))
+                    out[i + l] = v[l];
+        }
+    }
+    tone_row_scalar(counts + i, out + i, n - i, lut, lut_size);
+}
+#endif
+
+// Widest row kernel this CPU runs, picked once
+inline ToneRowFn tone_row_kernel() {
+    static const ToneRowFn kernel = []() {
+        ToneRowFn k = tone_row_scalar;
+#ifdef SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            k = tone_row_avx2;
+#endif
+        return k;
+    }();
+    return kernel;
+}
+
+// Settings and statistics folded into tables; map() is then pure lookups
+class ToneMap {
+public:
+    ToneMap() : clip(0), lit(0), log_clip(0), palette_map(-1), palette16_map(-1), kernel(tone_row_kernel()) {}
+
+    // With `wide`, also the 16-bit palette map16() needs
+    void prepare(const ToneSettings& s, const ToneStats& stats, bool wide = false) {
+        settings = s;
+        if (palette_map != s.colormap) {
+            palette_map = s.colormap;
+            palette.resize(PALETTE_SIZE);
+            for (int i = 0; i < PALETTE_SIZE; i++) {
+                double rgb[3];
+                colormap_rgb(s.colormap, i / (double)(PALETTE_SIZE - 1), rgb);
+                palette[i] = tone_pack(rgb);
+            }
+        }
+        if (wide && palette16_map != s.colormap) {
+            palette16_map = s.colormap;
+            palette16.resize(3 * PALETTE16_SIZE);
+            for (int i = 0; i < PALETTE16_SIZE; i++) {
+                double rgb[3];
+                colormap_rgb(s.colormap, i / (double)(PALETTE16_SIZE - 1), rgb);
+                for (int c = 0; c < 3; c++)
+                    palette16[3 * i + c] = (uint16_t)(tone_clamp(rgb[c]) * 65535.0 + 0.5);
+            }
+        }
+        clip = std::max<int64_t>(stats.percentile(s.percentile), 1);
+        lit = stats.lit;
+        log_clip = log1p((double)clip);
+        // Equalization: cells at or below each bin, as a fraction of the lit ones
+        cdf.clear();
+        if (s.curve == TONE_EQUALIZE && !stats.histogram.empty()) {
+            cdf.resize(TONE_BINS);
+            int64_t seen = 0;
+            for (int b = 0; b < TONE_BINS; b++) {
+                if (b > 0)
+                    seen += stats.histogram[b];
+                cdf[b] = lit ? (double)seen / lit : 0.0;
+            }
+        }
+        lut.resize((size_t)std::min(clip + 1, TONE_LUT_SIZE));
+        level_lut.resize(lut.size());
+        for (size_t c = 0; c < lut.size(); c++) {
+            lut[c] = color((int64_t)c);
+            level_lut[c] = (float)level((int64_t)c);
+        }
+    }
+
+    const ToneSettings& current() const {
+        return settings;
+    }
+
+    // t in [0, 1] of count n
+    double level(int64_t n) const {
+        if (n <= 0)
+            return 0.0;
+        if (n >= clip)
+            return 1.0;
+        switch (settings.curve) {
+        case TONE_LINEAR: return (double)n / clip;
+        case TONE_SQRT: return sqrt((double)n / clip);
+        case TONE_EQUALIZE: return cdf.empty() ? 0.0 : std::min(cdf[tone_bin(n)] / std::max(cdf[tone_bin(clip)], 1e-300), 1.0);
+        default: return log1p((double)n) / log_clip;
+        }
+    }
+
+    uint32_t color(int64_t n) const {
+        return palette[(int)(level(n) * (PALETTE_SIZE - 1) + 0.5)];
+    }
+
+    void map(const int64_t* counts, uint32_t* out, int n) const {
+        const int64_t size = (int64_t)lut.size();
+        kernel(counts, out, n, &lut[0], size);
+        for (int i = 0; i < n; i++)
+            if (counts[i] >= size)
+                out[i] = color(counts[i]);
+    }
+
+    // level() of n counts, as floats
+    void levels(const int64_t* counts, float* out, int n) const {
+        const int64_t size = (int64_t)level_lut.size();
+        for (int i = 0; i < n; i++) {
+            int64_t c = counts[i];
+            out[i] = c <= 0 ? 0.0f : c < size ? level_lut[c] : (float)level(c);
+        }
+    }
+
+    // n counts to 16-bit RGB, three values per count in host byte order;
+    // needs prepare() with `wide`
+    void map16(const int64_t* counts, uint16_t* rgb, int n) const {
+        const int64_t size = (int64_t)level_lut.size();
+        for (int i = 0; i < n; i++) {
+            int64_t c = counts[i];
+            double t = c <= 0 ? 0.0 : c < size ? level_lut[c] : level(c);
+            const uint16_t* p = &palette16[3 * (int)(t * (PALETTE16_SIZE - 1) + 0.5)];
+            rgb[3 * i] = p[0];
+            rgb[3 * i + 1] = p[1];
+            rgb[3 * i + 2] = p[2];
+        }
+    }
+
+private:
+    ToneSettings settings;
+    int64_t clip;                    // Count that gets the top colour
+    int64_t lit;
+    double log_clip;                 // log1p(clip), for TONE_LOG
+    int palette_map;                 // Colormap `palette` holds
+    std::vector<uint32_t> palette;   // PALETTE_SIZE colours
+    std::vector<double> cdf;         // Per histogram bin, equalization only
+    std::vector<uint32_t> lut;       // color() of the counts below TONE_LUT_SIZE
+    std::vector<float> level_lut;    // level() of the same counts
+    int palette16_map;               // Colormap `palette16` holds, if any
+    std::vector<uint16_t> palette16; // PALETTE16_SIZE RGB colours
+    ToneRowFn kernel;
+};
+
+#endif
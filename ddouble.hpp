@@ -0,0 +1,92 @@
+#ifndef DDOUBLE_HPP
+#define DDOUBLE_HPP
+
+#include <math.h>
+
+// Double-double number: the unevaluated sum hi + lo with |lo| <= ulp(hi) / 2,
+// about 106 bits of significand at a few times the cost of a double.
+// Algorithms after Dekker and Knuth as used in the QD library.
+struct dd_real {
+    double hi, lo;
+};
+
+inline dd_real dd_make(double hi, double lo = 0.0) {
+    dd_real r;
+    r.hi = hi;
+    r.lo = lo;
+    return r;
+}
+
+// a + b exactly, assuming |a| >= |b|
+inline dd_real dd_quick_two_sum(double a, double b) {
+    double s = a + b;
+    return dd_make(s, b - (s - a));
+}
+
+// a + b exactly
+inline dd_real dd_two_sum(double a, double b) {
+    double s = a + b;
+    double bb = s - a;
+    return dd_make(s, (a - (s - bb)) + (b - bb));
+}
+
+// a * b exactly
+inline dd_real dd_two_prod(double a, double b) {
+    double p = a * b;
+#ifdef __FMA__
+    return dd_make(p, fma(a, b, -p));
+#else
+    // Dekker's split; a hardware fma is not guaranteed without -mfma
+    const double split = 134217729.0; // 2^27 + 1
+    double t = split * a;
+    double ahi = t - (t - a), alo = a - ahi;
+    t = split * b;
+    double bhi = t - (t - b), blo = b - bhi;
+    return dd_make(p, ((ahi * bhi - p) + ahi * blo + alo * bhi) + alo * blo);
+#endif
+}
+
+inline dd_real dd_add(const dd_real& a, const dd_real& b) {
+    dd_real s = dd_two_sum(a.hi, b.hi);
+    dd_real t = dd_two_sum(a.lo, b.lo);
+    s.lo += t.hi;
+    s = dd_quick_two_sum(s.hi, s.lo);
+    s.lo += t.lo;
+    return dd_quick_two_sum(s.hi, s.lo);
+}
+
+inline dd_real dd_neg(const dd_real& a) {
+    return dd_make(-a.hi, -a.lo);
+}
+
+inline dd_real dd_sub(const dd_real& a, const dd_real& b) {
+    return dd_add(a, dd_neg(b));
+}
+
+inline dd_real dd_mul(const dd_real& a, const dd_real& b) {
+    dd_real p = dd_two_prod(a.hi, b.hi);
+    p.lo += a.hi * b.lo + a.lo * b.hi;
+    return dd_quick_two_sum(p.hi, p.lo);
+}
+
+inline dd_real dd_sqr(const dd_real& a) {
+    dd_real p = dd_two_prod(a.hi, a.hi);
+    p.lo += 2.0 * a.hi * a.lo;
+    return dd_quick_two_sum(p.hi, p.lo);
+}
+
+// Exact scaling by a power of two
+inline dd_real dd_ldexp(const dd_real& a, int e) {
+    return dd_make(ldexp(a.hi, e), ldexp(a.lo, e));
+}
+
+inline dd_real dd_abs(const dd_real& a) {
+    return a.hi < 0.0 ? dd_neg(a) : a;
+}
+
+// a > x for a plain double x
+inline bool dd_greater(const dd_real& a, double x) {
+    return a.hi > x || (a.hi == x && a.lo > 0.0);
+}
+
+#endif
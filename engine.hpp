@@ -0,0 +1,1277 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include <stdint.h>
+#include <gmp.h>
+#include <mpfr.h>
+
+#include "quaternion.hpp"
+#include "beam.hpp"
+#include "plate.hpp"
+#include "models.hpp"
+#include "tilecache.hpp"
+#include "simd.hpp"
+#include "perturbation.hpp"
+#include "telemetry.hpp"
+#include "numa.hpp"
+
+// Everything a render needs besides beams and plates. The engine keeps its
+// own copy, so the GUI may edit its globals while workers are running.
+struct RenderSettings {
+    int model;
+    int max_iterations;
+    double escape_radius;
+    double julia_c[4];               // Constant for the Julia model
+    int threads;
+    int64_t chunk_size;              // Samples a worker takes at a time
+    int64_t merge_batch;             // Buffered hits per worker before a merge
+    int merge_interval_ms;           // Longest a hit may sit in a worker buffer
+    bool pin_threads;                // Keep each worker on one CPU
+    bool node_replicas;              // Workers merge into a copy of each dense plate on their NUMA node
+
+    RenderSettings() : model(MODEL_MANDELBROT), max_iterations(100), escape_radius(64.0), threads(1), chunk_size(1024), merge_batch(1 << 20), merge_interval_ms(250),
+        pin_threads(false), node_replicas(false) {
+        julia_c[0] = -0.8; julia_c[1] = 0.156; julia_c[2] = 0.0; julia_c[3] = 0.0;
+    }
+};
+
+// Samples that never escaped, by how that was found out
+struct RejectStats {
+    int64_t cardioid;                // Inside the main cardioid
+    int64_t bulb;                    // Inside the period-2 bulb
+    int64_t cycle;                   // Orbit came back to an earlier point
+    int64_t max_iterations;          // Ran the full max_iterations
+    RejectStats() : cardioid(0), bulb(0), cycle(0), max_iterations(0) {}
+};
+
+// Samples handed to the SIMD kernel at a time
+static const int SIMD_BLOCK = 256;
+
+// Most hits a worker keeps for the orbit it is iterating (12 bytes each)
+static const int ORBIT_BUFFER_HITS = 1 << 18;
+// Orbits between two decisions whether to record
+static const int ORBIT_POLICY_WINDOW = 1024;
+
+// Sign flips that map the samples of a beam, and their orbits, onto each
+// other: every subset of `axes`, bit c for component c of (r, i, j, k).
+// Sample s of the beam is draw s - s % order flipped by flips[s % order].
+struct Symmetry {
+    unsigned axes;
+    int order;
+    unsigned flips[16];
+
+    explicit Symmetry(unsigned axes_in = 0) : axes(axes_in & 0xF), order(1) {
+        flips[0] = 0;
+        for (int c = 0; c < 4; c++) {
+            if (!(axes & (1u << c)))
+                continue;
+            for (int g = 0; g < order; g++)
+                flips[order + g] = flips[g] | (1u << c);
+            order *= 2;
+        }
+    }
+};
+
+// Which flips of a symmetric beam's draw the orbit being iterated stands
+// for: flips[first] .. flips[last - 1]. No symmetry is the draw itself.
+struct SampleImages {
+    const Symmetry* symmetry;        // NULL: no symmetry
+    int first, last;
+
+    SampleImages(const Symmetry* symmetry_in = NULL, int first_in = 0, int last_in = 1) : symmetry(symmetry_in), first(first_in), last(last_in) {}
+
+    int count() const {
+        return last - first;
+    }
+};
+
+// Half-open range [begin, end) of sample indices of one beam
+struct WorkRange {
+    size_t beam;
+    int64_t begin, end;
+    int64_t grain;                   // Ranges are only split at multiples of this index
+};
+
+// First multiple of `grain` at or above x
+inline int64_t round_up(int64_t x, int64_t grain) {
+    return (x + grain - 1) / grain * grain;
+}
+
+// Per-worker deque of sample ranges. The owner eats chunks off the front of
+// the oldest range; idle workers steal the back half of the largest range.
+class WorkQueue {
+public:
+    void push(const WorkRange& r) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (r.end > r.begin)
+            ranges.push_back(r);
+    }
+
+    bool take(int64_t n, WorkRange& out) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (ranges.empty())
+            return false;
+        WorkRange& front = ranges.front();
+        out = front;
+        int64_t cut = round_up(front.begin + n, front.grain);
+        if (cut < front.end) {
+            out.end = cut;
+            front.begin = cut;
+        } else {
+            ranges.pop_front();
+        }
+        return true;
+    }
+
+    bool steal(int64_t min_split, WorkRange& out) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (ranges.empty())
+            return false;
+        size_t best = 0;
+        for (size_t i = 1; i < ranges.size(); i++)
+            if (ranges[i].end - ranges[i].begin > ranges[best].end - ranges[best].begin)
+                best = i;
+        WorkRange& victim = ranges[best];
+        out = victim;
+        int64_t mid = victim.begin + (victim.end - victim.begin) / 2;
+        mid -= mid % victim.grain;
+        if (victim.end - victim.begin >= 2 * min_split && mid > victim.begin) {
+            out.begin = mid;
+            victim.end = mid;
+        } else {
+            ranges.erase(ranges.begin() + best);
+        }
+        return true;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        ranges.clear();
+    }
+
+    // Move every range to `out`
+    void drain(std::vector<WorkRange>& out) {
+        std::lock_guard<std::mutex> guard(lock);
+        out.insert(out.end(), ranges.begin(), ranges.end());
+        ranges.clear();
+    }
+
+private:
+    std::mutex lock;
+    std::deque<WorkRange> ranges;
+};
+
+// An orbit point that landed on a plate
+struct PlateHit {
+    uint32_t plate;
+    int x, y;
+};
+
+// Where the orbit being iterated landed, recorded during the escape-time
+// pass so that an escaping orbit is deposited without iterating it again.
+// Only the first `horizon` points are recorded; an orbit that escapes later
+// is replayed. The horizon is max_iterations unless that would take more
+// than ORBIT_BUFFER_HITS hits, so long orbits cost no memory.
+//
+// Recording pays off when escaping orbits are long; when most of the work
+// is in orbits that stay bounded, their projections are wasted. The buffer
+// keeps a running count of both, in iterations, and every
+// ORBIT_POLICY_WINDOW orbits picks whichever is cheaper for the next ones.
+struct OrbitBuffer {
+    std::vector<PlateHit> hits;
+    int horizon;                     // Most iterations recorded
+    bool recording;                  // Record the next orbit
+    bool complete;                   // `hits` hold all of the last orbit, which escaped
+    int length;                      // Iterations the last orbit ran
+    double saved;                    // Iterations replays would have taken
+    double wasted;                   // Points projected for nothing
+    double points, point_hits;       // Recorded so far, for the cost of a point
+    double bound_cost;               // Cost of the per-plate bounds, in iterations
+    int orbits;                      // In this window
+
+    OrbitBuffer() : horizon(0), recording(false), complete(false), length(0), saved(0.0), wasted(0.0), points(0.0), point_hits(0.0), bound_cost(0.0), orbits(0) {}
+
+    void set_horizon(int max_iterations, size_t plates) {
+        horizon = std::min<int64_t>(max_iterations, ORBIT_BUFFER_HITS / std::max<size_t>(plates, 1));
+        hits.reserve((size_t)horizon * plates);
+        // The counts do not depend on recording, so the first window replays
+        recording = false;
+        bound_cost = 0.1 * plates;
+    }
+
+    // Account for an orbit that escaped at n (<= 0: did not), after `length`
+    // was set by the escape-time pass
+    void finish(int n) {
+        int seen = std::min(length, horizon);
+        complete = recording && n > 1 && n - 1 <= horizon;
+        if (n > 1 && n - 1 <= horizon)
+            saved += n - 1;
+        else
+            wasted += seen;
+        if (recording) {
+            points += seen;
+            point_hits += hits.size();
+        }
+        if (++orbits < ORBIT_POLICY_WINDOW)
+            return;
+        // A recorded hit costs about one iteration in the backend
+        double cost = bound_cost + (points > 0.0 ? point_hits / points : 1.0);
+        recording = horizon > 0 && saved > wasted * cost;
+        saved *= 0.5;
+        wasted *= 0.5;
+        orbits = 0;
+    }
+};
+
+// Iteration state of one worker in scalar backend B, with every plate's
+// projection in B, pooled in the worker's arena so that iterating never
+// touches the heap
+template <typename B>
+struct OrbitState {
+    QuaternionT<B> c, z;
+    QuaternionT<B> saved;            // Brent's checkpoint for cycle detection
+    ModelScratch<B> ms;
+    typename B::value norm;
+    typename B::value eps;           // 2^-prec
+    typename B::value tol, tol2;     // Cycle tolerance of the model and its square
+    PlateProjections<B> proj;
+    SampleImages images;             // Samples the orbit being iterated stands for
+
+    OrbitState(mpfr_prec_t prec, const double julia_c[4], const std::vector<const PixelTransform*>& views, MpfrArena& arena)
+        : c(prec, arena), z(prec, arena), saved(prec, arena), ms(prec, arena), proj(views, prec, arena) {
+        B::init_pooled(norm, prec, arena);
+        B::init_pooled(eps, prec, arena);
+        B::init_pooled(tol, prec, arena);
+        B::init_pooled(tol2, prec, arena);
+        B::set_d(eps, 1.0);
+        B::mul_2si(eps, eps, -(long)B::get_prec(norm));
+        B::set_d(ms.julia_c.r, julia_c[0]);
+        B::set_d(ms.julia_c.i, julia_c[1]);
+        B::set_d(ms.julia_c.j, julia_c[2]);
+        B::set_d(ms.julia_c.k, julia_c[3]);
+    }
+
+private:
+    OrbitState(const OrbitState&);
+    OrbitState& operator=(const OrbitState&);
+};
+
+// Iteration state of one worker for the perturbation beams of one
+// precision: the sample at full precision for the interior tests, its
+// offset from the reference, and the orbit point in double, which is all
+// the plates of a perturbation beam need
+struct PerturbedState {
+    Quaternion c;                    // Pooled, at the beams' precision
+    ModelScratch<MpfrBackend> ms;
+    const ReferenceOrbit* ref;       // Of the beam being sampled
+    double dc[4];                    // c - mu
+    double delta[4];                 // z - Z[m]
+    int m;                           // Reference iteration being followed
+    QuaternionT<DoubleBackend> z;
+    double norm;                     // |z|^2
+    PlateProjections<DoubleBackend> proj;
+    SampleImages images;
+
+    PerturbedState(mpfr_prec_t prec, const std::vector<const PixelTransform*>& views, MpfrArena& arena)
+        : c(prec, arena), ms(prec, arena), ref(NULL), m(0), norm(0.0), proj(views, 53, arena) {}
+
+    void begin() {
+        delta[0] = delta[1] = delta[2] = delta[3] = 0.0;
+        m = 0;
+        z.set(0.0, 0.0, 0.0, 0.0);
+    }
+
+    // One iteration of z^2 + c, rebasing when the offset has lost its
+    // precision or the reference ends
+    void step() {
+        perturbed_step(delta, ref->at(m), dc);
+        const double* Z = ref->at(++m);
+        z.r = Z[0] + delta[0];
+        z.i = Z[1] + delta[1];
+        z.j = Z[2] + delta[2];
+        z.k = Z[3] + delta[3];
+        quaternion_norm2(norm, z);
+        double d2 = delta[0] * delta[0] + delta[1] * delta[1] + delta[2] * delta[2] + delta[3] * delta[3];
+        if (m == ref->length || norm < d2) {
+            z.get(&delta[0], &delta[1], &delta[2], &delta[3]);
+            m = 0;
+        }
+    }
+
+private:
+    PerturbedState(const PerturbedState&);
+    PerturbedState& operator=(const PerturbedState&);
+};
+
+// A worker's Metropolis chain over one beam: the current seed and where
+// its orbit lands
+struct MetropolisChain {
+    Quaternion c;                    // Pooled, at the beam's precision
+    double log_prior;
+    int64_t g;                       // Points of c's orbit on the plates; 0 until a first find
+    std::vector<PlateHit> hits;
+
+    MetropolisChain(mpfr_prec_t prec, MpfrArena& arena) : c(prec, arena), log_prior(0.0), g(0) {}
+};
+
+// Everything one worker thread owns. The arena is declared first so that
+// it outlives every pooled value below.
+struct WorkerContext {
+    MpfrArena arena;
+    TileCache cache;
+    mpfr_t t;                        // Conversion temporary
+    std::vector<Quaternion> sample;  // Per beam, at its precision
+    std::unique_ptr<OrbitState<DoubleBackend> > d;
+    std::unique_ptr<OrbitState<DoubleDoubleBackend> > dd;
+    std::map<mpfr_prec_t, std::unique_ptr<OrbitState<MpfrBackend> > > mp;
+    std::map<mpfr_prec_t, std::unique_ptr<PerturbedState> > pt;
+    std::vector<double> cr, ci, cj, ck; // Sample block for the SIMD kernel
+    std::vector<int> escape;
+    std::vector<SampleImages> lanes; // What each lane of the block stands for
+    RejectStats rejects;             // Since the last hand-over to the engine
+    std::vector<std::unique_ptr<MetropolisChain> > chains; // Per beam, Metropolis beams only
+    std::vector<PlateHit> proposal_hits;
+    OrbitBuffer orbit;
+    WorkerCounters counters;         // Hits and merges are the cache's
+    TelemetrySlot* slot;
+    int64_t range_ns;                // When the current range began, 0 between ranges
+    int64_t published_ns;
+    int polls;
+
+    // Each orbit point lands on up to `images` pixels per plate
+    WorkerContext(const std::vector<Plate*>& plates, const RenderSettings& settings, mpfr_prec_t bits, int images,
+                  TelemetrySlot* slot)
+        : cache(plates, settings.merge_batch, settings.merge_interval_ms), slot(slot), range_ns(0), published_ns(0), polls(0) {
+        arena.init(t, bits);
+        orbit.set_horizon(settings.max_iterations, plates.size() * images);
+    }
+
+    // After each sample: merge the cache and publish the counters when due.
+    // The clock is only read every 64 calls.
+    void poll() {
+        cache.maybe_flush();
+        if (++polls < 64)
+            return;
+        polls = 0;
+        int64_t now = steady_ns();
+        if (now - published_ns >= TELEMETRY_PUBLISH_MS * 1000000LL)
+            publish(now);
+    }
+
+    void publish(int64_t now) {
+        WorkerCounters c = counters;
+        c.hits = cache.hits();
+        c.merges = cache.flushes();
+        c.merge_ns = cache.flush_ns();
+        if (range_ns)
+            c.busy_ns += now - range_ns;
+        slot->publish(c);
+        published_ns = now;
+    }
+
+private:
+    WorkerContext(const WorkerContext&);
+    WorkerContext& operator=(const WorkerContext&);
+};
+
+// Sampling engine: a pool of worker threads that draw samples from every
+// beam, iterate them through the model and splat escaping orbits onto every
+// plate. Beams and plates must outlive the run and must not be added,
+// removed or resized until stop() returns.
+//
+// Workers are spread over the NUMA nodes in turn, and with pin_threads
+// each is kept on one CPU of its node. With node_replicas on a machine of
+// several nodes, every node used gets its own copy of each dense plate,
+// allocated and zeroed by a thread on that node so its pages are local;
+// workers merge into their node's copies, and reduce() moves what they
+// merged into the plates. Sparse plates are shared, their tiles being
+// allocated by whichever worker hits them first. A worker's own buffers
+// are allocated once it is placed, so they are local too.
+class Engine {
+public:
+    Engine() : scratch_bits(53), perturbable(false), mirror_axes(0), topology(numa_topology()), reduce_cursor(0),
+        stop_requested(false), workers_running(0), rejected_cardioid(0), rejected_bulb(0), rejected_cycle(0),
+        rejected_max_iterations(0), start_ns(0), end_ns(0), samplers() {}
+
+    ~Engine() {
+        stop();
+    }
+
+    // Spawn the workers. Returns false if already running or nothing to do.
+    bool start(const std::vector<Beam*>& beams_in, const std::vector<Plate*>& plates_in, const RenderSettings& settings_in) {
+        if (running())
+            return false;
+        // The model is picked here, once: every tier gets a sampling loop
+        // compiled for it
+        SamplerPicker pick = { this, settings_in.julia_c };
+        if (!model_dispatch(settings_in.model, pick))
+            return false;
+        beams = beams_in;
+        plates = plates_in;
+        settings = settings_in;
+        if (settings.threads < 1)
+            settings.threads = 1;
+        if (settings.chunk_size < 1)
+            settings.chunk_size = 1;
+
+        // Pick each beam's arithmetic from its spread and the finest plate
+        mpfr_exp_t pixel_exp = 0;
+        for (size_t p = 0; p < plates.size(); p++)
+            pixel_exp = std::min(pixel_exp, plates[p]->pixel_exp());
+        precision.clear();
+        scratch_bits = 53;
+        for (size_t b = 0; b < beams.size(); b++) {
+            PrecisionChoice pc = beams[b]->choose_precision(pixel_exp, perturbable);
+            beams[b]->precision = pc;
+            precision.push_back(pc);
+            // Double-double values only convert exactly into 107+ bits
+            scratch_bits = std::max(scratch_bits, pc.tier == PRECISION_DOUBLE_DOUBLE ? (mpfr_prec_t)128 : pc.bits);
+        }
+        // Chains are left alone: their steps are not independent draws
+        symmetry.clear();
+        for (size_t b = 0; b < beams.size(); b++) {
+            unsigned axes = beams[b]->mode == SAMPLING_GAUSSIAN ? beams[b]->symmetric_axes() & mirror_axes : 0;
+            symmetry.push_back(Symmetry(axes));
+            beams[b]->images = symmetry.back().order;
+        }
+        // Reference orbits are computed by the first worker to need them
+        references.clear();
+        for (size_t b = 0; b < beams.size(); b++)
+            references.push_back(std::unique_ptr<ReferenceOrbit>(precision[b].tier == PRECISION_PERTURBATION ? new ReferenceOrbit() : NULL));
+
+        // Each plate's projections, composed once for the run a little
+        // more precisely than any beam is iterated
+        views.clear();
+        view_ptrs.clear();
+        for (size_t p = 0; p < plates.size(); p++) {
+            views.push_back(std::unique_ptr<PixelTransform>(new PixelTransform(scratch_bits + 64)));
+            plates[p]->pixel_transform(*views.back());
+            view_ptrs.push_back(views.back().get());
+        }
+
+        queues.clear();
+        for (int t = 0; t < settings.threads; t++)
+            queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+
+        place_workers();
+
+        // Give every worker an equal share of what is left of every beam
+        bool any = false;
+        keys.clear();
+        for (size_t b = 0; b < beams.size(); b++) {
+            keys.push_back(beams[b]->seed_key());
+            int64_t grain = beams[b]->mode == SAMPLING_METROPOLIS ? MH_CHAIN_STEPS : 1;
+            std::vector<SampleRange> todo;
+            beams[b]->unsampled(todo);
+            beams[b]->pending.clear();
+            int64_t left = 0;
+            for (size_t r = 0; r < todo.size(); r++)
+                left += todo[r].end - todo[r].begin;
+            if (left == 0)
+                continue;
+            any = true;
+            // Thread t gets ranks [left * t / threads, left * (t + 1) / threads)
+            // of the concatenated ranges; cuts inside a range are rounded to
+            // the grain
+            int64_t rank = 0;
+            for (size_t r = 0; r < todo.size(); r++) {
+                int64_t len = todo[r].end - todo[r].begin;
+                int64_t from = todo[r].begin;
+                for (int t = 0; t < settings.threads && from < todo[r].end; t++) {
+                    int64_t cut = todo[r].begin + left * (t + 1) / settings.threads - rank;
+                    if (cut <= from)
+                        continue;
+                    cut = cut >= todo[r].begin + len ? todo[r].end : round_up(cut, grain);
+                    cut = std::min(cut, todo[r].end);
+                    WorkRange w = { b, from, cut, grain };
+                    queues[t]->push(w);
+                    from = cut;
+                }
+                rank += len;
+            }
+        }
+        if (!any)
+            return false;
+
+        rejected_cardioid.store(0);
+        rejected_bulb.store(0);
+        rejected_cycle.store(0);
+        rejected_max_iterations.store(0);
+        telemetry_slots.clear();
+        for (int t = 0; t < settings.threads; t++)
+            telemetry_slots.push_back(std::unique_ptr<TelemetrySlot>(new TelemetrySlot()));
+        start_ns = steady_ns();
+        end_ns.store(0);
+        stop_requested.store(false);
+        workers_running.store(settings.threads);
+        for (int t = 0; t < settings.threads; t++)
+            threads.push_back(std::thread(&Engine::worker_main, this, t));
+        return true;
+    }
+
+    // Ask the workers to stop after their current sample (Metropolis
+    // beams: chain) and wait for them. Whatever is left undone is kept in
+    // the beams' pending ranges for the next start().
+    void stop() {
+        stop_requested.store(true);
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+        threads.clear();
+        reduce();
+        replicas.clear();
+        node_plates.clear();
+        std::vector<WorkRange> left;
+        for (size_t q = 0; q < queues.size(); q++)
+            queues[q]->drain(left);
+        // In index order, touching ranges joined
+        std::sort(left.begin(), left.end(), [](const WorkRange& a, const WorkRange& b) {
+            return a.beam != b.beam ? a.beam < b.beam : a.begin < b.begin;
+        });
+        for (size_t r = 0; r < left.size(); r++) {
+            std::vector<SampleRange>& pending = beams[left[r].beam]->pending;
+            if (!pending.empty() && pending.back().end == left[r].begin) {
+                pending.back().end = left[r].end;
+            } else {
+                SampleRange s = { left[r].begin, left[r].end };
+                pending.push_back(s);
+            }
+        }
+        queues.clear();
+        stop_requested.store(false);
+    }
+
+    bool running() const {
+        return !threads.empty();
+    }
+
+    // Add what the workers merged into the node replicas since the last
+    // call to the plates, at most `max_tiles` tiles of replicas (all if
+    // negative); the rest are taken by later calls. Returns the tiles
+    // moved. Safe while running; without replicas there is nothing to do.
+    size_t reduce(long max_tiles = -1) {
+        if (replicas.empty())
+            return 0;
+        size_t total = 0;
+        for (size_t p = 0; p < plates.size(); p++)
+            total += plates[p]->tile_count();
+        size_t moved = 0, k = 0;
+        for (; k < total && (max_tiles < 0 || (long)moved < max_tiles); k++) {
+            size_t i = (reduce_cursor + k) % total, p = 0;
+            while (i >= plates[p]->tile_count())
+                i -= plates[p++]->tile_count();
+            int tx = (int)(i % plates[p]->tiles_x()), ty = (int)(i / plates[p]->tiles_x());
+            for (size_t n = 0; n < replicas.size(); n++) {
+                Plate* r = replicas[n][p].get();
+                if (r && r->take_dirty(tx, ty) && plates[p]->absorb_tile(*r, tx, ty))
+                    moved++;
+            }
+        }
+        reduce_cursor = total ? (reduce_cursor + k) % total : 0;
+        return moved;
+    }
+
+    // Bytes held by the node replicas of the current run
+    size_t replica_memory() const {
+        size_t bytes = 0;
+        for (size_t n = 0; n < replicas.size(); n++)
+            for (size_t p = 0; p < replicas[n].size(); p++)
+                if (replicas[n][p])
+                    bytes += replicas[n][p]->memory();
+        return bytes;
+    }
+
+    // Place workers on `t` instead of this machine's topology; not while
+    // running
+    void set_topology(const NumaTopology& t) {
+        topology = t;
+    }
+
+    // All work is done; the caller still has to stop() to join the threads
+    bool finished() const {
+        return running() && workers_running.load() == 0;
+    }
+
+    // Wall time of the last run, up to now if it is still going
+    double elapsed_seconds() const {
+        int64_t end = end_ns.load();
+        if (end == 0)
+            end = steady_ns();
+        return (end - start_ns) * 1e-9;
+    }
+
+    // Every worker's counters as last published, at most
+    // TELEMETRY_PUBLISH_MS old; may be read while running
+    void telemetry(TelemetrySnapshot& out) const {
+        out.seconds = elapsed_seconds();
+        out.workers.resize(telemetry_slots.size());
+        for (size_t t = 0; t < telemetry_slots.size(); t++)
+            out.workers[t] = telemetry_slots[t]->read();
+    }
+
+    // Totals since the last start(); may be read while running
+    RejectStats rejects() const {
+        RejectStats r;
+        r.cardioid = rejected_cardioid.load(std::memory_order_relaxed);
+        r.bulb = rejected_bulb.load(std::memory_order_relaxed);
+        r.cycle = rejected_cycle.load(std::memory_order_relaxed);
+        r.max_iterations = rejected_max_iterations.load(std::memory_order_relaxed);
+        return r;
+    }
+
+private:
+    std::vector<Beam*> beams;
+    std::vector<Plate*> plates;
+    RenderSettings settings;
+    std::vector<PrecisionChoice> precision; // Per beam
+    std::vector<uint64_t> keys;      // Per beam, of its sample generator
+    std::vector<std::unique_ptr<ReferenceOrbit> > references; // Per perturbation beam
+    std::vector<Symmetry> symmetry;  // Per beam
+    std::vector<std::unique_ptr<PixelTransform> > views; // Per plate, for this run
+    std::vector<const PixelTransform*> view_ptrs;
+    mpfr_prec_t scratch_bits;        // Enough for every beam's conversions
+    bool perturbable;                // The model can be iterated by perturbation
+    unsigned mirror_axes;            // The model's, for this run's julia_c
+    NumaTopology topology;           // Workers are placed on its nodes
+    std::vector<int> worker_node;    // Per worker, index into topology.nodes
+    std::vector<std::vector<int> > worker_cpus; // Per worker, CPUs to pin it to; empty if not pinned
+    // Per node used, when replicating: a copy of each dense plate (NULL
+    // for sparse ones) and the plates its workers merge into
+    std::vector<std::vector<std::unique_ptr<Plate> > > replicas;
+    std::vector<std::vector<Plate*> > node_plates;
+    size_t reduce_cursor;            // Where the next reduce() starts
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stop_requested;
+    std::atomic<int> workers_running;
+    std::atomic<int64_t> rejected_cardioid, rejected_bulb, rejected_cycle, rejected_max_iterations;
+    int64_t start_ns;
+    std::atomic<int64_t> end_ns;     // When the last worker left, 0 while running
+    std::vector<std::unique_ptr<TelemetrySlot> > telemetry_slots; // Per worker, kept after the run
+
+    typedef int64_t (Engine::*Sampler)(const WorkRange&, WorkerContext&);
+    Sampler samplers[4];             // Per precision tier, for the model
+
+    struct SamplerPicker {
+        Engine* engine;
+        const double* julia_c;
+        template <typename M> void run() {
+            engine->samplers[PRECISION_DOUBLE] = &Engine::sample_double<M>;
+            engine->samplers[PRECISION_DOUBLE_DOUBLE] = &Engine::sample_double_double<M>;
+            engine->samplers[PRECISION_MPFR] = &Engine::sample_mpfr<M>;
+            engine->samplers[PRECISION_PERTURBATION] = &Engine::sample_perturbed<M>;
+            engine->perturbable = M::plain_square;
+            engine->mirror_axes = M::mirror_axes(julia_c);
+        }
+    };
+
+    // Worker t goes to node t % nodes and, pinned, to CPU t / nodes of it,
+    // so a run smaller than the machine still spans every node
+    void place_workers() {
+        const int threads_n = settings.threads;
+        const int nodes = (int)topology.nodes.size();
+        const int used = std::min(nodes, threads_n);
+        worker_node.assign(threads_n, 0);
+        worker_cpus.assign(threads_n, std::vector<int>());
+        replicas.clear();
+        node_plates.clear();
+        reduce_cursor = 0;
+        if (nodes == 0)
+            return;
+        for (int t = 0; t < threads_n; t++) {
+            const NumaNode& node = topology.nodes[t % nodes];
+            worker_node[t] = t % nodes;
+            if (settings.pin_threads)
+                worker_cpus[t].assign(1, node.cpus[(t / nodes) % node.cpus.size()]);
+            else if (settings.node_replicas && used > 1)
+                worker_cpus[t] = node.cpus;
+        }
+
+        if (!settings.node_replicas || used < 2)
+            return;
+        replicas.resize(used);
+        std::vector<std::thread> builders;
+        for (int n = 0; n < used; n++) {
+            builders.push_back(std::thread([this, n]() {
+                pin_thread(topology.nodes[n].cpus);
+                for (size_t p = 0; p < plates.size(); p++) {
+                    const Plate& master = *plates[p];
+                    Plate* r = master.sparse ? NULL : new Plate(master.width, master.height, master.morton);
+                    if (r)
+                        for (size_t t = 0; t < r->tile_count(); t++)
+                            r->take_dirty((int)(t % r->tiles_x()), (int)(t / r->tiles_x()));
+                    replicas[n].push_back(std::unique_ptr<Plate>(r));
+                }
+            }));
+        }
+        for (size_t b = 0; b < builders.size(); b++)
+            builders[b].join();
+        node_plates.resize(used);
+        for (int n = 0; n < used; n++)
+            for (size_t p = 0; p < plates.size(); p++)
+                node_plates[n].push_back(replicas[n][p] ? replicas[n][p].get() : plates[p]);
+    }
+
+    bool next_range(int id, WorkRange& out) {
+        if (queues[id]->take(settings.chunk_size, out))
+            return true;
+        int n = (int)queues.size();
+        for (int k = 1; k < n; k++) {
+            int victim = (id + k) % n;
+            if (queues[victim]->steal(settings.chunk_size, out)) {
+                // Keep the stolen range at home so it can be stolen again
+                queues[id]->push(out);
+                return queues[id]->take(settings.chunk_size, out);
+            }
+        }
+        // Ranges are only ever split, never created, so empty stays empty
+        return false;
+    }
+
+    // Iterate from st.c; returns the iteration at which the orbit escaped,
+    // 0 if it stayed bounded for max_iterations, or ESCAPE_CYCLE if it came
+    // back within the model's tolerance of the point saved at iteration
+    // 1, 2, 4, 8, ... (Brent). With `orbit`, the points up to its horizon
+    // are projected into it on the way.
+    template <typename M, typename B>
+    int escape_time(OrbitState<B>& st, double r2, OrbitBuffer* orbit = NULL) {
+        const bool check = M::cycle_ulps > 0.0;
+        const int record = orbit && orbit->recording ? orbit->horizon : 0;
+        std::vector<PlateHit>* hits = orbit ? &orbit->hits : NULL;
+        int* length = orbit ? &orbit->length : NULL;
+        if (hits)
+            hits->clear();
+        M::begin(st.z, st.c, st.ms);
+        if (check) {
+            B::mul_d(st.tol, st.eps, M::cycle_ulps);
+            B::sqr(st.tol2, st.tol);
+            quaternion_set(st.saved, st.z);
+        }
+        typename B::value& t = st.ms.t;
+        typename B::value& u = st.ms.u;
+        int limit = 1;
+        for (int n = 1; n <= settings.max_iterations; n++) {
+            M::step(st.z, st.c, st.ms);
+            quaternion_norm2(st.norm, st.z);
+            if (M::template escaped<B>(st.norm, r2)) {
+                if (length)
+                    *length = n;
+                return n;
+            }
+            if (n <= record) {
+                project_images(st.proj, st.z, st.images, [hits](uint32_t p, int x, int y) {
+                    PlateHit h = { p, x, y };
+                    hits->push_back(h);
+                });
+            }
+            if (!check)
+                continue;
+            // One component first; most steps are far from the checkpoint
+            B::sub(t, st.z.r, st.saved.r);
+            B::abs(t, t);
+            B::sub(t, t, st.tol);
+            if (!B::greater_d(t, 0.0)) {
+                B::sub(u, st.z.r, st.saved.r);
+                B::sqr(t, u);
+                B::sub(u, st.z.i, st.saved.i);
+                B::fma(t, u, u, t);
+                B::sub(u, st.z.j, st.saved.j);
+                B::fma(t, u, u, t);
+                B::sub(u, st.z.k, st.saved.k);
+                B::fma(t, u, u, t);
+                // Strictly within, as the batched kernels in simd.hpp test
+                B::sub(t, st.tol2, t);
+                if (B::greater_d(t, 0.0)) {
+                    if (length)
+                        *length = n;
+                    return ESCAPE_CYCLE;
+                }
+            }
+            if (n == limit) {
+                quaternion_set(st.saved, st.z);
+                limit *= 2;
+            }
+        }
+        if (length)
+            *length = settings.max_iterations;
+        return 0;
+    }
+
+    // The same for a perturbation beam, without the cycle check: z is only
+    // known to the rounding of a double offset, far coarser than the beam's
+    // precision, so a near return cannot be told from a cycle
+    template <typename M>
+    int escape_time(PerturbedState& st, double r2, OrbitBuffer* orbit = NULL) {
+        const int record = orbit && orbit->recording ? orbit->horizon : 0;
+        std::vector<PlateHit>* hits = orbit ? &orbit->hits : NULL;
+        int* length = orbit ? &orbit->length : NULL;
+        if (hits)
+            hits->clear();
+        st.begin();
+        for (int n = 1; n <= settings.max_iterations; n++) {
+            st.step();
+            if (M::template escaped<DoubleBackend>(st.norm, r2)) {
+                if (length)
+                    *length = n;
+                return n;
+            }
+            if (n <= record) {
+                project_images(st.proj, st.z, st.images, [hits](uint32_t p, int x, int y) {
+                    PlateHit h = { p, x, y };
+                    hits->push_back(h);
+                });
+            }
+        }
+        if (length)
+            *length = settings.max_iterations;
+        return 0;
+    }
+
+    // Count `samples` samples that will not be splatted
+    static void count_interior(RejectStats& r, InteriorRegion region, int samples) {
+        if (region == INTERIOR_CARDIOID)
+            r.cardioid += samples;
+        else
+            r.bulb += samples;
+    }
+
+    static void count_escape(RejectStats& r, int n, int samples) {
+        if (n == ESCAPE_CYCLE)
+            r.cycle += samples;
+        else if (n == 0)
+            r.max_iterations += samples;
+    }
+
+    // Call hit(plate, x, y) for orbit point z of every sample in `images`.
+    // Plates that do not see the flipped components get z's own pixel once
+    // per sample; the others get each flipped point projected. z is
+    // flipped in place and back, which is exact.
+    template <typename B, typename F>
+    static void project_images(PlateProjections<B>& proj, QuaternionT<B>& z, const SampleImages& images, F hit) {
+        if (!images.symmetry) {
+            proj.project(z, hit);
+            return;
+        }
+        const Symmetry& sym = *images.symmetry;
+        int n = images.count();
+        proj.project(z, [&hit, n](uint32_t p, int x, int y) {
+            for (int k = 0; k < n; k++)
+                hit(p, x, y);
+        }, sym.axes, false);
+        for (int g = images.first; g < images.last; g++) {
+            unsigned f = sym.flips[g];
+            flip(z, f);
+            proj.project(z, hit, sym.axes, true);
+            flip(z, f);
+        }
+    }
+
+    template <typename B>
+    static void flip(QuaternionT<B>& z, unsigned f) {
+        if (f & 1)
+            B::neg(z.r, z.r);
+        if (f & 2)
+            B::neg(z.i, z.i);
+        if (f & 4)
+            B::neg(z.j, z.j);
+        if (f & 8)
+            B::neg(z.k, z.k);
+    }
+
+    // Replay an escaping orbit and deposit z[1] .. z[n-1] on every plate
+    template <typename M, typename B>
+    void splat(OrbitState<B>& st, WorkerContext& w, int n) {
+        TileCache& cache = w.cache;
+        w.counters.iterations += n - 1;
+        M::begin(st.z, st.c, st.ms);
+        for (int it = 1; it < n; it++) {
+            M::step(st.z, st.c, st.ms);
+            project_images(st.proj, st.z, st.images, [&cache](uint32_t p, int x, int y) { cache.deposit(p, x, y); });
+        }
+    }
+
+    template <typename M>
+    void splat(PerturbedState& st, WorkerContext& w, int n) {
+        TileCache& cache = w.cache;
+        w.counters.iterations += n - 1;
+        st.begin();
+        for (int it = 1; it < n; it++) {
+            st.step();
+            project_images(st.proj, st.z, st.images, [&cache](uint32_t p, int x, int y) { cache.deposit(p, x, y); });
+        }
+    }
+
+    void deposit(const std::vector<PlateHit>& hits, WorkerContext& w) {
+        for (size_t h = 0; h < hits.size(); h++)
+            w.cache.deposit(hits[h].plate, hits[h].x, hits[h].y);
+    }
+
+    // Like splat, but only record where z[1] .. z[n-1] land
+    template <typename M, typename B>
+    void trace(OrbitState<B>& st, int n, std::vector<PlateHit>& hits) {
+        hits.clear();
+        M::begin(st.z, st.c, st.ms);
+        for (int it = 1; it < n; it++) {
+            M::step(st.z, st.c, st.ms);
+            st.proj.project(st.z, [&hits](uint32_t p, int x, int y) {
+                PlateHit h = { p, x, y };
+                hits.push_back(h);
+            });
+        }
+    }
+
+    template <typename M>
+    void trace(PerturbedState& st, int n, std::vector<PlateHit>& hits) {
+        hits.clear();
+        st.begin();
+        for (int it = 1; it < n; it++) {
+            st.step();
+            st.proj.project(st.z, [&hits](uint32_t p, int x, int y) {
+                PlateHit h = { p, x, y };
+                hits.push_back(h);
+            });
+        }
+    }
+
+    // Interior tests, then escape time, counting whatever is rejected;
+    // returns the escape iteration or <= 0 if the orbit stays bounded. If
+    // w.orbit is recording, the orbit's first points are in it.
+    template <typename M, typename S>
+    int orbit_escape(S& st, WorkerContext& w, double r2) {
+        int samples = st.images.count();
+        w.counters.samples += samples;
+        InteriorRegion region = M::interior(st.c, st.ms);
+        if (region != INTERIOR_NONE) {
+            count_interior(w.rejects, region, samples);
+            w.counters.interior += samples;
+            w.orbit.length = 0;
+            w.orbit.finish(0);
+            return 0;
+        }
+        int n = escape_time<M>(st, r2, &w.orbit);
+        count_escape(w.rejects, n, samples);
+        w.counters.iterations += w.orbit.length;
+        if (n > 0)
+            w.counters.escaped += samples;
+        w.orbit.finish(n);
+        return n;
+    }
+
+    // Start st from seed c of a beam
+    template <typename B>
+    void seed(OrbitState<B>& st, WorkerContext& w, size_t, const Quaternion& c) {
+        st.c.set(c, w.t);
+    }
+
+    void seed(PerturbedState& st, WorkerContext& w, size_t beam, const Quaternion& c) {
+        mpfr_srcptr cs[4] = { c.r, c.i, c.j, c.k };
+        mpfr_srcptr mu[4] = { beams[beam]->mu.r, beams[beam]->mu.i, beams[beam]->mu.j, beams[beam]->mu.k };
+        quaternion_set(st.c, c);
+        for (int k = 0; k < 4; k++) {
+            mpfr_sub(w.t, cs[k], mu[k], MPFR_RNDN);
+            st.dc[k] = mpfr_get_d(w.t, MPFR_RNDN);
+        }
+    }
+
+    // Sample `index` of a beam into st, in double form for the double tier
+    template <typename S>
+    void draw(S& st, WorkerContext& w, size_t beam, int64_t index) {
+        CounterRng rng(keys[beam], (uint64_t)index);
+        beams[beam]->get_sample(w.sample[beam], rng);
+        seed(st, w, beam, w.sample[beam]);
+    }
+
+    void draw(OrbitState<DoubleBackend>& st, WorkerContext&, size_t beam, int64_t index) {
+        CounterRng rng(keys[beam], (uint64_t)index);
+        double q[4];
+        beams[beam]->get_sample(q, rng);
+        st.c.set(q[0], q[1], q[2], q[3]);
+    }
+
+    // Metropolis-Hastings over one range of a beam: one chain step per
+    // sample index. The target density is the Gaussian times g, the
+    // number of orbit points landing on the plates; a Gaussian proposal
+    // cancels the Gaussian factor, a symmetric small step keeps it. The
+    // current seed's points are deposited with weight MH_STEP_WEIGHT / g,
+    // stochastically rounded, every step. A chain starts afresh at the
+    // range's start and at every multiple of MH_CHAIN_STEPS, and step s
+    // draws only from (seed, s), so the result does not depend on which
+    // worker ran what. Stops only between chains.
+    template <typename M, typename S>
+    int64_t run_range_mh(const WorkRange& range, WorkerContext& w, S& st) {
+        Beam* beam = beams[range.beam];
+        Quaternion& proposal = w.sample[range.beam];
+        std::unique_ptr<MetropolisChain>& chain = w.chains[range.beam];
+        if (!chain)
+            chain.reset(new MetropolisChain(precision[range.beam].bits, w.arena));
+        const double r2 = settings.escape_radius * settings.escape_radius;
+        const double log_span = 24.0 * log(2.0); // Small steps span 2^-24 .. 1 of mh_mutation
+        int64_t done = 0, accepted = 0, large_steps = 0, large_hits = 0;
+        // Chains have no symmetry
+        st.images = SampleImages();
+        for (int64_t s = range.begin; s < range.end; s++) {
+            if (s == range.begin || s % MH_CHAIN_STEPS == 0) {
+                if (stop_requested.load(std::memory_order_relaxed))
+                    break;
+                chain->g = 0;
+                chain->hits.clear();
+            }
+            done++;
+            CounterRng rng(keys[range.beam], (uint64_t)s, RNG_STREAM_CHAIN);
+            // A chain that has not found the plates yet only draws fresh seeds
+            bool large = chain->g == 0 || rng.uniform() < beam->mh_large_step;
+            if (large)
+                beam->get_sample(proposal, rng);
+            else
+                beam->mutate(proposal, chain->c, beam->mh_mutation * exp(-log_span * rng.uniform()), rng);
+            seed(st, w, range.beam, proposal);
+            int n = orbit_escape<M>(st, w, r2);
+            w.proposal_hits.clear();
+            if (w.orbit.complete)
+                w.proposal_hits.swap(w.orbit.hits);
+            else if (n > 1) {
+                trace<M>(st, n, w.proposal_hits);
+                w.counters.iterations += n - 1;
+            }
+            int64_t g = (int64_t)w.proposal_hits.size();
+            if (large) {
+                large_steps++;
+                large_hits += g;
+            }
+
+            bool accept = false;
+            double lp = beam->log_prior(proposal, w.t);
+            if (g > 0 && chain->g == 0) {
+                accept = true;
+            } else if (g > 0) {
+                double ratio = (double)g / (double)chain->g;
+                if (!large)
+                    ratio *= exp(lp - chain->log_prior);
+                accept = ratio >= 1.0 || rng.uniform() < ratio;
+            }
+            if (accept) {
+                quaternion_swap(chain->c, proposal);
+                chain->log_prior = lp;
+                chain->g = g;
+                chain->hits.swap(w.proposal_hits);
+                accepted++;
+            }
+
+            if (chain->g > 0) {
+                double weight = MH_STEP_WEIGHT / (double)chain->g;
+                uint32_t whole = (uint32_t)weight;
+                double frac = weight - whole;
+                for (size_t h = 0; h < chain->hits.size(); h++) {
+                    const PlateHit& hit = chain->hits[h];
+                    uint32_t count = whole + (rng.uniform() < frac ? 1 : 0);
+                    if (count)
+                        w.cache.deposit(hit.plate, hit.x, hit.y, count);
+                }
+            }
+            w.poll();
+        }
+        beam->mh_proposals.fetch_add(done, std::memory_order_relaxed);
+        beam->mh_accepted.fetch_add(accepted, std::memory_order_relaxed);
+        beam->mh_large_steps.fetch_add(large_steps, std::memory_order_relaxed);
+        beam->mh_large_hits.fetch_add(large_hits, std::memory_order_relaxed);
+        return done;
+    }
+
+    // The draw behind sample s of a beam and the images of it from s up to
+    // the end of its group or of the range
+    SampleImages images_from(size_t beam, int64_t s, int64_t end, int64_t& base) const {
+        const Symmetry& sym = symmetry[beam];
+        base = s - s % sym.order;
+        int64_t last = std::min<int64_t>(base + sym.order, end);
+        return SampleImages(sym.order > 1 ? &sym : NULL, (int)(s - base), (int)(last - base));
+    }
+
+    // Sample and splat one range of a beam with iteration state S; returns
+    // the number of samples done. One orbit is iterated per group of
+    // mirror images.
+    template <typename M, typename S>
+    int64_t run_range(const WorkRange& range, WorkerContext& w, S& st) {
+        const double r2 = settings.escape_radius * settings.escape_radius;
+        int64_t done = 0;
+        for (int64_t s = range.begin; s < range.end; s += st.images.count()) {
+            if (stop_requested.load(std::memory_order_relaxed))
+                break;
+            int64_t base;
+            st.images = images_from(range.beam, s, range.end, base);
+            draw(st, w, range.beam, base);
+            done += st.images.count();
+            int n = orbit_escape<M>(st, w, r2);
+            if (w.orbit.complete)
+                deposit(w.orbit.hits, w);
+            else if (n > 1)
+                splat<M>(st, w, n);
+            w.poll();
+        }
+        return done;
+    }
+
+    // Double precision z^2 + c: the SIMD kernel finds the escape times of a
+    // whole block of samples, then the escaping orbits are replayed one by
+    // one to splat them
+    template <typename M>
+    int64_t run_range_simd(const WorkRange& range, WorkerContext& w, OrbitState<DoubleBackend>& st) {
+        const double r2 = settings.escape_radius * settings.escape_radius;
+        const EscapeKernel& kernel = escape_kernel();
+        const double cycle_tol = ldexp(M::cycle_ulps, -53);
+        w.cr.resize(SIMD_BLOCK);
+        w.ci.resize(SIMD_BLOCK);
+        w.cj.resize(SIMD_BLOCK);
+        w.ck.resize(SIMD_BLOCK);
+        w.escape.resize(SIMD_BLOCK);
+        w.lanes.resize(SIMD_BLOCK);
+        int64_t done = 0;
+        for (int64_t s = range.begin; s < range.end; ) {
+            if (stop_requested.load(std::memory_order_relaxed))
+                break;
+            // Up to SIMD_BLOCK draws; samples inside the cardioid or bulb
+            // never reach the kernel
+            int m = 0;
+            for (int b = 0; b < SIMD_BLOCK && s < range.end; b++) {
+                int64_t base;
+                SampleImages images = images_from(range.beam, s, range.end, base);
+                draw(st, w, range.beam, base);
+                s += images.count();
+                done += images.count();
+                w.counters.samples += images.count();
+                InteriorRegion region = M::interior(st.c, st.ms);
+                if (region != INTERIOR_NONE) {
+                    count_interior(w.rejects, region, images.count());
+                    w.counters.interior += images.count();
+                    continue;
+                }
+                w.cr[m] = st.c.r;
+                w.ci[m] = st.c.i;
+                w.cj[m] = st.c.j;
+                w.ck[m] = st.c.k;
+                w.lanes[m] = images;
+                m++;
+            }
+            w.counters.iterations += kernel.run(&w.cr[0], &w.ci[0], &w.cj[0], &w.ck[0], m, settings.max_iterations, r2, cycle_tol, &w.escape[0]);
+            for (int b = 0; b < m; b++) {
+                count_escape(w.rejects, w.escape[b], w.lanes[b].count());
+                if (w.escape[b] > 0)
+                    w.counters.escaped += w.lanes[b].count();
+                if (w.escape[b] > 1) {
+                    st.c.set(w.cr[b], w.ci[b], w.cj[b], w.ck[b]);
+                    st.images = w.lanes[b];
+                    splat<M>(st, w, w.escape[b]);
+                }
+                w.poll();
+            }
+        }
+        return done;
+    }
+
+    // Sampling loops of one model, one per precision tier
+    template <typename M>
+    int64_t sample_double(const WorkRange& range, WorkerContext& w) {
+        if (!w.d)
+            w.d.reset(new OrbitState<DoubleBackend>(53, settings.julia_c, view_ptrs, w.arena));
+        if (beams[range.beam]->mode == SAMPLING_METROPOLIS)
+            return run_range_mh<M>(range, w, *w.d);
+        if (M::plain_square)
+            return run_range_simd<M>(range, w, *w.d);
+        return run_range<M>(range, w, *w.d);
+    }
+
+    template <typename M>
+    int64_t sample_double_double(const WorkRange& range, WorkerContext& w) {
+        if (!w.dd)
+            w.dd.reset(new OrbitState<DoubleDoubleBackend>(106, settings.julia_c, view_ptrs, w.arena));
+        if (beams[range.beam]->mode == SAMPLING_METROPOLIS)
+            return run_range_mh<M>(range, w, *w.dd);
+        return run_range<M>(range, w, *w.dd);
+    }
+
+    template <typename M>
+    int64_t sample_mpfr(const WorkRange& range, WorkerContext& w) {
+        mpfr_prec_t bits = precision[range.beam].bits;
+        std::unique_ptr<OrbitState<MpfrBackend> >& st = w.mp[bits];
+        if (!st)
+            st.reset(new OrbitState<MpfrBackend>(bits, settings.julia_c, view_ptrs, w.arena));
+        if (beams[range.beam]->mode == SAMPLING_METROPOLIS)
+            return run_range_mh<M>(range, w, *st);
+        return run_range<M>(range, w, *st);
+    }
+
+    template <typename M>
+    int64_t sample_perturbed(const WorkRange& range, WorkerContext& w) {
+        // Only picked for z^2 + c
+        if (!M::plain_square)
+            return sample_mpfr<M>(range, w);
+        mpfr_prec_t bits = precision[range.beam].bits;
+        ReferenceOrbit& ref = *references[range.beam];
+        const Beam& beam = *beams[range.beam];
+        const double r2 = settings.escape_radius * settings.escape_radius;
+        const int max_iterations = settings.max_iterations;
+        std::call_once(ref.once, [&ref, &beam, bits, max_iterations, r2]() {
+            ref.compute(beam.mu, bits, max_iterations, r2);
+        });
+        std::unique_ptr<PerturbedState>& st = w.pt[bits];
+        if (!st)
+            st.reset(new PerturbedState(bits, view_ptrs, w.arena));
+        st->ref = &ref;
+        if (beams[range.beam]->mode == SAMPLING_METROPOLIS)
+            return run_range_mh<M>(range, w, *st);
+        return run_range<M>(range, w, *st);
+    }
+
+    void worker_main(int id) {
+        int images = 1;
+        for (size_t b = 0; b < symmetry.size(); b++)
+            images = std::max(images, symmetry[b].order);
+        // Placed before anything is allocated, so the worker's buffers are
+        // first touched on its own node
+        if (!worker_cpus[id].empty())
+            pin_thread(worker_cpus[id]);
+        WorkerContext w(node_plates.empty() ? plates : node_plates[worker_node[id]], settings, scratch_bits, images, telemetry_slots[id].get());
+
+        w.sample.reserve(beams.size());
+        w.chains.resize(beams.size());
+        for (size_t b = 0; b < beams.size(); b++)
+            w.sample.push_back(Quaternion(precision[b].bits, w.arena));
+
+        WorkRange range;
+        while (!stop_requested.load(std::memory_order_relaxed) && next_range(id, range)) {
+            // The backend and model are fixed per range, never tested inside the loop
+            w.range_ns = steady_ns();
+            int64_t done = (this->*samplers[precision[range.beam].tier])(range, w);
+            w.counters.busy_ns += steady_ns() - w.range_ns;
+            w.range_ns = 0;
+            rejected_cardioid.fetch_add(w.rejects.cardioid, std::memory_order_relaxed);
+            rejected_bulb.fetch_add(w.rejects.bulb, std::memory_order_relaxed);
+            rejected_cycle.fetch_add(w.rejects.cycle, std::memory_order_relaxed);
+            rejected_max_iterations.fetch_add(w.rejects.max_iterations, std::memory_order_relaxed);
+            w.rejects = RejectStats();
+            beams[range.beam]->samples_current.fetch_add(done);
+            // Cut short by stop(): hand the rest back so it is kept as pending
+            if (range.begin + done < range.end) {
+                range.begin += done;
+                queues[id]->push(range);
+            }
+        }
+
+        int64_t flush_start = steady_ns();
+        w.cache.flush_all();
+        int64_t now = steady_ns();
+        w.counters.busy_ns += now - flush_start;
+        w.publish(now);
+        if (workers_running.fetch_sub(1) == 1)
+            end_ns.store(steady_ns());
+    }
+};
+
+#endif
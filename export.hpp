@@ -0,0 +1,381 @@
+#ifndef EXPORT_HPP
+#define EXPORT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "plate.hpp"
+#include "preview.hpp"
+
+// Streaming image export. The plate is tone mapped with its ToneSettings,
+// after one statistics pass, and written a band of rows at a time; each
+// band is mapped on all threads. Memory stays within about twice
+// EXPORT_BAND_BYTES (a band and its PNG deflate output), whatever the size
+// of the plate.
+//
+//   PNG   16-bit RGB. Each band is deflated in pieces on all threads and
+//         the pieces are joined into one zlib stream, as pigz does.
+//   TIFF  16-bit RGB in uncompressed EXPORT_TIFF_TILE tiles; BigTIFF when
+//         the file would pass 4 GB.
+//   Raw   The curve's level in [0, 1] per pixel, before the colormap, as
+//         host-order float32, row by row, no header.
+//
+// Safe while workers are merging, like Plate::save().
+
+enum ExportFormat { EXPORT_PNG, EXPORT_TIFF, EXPORT_RAW, EXPORT_FORMAT_COUNT };
+static const char* const export_formats[] = { "PNG", "TIFF", "Raw" };
+static const char* const export_extensions[] = { "png", "tif", "raw" };
+
+static const size_t EXPORT_BAND_BYTES = 64 << 20; // Image bytes mapped at once
+static const int EXPORT_TIFF_TILE = 256;
+static const int EXPORT_PNG_LEVEL = 3;            // zlib level; higher buys little on these images
+
+// Shared with the thread running an export
+struct ExportProgress {
+    std::atomic<int64_t> rows;       // Image rows written
+    std::atomic<bool> cancel;        // Set to stop; the file is removed
+    ExportProgress() : rows(0), cancel(false) {}
+};
+
+inline void export_be32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+inline bool export_write(FILE* f, const void* data, size_t n) {
+    return n == 0 || fwrite(data, 1, n, f) == n;
+}
+
+// Whether to stop, counting `rows` more as done otherwise
+inline bool export_step(ExportProgress* progress, int64_t rows) {
+    if (!progress)
+        return false;
+    progress->rows += rows;
+    return progress->cancel.load();
+}
+
+// One PNG chunk
+inline bool export_png_chunk(FILE* f, const char* type, const unsigned char* data, size_t n) {
+    unsigned char head[8], tail[4];
+    export_be32(head, (uint32_t)n);
+    memcpy(head + 4, type, 4);
+    uLong crc = crc32(crc32(0, Z_NULL, 0), head + 4, 4);
+    if (n)
+        crc = crc32(crc, data, (uInt)n);
+    export_be32(tail, (uint32_t)crc);
+    return export_write(f, head, 8) && export_write(f, data, n) && export_write(f, tail, 4);
+}
+
+inline bool export_png(const Plate& plate, const ToneMap& tone, FILE* f, int threads, ExportProgress* progress) {
+    const int w = plate.width, h = plate.height;
+    const size_t row_bytes = 1 + 6 * (size_t)w;      // Filter byte, then big-endian RGB
+    const int band = (int)std::max<size_t>(1, std::min<size_t>(EXPORT_BAND_BYTES / row_bytes, h));
+    std::vector<unsigned char> image((size_t)band * row_bytes);
+    std::vector<std::vector<unsigned char> > packed(threads);
+    std::vector<uLong> adler(threads);
+    std::vector<size_t> length(threads);
+    std::vector<char> failed(threads, 0);            // Piece t could not be deflated
+
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    unsigned char ihdr[13] = { 0 };
+    export_be32(ihdr, (uint32_t)w);
+    export_be32(ihdr + 4, (uint32_t)h);
+    ihdr[8] = 16;                                      // Bits per sample
+    ihdr[9] = 2;                                       // RGB
+    static const unsigned char zlib_header[2] = { 0x78, 0x01 };
+    bool ok = export_write(f, signature, 8) && export_png_chunk(f, "IHDR", ihdr, 13) &&
+              export_png_chunk(f, "IDAT", zlib_header, 2);
+    uLong total = adler32(0, Z_NULL, 0);
+
+    for (int y0 = 0; ok && y0 < h; y0 += band) {
+        const int n = std::min(band, h - y0);
+        const bool end = y0 + n == h;
+        tone_parallel((size_t)n, threads, [&](int t, size_t begin, size_t stop) {
+            std::vector<int64_t> counts(w);
+            std::vector<uint16_t> rgb(3 * (size_t)w);
+            for (size_t r = begin; r < stop; r++) {
+                unsigned char* dst = &image[r * row_bytes];
+                plate.read_row(y0 + (int)r, &counts[0]);
+                tone.map16(&counts[0], &rgb[0], w);
+                // Filter 1 (Sub): each byte less the one a pixel to its left
+                dst[0] = 1;
+                for (size_t i = 0; i < rgb.size(); i++) {
+                    dst[1 + 2 * i] = (unsigned char)(rgb[i] >> 8);
+                    dst[2 + 2 * i] = (unsigned char)rgb[i];
+                }
+                for (size_t i = row_bytes - 1; i > 6; i--)
+                    dst[i] -= dst[i - 6];
+            }
+            // Raw deflate of this piece; a sync flush ends it on a byte
+            // boundary so the pieces concatenate, and the last one finishes
+            const unsigned char* in = image.data() + begin * row_bytes;
+            length[t] = (stop - begin) * row_bytes;
+            adler[t] = adler32(adler32(0, Z_NULL, 0), in, (uInt)length[t]);
+            z_stream z;
+            memset(&z, 0, sizeof(z));
+            std::vector<unsigned char>& out = packed[t];
+            out.clear();
+            if (deflateInit2(&z, EXPORT_PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                failed[t] = 1;
+                return;
+            }
+            out.resize(deflateBound(&z, (uLong)length[t]) + 64);
+            z.next_in = (Bytef*)in;
+            z.avail_in = (uInt)length[t];
+            z.next_out = &out[0];
+            z.avail_out = (uInt)out.size();
+            int flush = end && stop == (size_t)n ? Z_FINISH : Z_SYNC_FLUSH;
+            for (;;) {
+                int rc = deflate(&z, flush);
+                if (rc == Z_STREAM_ERROR) {
+                    failed[t] = 1;
+                    break;
+                }
+                if (z.avail_out && (flush == Z_FINISH ? rc == Z_STREAM_END : !z.avail_in))
+                    break;
+                if (z.avail_out == 0) {
+                    size_t done = out.size();
+                    out.resize(done * 2);
+                    z.next_out = &out[done];
+                    z.avail_out = (uInt)done;
+                }
+            }
+            out.resize(z.total_out);
+            deflateEnd(&z);
+        });
+        for (int t = 0; ok && t < threads; t++) {
+            if (failed[t]) {
+                errno = ENOMEM;                        // zlib only fails here for want of memory
+                ok = false;
+                break;
+            }
+            total = adler32_combine(total, adler[t], (z_off_t)length[t]);
+            ok = packed[t].empty() || export_png_chunk(f, "IDAT", &packed[t][0], packed[t].size());
+        }
+        if (export_step(progress, n))
+            return false;
+    }
+    unsigned char check[4];
+    export_be32(check, (uint32_t)total);
+    return ok && export_png_chunk(f, "IDAT", check, 4) && export_png_chunk(f, "IEND", NULL, 0);
+}
+
+// TIFF directory entry; `value` holds the value itself when it fits in
+// the field, or else the offset of where it is
+struct ExportTiffEntry {
+    uint16_t tag, type;
+    uint64_t count;
+    unsigned char value[8];
+};
+
+inline ExportTiffEntry export_tiff_entry(uint16_t tag, uint16_t type, uint64_t count, const void* value, size_t bytes) {
+    ExportTiffEntry e;
+    e.tag = tag;
+    e.type = type;
+    e.count = count;
+    memset(e.value, 0, sizeof(e.value));
+    memcpy(e.value, value, bytes);
+    return e;
+}
+
+inline bool export_tiff(const Plate& plate, const ToneMap& tone, FILE* f, int threads, ExportProgress* progress) {
+    const int w = plate.width, h = plate.height, side = EXPORT_TIFF_TILE;
+    const uint64_t across = (w + side - 1) / side, down = (h + side - 1) / side, tiles = across * down;
+    const uint64_t tile_bytes = (uint64_t)side * side * 6;
+    const int entries = 10;                           // Besides TileByteCounts
+    // Classic TIFF unless the offsets need 64 bits
+    uint64_t directory = 8, classic_data = directory + 2 + (entries + 1) * 12 + 4 + 8 + tiles * 8;
+    const bool big = classic_data + tiles * tile_bytes > UINT32_MAX;
+    if (big)
+        directory = 16;
+    const uint64_t field = big ? 8 : 4;
+    const uint64_t bits_at = directory + (big ? 8 : 2) + (entries + 1) * (big ? 20 : 12) + field;
+    // Arrays that fit in the entry's field must be stored there, not pointed at
+    const bool offsets_inline = tiles * field <= field, counts_inline = tiles * 4 <= field;
+    const uint64_t offsets_at = bits_at + 8, counts_at = offsets_at + (offsets_inline ? 0 : tiles * field);
+    const uint64_t data_at = counts_at + (counts_inline ? 0 : tiles * 4);
+
+    uint16_t probe = 1;
+    unsigned char little;
+    memcpy(&little, &probe, 1);
+    unsigned char header[16] = { 0 };
+    header[0] = header[1] = little ? 'I' : 'M';
+    uint16_t magic = big ? 43 : 42;
+    memcpy(header + 2, &magic, 2);
+    if (big) {
+        uint16_t size = 8, zero = 0;
+        memcpy(header + 4, &size, 2);
+        memcpy(header + 6, &zero, 2);
+        memcpy(header + 8, &directory, 8);
+    } else {
+        uint32_t at = (uint32_t)directory;
+        memcpy(header + 4, &at, 4);
+    }
+    bool ok = export_write(f, header, (size_t)directory);
+
+    const uint16_t SHORT = 3, LONG = 4, LONG8 = 16;
+    uint32_t width = (uint32_t)w, height = (uint32_t)h, tile = (uint32_t)side;
+    uint16_t bits[4] = { 16, 16, 16, 0 }, none = 1, rgb = 2, samples = 3, chunky = 1;
+    uint32_t bits_at32 = (uint32_t)bits_at;
+    uint64_t offsets = offsets_inline ? data_at : offsets_at;
+    uint32_t offsets32 = (uint32_t)offsets, bytes = (uint32_t)tile_bytes;
+    ExportTiffEntry e[entries] = {
+        export_tiff_entry(256, LONG, 1, &width, 4),                          // ImageWidth
+        export_tiff_entry(257, LONG, 1, &height, 4),                         // ImageLength
+        big ? export_tiff_entry(258, SHORT, 3, bits, 6) : export_tiff_entry(258, SHORT, 3, &bits_at32, 4), // BitsPerSample
+        export_tiff_entry(259, SHORT, 1, &none, 2),                          // Compression
+        export_tiff_entry(262, SHORT, 1, &rgb, 2),                           // PhotometricInterpretation
+        export_tiff_entry(277, SHORT, 1, &samples, 2),                       // SamplesPerPixel
+        export_tiff_entry(284, SHORT, 1, &chunky, 2),                        // PlanarConfiguration
+        export_tiff_entry(322, LONG, 1, &tile, 4),                           // TileWidth
+        export_tiff_entry(323, LONG, 1, &tile, 4),                           // TileLength
+        big ? export_tiff_entry(324, LONG8, tiles, &offsets, 8) : export_tiff_entry(324, LONG, tiles, &offsets32, 4), // TileOffsets
+    };
+    if (big) {
+        uint64_t count = entries + 1;
+        ok = ok && export_write(f, &count, 8);
+    } else {
+        uint16_t count = entries + 1;
+        ok = ok && export_write(f, &count, 2);
+    }
+    for (int i = 0; i < entries && ok; i++) {
+        if (big) {
+            ok = export_write(f, &e[i].tag, 2) && export_write(f, &e[i].type, 2) && export_write(f, &e[i].count, 8) &&
+                 export_write(f, e[i].value, 8);
+        } else {
+            uint32_t count = (uint32_t)e[i].count;
+            ok = export_write(f, &e[i].tag, 2) && export_write(f, &e[i].type, 2) && export_write(f, &count, 4) &&
+                 export_write(f, e[i].value, 4);
+        }
+    }
+    // TileByteCounts, written by hand since its type is always LONG
+    uint16_t counts_tag = 325;
+    unsigned char counts[8] = { 0 };
+    if (counts_inline) {
+        for (uint64_t t = 0; t < tiles; t++)
+            memcpy(counts + 4 * t, &bytes, 4);
+    } else {
+        uint32_t at32 = (uint32_t)counts_at;
+        memcpy(counts, big ? (const void*)&counts_at : (const void*)&at32, (size_t)field);
+    }
+    ok = ok && export_write(f, &counts_tag, 2) && export_write(f, &LONG, 2);
+    if (big) {
+        ok = ok && export_write(f, &tiles, 8);
+    } else {
+        uint32_t count = (uint32_t)tiles;
+        ok = ok && export_write(f, &count, 4);
+    }
+    uint64_t next = 0;
+    ok = ok && export_write(f, counts, (size_t)field) && export_write(f, &next, (size_t)field) && export_write(f, bits, 8);
+    // Every tile is the same size, so where each one goes is known now
+    for (uint64_t t = 0; ok && !offsets_inline && t < tiles; t++) {
+        uint64_t at = data_at + t * tile_bytes;
+        uint32_t at32 = (uint32_t)at;
+        ok = export_write(f, big ? (const void*)&at : (const void*)&at32, (size_t)field);
+    }
+    for (uint64_t t = 0; ok && !counts_inline && t < tiles; t++)
+        ok = export_write(f, &bytes, 4);
+
+    // A row of tiles at a time, in chunks of up to `chunk` tiles
+    const int chunk = (int)std::max<uint64_t>(1, std::min<uint64_t>(EXPORT_BAND_BYTES / tile_bytes, across));
+    std::vector<uint16_t> image((size_t)chunk * side * side * 3);
+    for (int ty = 0; ok && ty < (int)down; ty++) {
+        for (int tx0 = 0; ok && tx0 < (int)across; tx0 += chunk) {
+            const int k = std::min(chunk, (int)across - tx0);
+            tone_parallel((size_t)k * side, threads, [&](int, size_t begin, size_t stop) {
+                std::vector<int64_t> counts(side);
+                for (size_t u = begin; u < stop; u++) {
+                    int t = (int)(u / side), r = (int)(u % side);
+                    int y = ty * side + r, x0 = (tx0 + t) * side;
+                    int m = y < h ? std::min(side, w - x0) : 0;
+                    uint16_t* dst = &image[((size_t)t * side + r) * side * 3];
+                    if (m > 0) {
+                        plate.read_span(y, x0, m, &counts[0]);
+                        tone.map16(&counts[0], dst, m);
+                    }
+                    std::fill(dst + 3 * m, dst + 3 * side, (uint16_t)0);
+                }
+            });
+            ok = export_write(f, &image[0], (size_t)k * tile_bytes);
+        }
+        if (export_step(progress, std::min(side, h - ty * side)))
+            return false;
+    }
+    return ok;
+}
+
+inline bool export_raw(const Plate& plate, const ToneMap& tone, FILE* f, int threads, ExportProgress* progress) {
+    const int w = plate.width, h = plate.height;
+    const int band = (int)std::max<size_t>(1, std::min<size_t>(EXPORT_BAND_BYTES / (4 * (size_t)w), h));
+    std::vector<float> image((size_t)band * w);
+    bool ok = true;
+    for (int y0 = 0; ok && y0 < h; y0 += band) {
+        const int n = std::min(band, h - y0);
+        tone_parallel((size_t)n, threads, [&](int, size_t begin, size_t stop) {
+            std::vector<int64_t> counts(w);
+            for (size_t r = begin; r < stop; r++) {
+                plate.read_row(y0 + (int)r, &counts[0]);
+                tone.levels(&counts[0], &image[r * w], w);
+            }
+        });
+        ok = export_write(f, &image[0], (size_t)n * w * sizeof(float));
+        if (export_step(progress, n))
+            return false;
+    }
+    return ok;
+}
+
+// Write `plate` to `path` as `format` on `threads` threads, coloured by
+// `settings`, a copy taken by the caller so the plate's own may change
+// meanwhile. The file is written next to `path` and renamed over it, as
+// Plate::save() does. Returns false with `error` set on failure or when
+// cancelled.
+inline bool export_plate(const Plate& plate, const ToneSettings& settings, const char* path, int format, int threads,
+                         std::string& error, ExportProgress* progress = NULL) {
+    threads = std::max(1, threads);
+    ToneStats stats;
+    plate_tone_stats(plate, threads, stats);
+    ToneMap tone;
+    tone.prepare(settings, stats, format != EXPORT_RAW);
+
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        error = tmp + ": " + strerror(errno);
+        return false;
+    }
+    bool ok;
+    switch (format) {
+    case EXPORT_PNG: ok = export_png(plate, tone, f, threads, progress); break;
+    case EXPORT_TIFF: ok = export_tiff(plate, tone, f, threads, progress); break;
+    default: ok = export_raw(plate, tone, f, threads, progress); break;
+    }
+    if (!ok)
+        error = progress && progress->cancel.load() ? "cancelled" : tmp + ": " + strerror(errno);
+    if (fclose(f) != 0 && ok) {
+        error = tmp + ": " + strerror(errno);
+        ok = false;
+    }
+#ifdef _WIN32
+    if (ok)
+        remove(path);
+#endif
+    if (ok && rename(tmp.c_str(), path) != 0) {
+        error = std::string(path) + ": " + strerror(errno);
+        ok = false;
+    }
+    if (!ok)
+        remove(tmp.c_str());
+    return ok;
+}
+
+#endif
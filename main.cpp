@@ -25,6 +25,13 @@
 // Copy constructor and assignment operator are defined.
 // .set(4*str), .set(4*double), 
 #include "quaternion.hpp"
+#include "beam.hpp"
+#include "plate.hpp"
+#include "models.hpp"
+#include "engine.hpp"
+#include "preview.hpp"
+#include "export.hpp"
+#include "scene.hpp"
 
 // C++11 make_unique and make_shared
 template <typename T, typename... Args>
@@ -38,93 +45,6 @@ std::shared_ptr<T> make_shared(Args&&... args) {
     return std::shared_ptr<T>(new T(std::forward<Args>(args)...));
 }
 
-// Beam class with Quaternion for mu and sigma
-class Beam {
-public:
-    Quaternion mu;                  // Quaternion for mu parameters
-    Quaternion sigma;               // Quaternion for sigma parameters
-    int samples_total;
-    int samples_current;
-    std::string seed_start; // String seed
-    // MPFR_PRNG_state state_current;   // State of the PRNG
-
-    Beam() : samples_total(0), samples_current(0), seed_start("") {
-        printf("Entering Beam constructor. Parameters: %d %d %s\n", samples_total, samples_current, seed_start.c_str());
-        // initialize quaternion variables
-        mpfr_set_d(mu.r, 0.0, MPFR_RNDN);
-        mpfr_set_d(mu.i, 0.0, MPFR_RNDN);
-        mpfr_set_d(mu.j, 0.0, MPFR_RNDN);
-        mpfr_set_d(mu.k, 0.0, MPFR_RNDN);
-
-        mpfr_set_d(sigma.r, 0.0, MPFR_RNDN);
-        mpfr_set_d(sigma.i, 0.0, MPFR_RNDN);
-        mpfr_set_d(sigma.j, 0.0, MPFR_RNDN);
-        mpfr_set_d(sigma.k, 0.0, MPFR_RNDN);
-
-        // Initialize the PRNG state
-        // mpfr_prng_init(state_current);
-
-    }
-
-    ~Beam() {
-        printf("Entering Beam destructor\n");
-        // Destructor to clean up if needed
-    }
-
-    void get_sample(/*args*/) {
-        // Method to get a sample
-    }
-};
-
-
-// Plate class
-class Plate {
-public:
-    /* 4D to 3D projection matrix */
-    mpfr_t projection4[5][4];        // Projection matrix
-    /*  3D to 2D projection matrix */
-    mpfr_t projection3[4][3];        // Projection matrix
-    // ColorMap colormap;              // Color map
-    int width, height;               // Dimensions
-    std::vector<std::vector<int64_t>> data; // Data
-    //std::vector<std::mutex> row_locks; // Locks for each row (TODO: make ReadWriteLock)
-
-    Plate(int w, int h) : width(w), height(h) {
-        // Initialize MPFR variables
-        for (int i = 0; i < 5; i++)
-            for (int j = 0; j < 4; j++)
-                mpfr_init(projection4[i][j]);
-
-        for (int i = 0; i < 4; i++)
-            for (int j = 0; j < 3; j++)
-                mpfr_init(projection3[i][j]);
-
-        // Initialize data and locks
-        data.resize(width, std::vector<int64_t>(height, 0));
-        // row_locks.resize(height); // This makes the compiler angry!
-        //for (int i = 0; i < height; i++)
-        //    row_locks.push_back(std::mutex());
-        // This still makes the compiler angry!
-    }
-    
-    ~Plate() {
-        // Clear MPFR variables
-        for (int i = 0; i < 5; i++)
-            for (int j = 0; j < 4; j++)
-                mpfr_clear(projection4[i][j]);
-
-        for (int i = 0; i < 4; i++)
-            for (int j = 0; j < 3; j++)
-                mpfr_clear(projection3[i][j]);
-    }
-    
-    // Methods for loading, saving, receiving a quaternion, etc.
-    // void loadFromFile(const std::string& filename);
-    // void saveToFile(const std::string& filename);
-    // void receiveQuaternion(const Quaternion& q, int iterCount);
-    // std::vector<std::vector<uint8_t>> getScaledData() const;
-};
-
 // Global state
 
 // Beams section
@@ -133,30 +53,87 @@ bool show_beam_modal = false;
 std::vector<std::unique_ptr<Beam>> beams;
 int cpu_threads = 1;
 bool beams_on = false;
+Engine engine;
 
 
 // Model section
 bool show_model_window = true;
-const char* models[] = { "Mandelbrot", "Julia", "Burning Ship", "Tricorn", "Mandelbar", "Phoenix", "Newton", "Halley", "Householder", "Laguerre", "Secant", "Inverse", "Quartic", "Quintic", "Sextic", "Heptic", "Octic", "Nonic", "Decic", "Cubic", "Quadratic", "Linear", "Identity", "Zero", "One", "Two", "Three", "Four", "Five", "Six", "Seven", "Eight", "Nine", "Ten" };
+// models[] lives in models.hpp
 int item_current = 0;
 int max_iterations = 100;
 float escape_radius = 64.0f;
+float julia_c[4] = { -0.8f, 0.156f, 0.0f, 0.0f };
 
 // Plates section
 bool show_plates_window = true;
 bool show_plate_modal = false;
 std::vector<std::unique_ptr<Plate>> plates;
-// color map
-const char* colormaps[] = { "Rainbow", "Grayscale", "Hot", "Cool", "Spring", "Summer", "Autumn", "Winter", "Bone", "Copper", "Pink", "Jet", "Hsv", "Flag", "Prism", "Ocean", "Cubehelix", "Turbo", "Viridis", "Plasma", "Inferno", "Magma", "Cividis" };
+// colormaps[] and tone_curves[] live in colormap.hpp
 
+// Preview of one plate; each frame only redoes the tiles merged into since
+// the last, so the workers are never waited for
+bool show_preview_window = true;
+int preview_plate = 0;
+PlatePreview preview;
+GLuint preview_texture = 0;
+int preview_max_side = PREVIEW_MAX_SIDE;   // No more than GL_MAX_TEXTURE_SIZE
+
+
+
+// Image export, on its own thread so huge plates do not stall the GUI;
+// plate i goes to plate_i.<extension> in the working directory
+std::thread export_thread;
+ExportProgress export_progress;
+std::atomic<bool> export_running(false);
+int64_t export_rows = 0;             // Rows over all plates being exported
+std::mutex export_mutex;
+std::string export_status;           // Last result, guarded by export_mutex
+
+
+// Scene files: File > Open takes a binary scene (save_scene_file() in
+// scene.hpp) or a text one; File > Save writes the binary one, with plate i
+// of foo.rb9scene in foo_i.plate next to it
+char scene_path[512] = "scene.rb9scene";
+bool scene_named = false;            // scene_path is where this scene was opened or saved
+bool show_scene_modal = false;
+bool scene_modal_saves = false;      // The modal picks a path to save to, else one to open
+std::string scene_status;            // Result of the last open or save
 
 
 bool show_preferences_window = false;
+// Worker buffers are merged into the plates after this many hits...
+int merge_batch = 1 << 20;
+// ...or at least this often
+int merge_interval_ms = 250;
+// Worker placement on the NUMA nodes (numa.hpp, read at startup)
+bool pin_threads = false;
+bool node_replicas = false;
+// Replica tiles moved into the plates per frame, so the preview keeps up
+// without a frame ever scanning whole plates
+const long REDUCE_TILES_PER_FRAME = 1024;
+
+
+// Telemetry section
+bool show_telemetry_window = false;
+const int TELEMETRY_HISTORY = 120;  // Points per graph...
+const double TELEMETRY_PERIOD = 0.5; // ...this many seconds apart
+TelemetrySnapshot telemetry_prev, telemetry_last;
+float telemetry_samples[TELEMETRY_HISTORY];
+float telemetry_iterations[TELEMETRY_HISTORY];
+float telemetry_hits[TELEMETRY_HISTORY];
+float telemetry_idle[TELEMETRY_HISTORY];
+int telemetry_points = 0;           // Filled so far
+int telemetry_next = 0;             // Oldest point once all are filled
 
 
 bool show_imgui_demo = false;
 
 void InitializeData() {
+    cpu_threads = std::thread::hardware_concurrency();
+    if (cpu_threads < 1)
+        cpu_threads = 1;
+    numa_topology();
+
     // Add one beam with default values
     //beams.push_back({0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1, {"seed1", "seed2"}});
 
@@ -164,23 +141,246 @@ void InitializeData() {
     //plates.push_back({1024, 768, 0, std::vector<std::vector<int64_t>>(1024, std::vector<int64_t>(768, 0))});
 }
 
+// Hand the current scene to the sampling engine. All sampling runs on the
+// engine's worker threads; the GUI thread only starts and joins them.
+static RenderSettings CurrentSettings()
+{
+    RenderSettings settings;
+    settings.model = item_current;
+    settings.max_iterations = max_iterations;
+    settings.escape_radius = escape_radius;
+    for (int c = 0; c < 4; c++)
+        settings.julia_c[c] = julia_c[c];
+    settings.threads = cpu_threads;
+    settings.merge_batch = merge_batch;
+    settings.merge_interval_ms = merge_interval_ms;
+    settings.pin_threads = pin_threads;
+    settings.node_replicas = node_replicas;
+    return settings;
+}
+
+static bool StartBeams()
+{
+    RenderSettings settings = CurrentSettings();
+
+    std::vector<Beam*> run_beams;
+    for (size_t i = 0; i < beams.size(); i++)
+        run_beams.push_back(beams[i].get());
+    std::vector<Plate*> run_plates;
+    for (size_t i = 0; i < plates.size(); i++)
+        run_plates.push_back(plates[i].get());
+
+    beams_on = engine.start(run_beams, run_plates, settings);
+    return beams_on;
+}
+
+static void StopBeams()
+{
+    engine.stop();
+    beams_on = false;
+}
+
+// Read the workers' counters once per frame and add a point to the
+// graphs every TELEMETRY_PERIOD
+static void UpdateTelemetry()
+{
+    if (!engine.running())
+        return;
+    TelemetrySnapshot now;
+    engine.telemetry(now);
+    // A new run starts the graphs over
+    if (now.seconds < telemetry_last.seconds || now.workers.size() != telemetry_last.workers.size())
+    {
+        telemetry_last = TelemetrySnapshot();
+        telemetry_last.workers.resize(now.workers.size());
+        telemetry_prev = telemetry_last;
+        telemetry_points = 0;
+        telemetry_next = 0;
+    }
+    if (now.seconds - telemetry_last.seconds < TELEMETRY_PERIOD)
+        return;
+    telemetry_prev = telemetry_last;
+    telemetry_last = now;
+    TelemetryRates r(telemetry_prev.total(), telemetry_last.total(), now.seconds - telemetry_prev.seconds, (int)now.workers.size());
+    telemetry_samples[telemetry_next] = (float)r.samples_per_s;
+    telemetry_iterations[telemetry_next] = (float)r.iterations_per_s;
+    telemetry_hits[telemetry_next] = (float)r.hits_per_s;
+    telemetry_idle[telemetry_next] = (float)(100.0 * r.idle);
+    telemetry_next = (telemetry_next + 1) % TELEMETRY_HISTORY;
+    if (telemetry_points < TELEMETRY_HISTORY)
+        telemetry_points++;
+}
+
+// One rolling graph, labelled with its latest point
+static void PlotTelemetry(const char* label, const float* values, const char* format)
+{
+    char overlay[64];
+    float latest = telemetry_points ? values[(telemetry_next + TELEMETRY_HISTORY - 1) % TELEMETRY_HISTORY] : 0.0f;
+    snprintf(overlay, sizeof(overlay), format, latest);
+    int offset = telemetry_points == TELEMETRY_HISTORY ? telemetry_next : 0;
+    ImGui::PlotLines(label, values, telemetry_points, offset, overlay, 0.0f, 3.4e38f, ImVec2(0, 60));
+}
+
+// Upload what the last preview.update() redid
+static void UploadPreview()
+{
+    if (!preview_texture)
+    {
+        glGenTextures(1, &preview_texture);
+        glBindTexture(GL_TEXTURE_2D, preview_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, preview_texture);
+    if (preview.full)
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, preview.width, preview.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &preview.rgba[0]);
+        return;
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, preview.width);
+    for (size_t t = 0; t < preview.updated.size(); t++)
+    {
+        const PreviewRect& r = preview.updated[t];
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.w, r.h, GL_RGBA, GL_UNSIGNED_BYTE, &preview.rgba[(size_t)r.y * preview.width + r.x]);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+static void StartExport(int format)
+{
+    if (export_thread.joinable())
+        export_thread.join();
+    // The tone widgets stay live, so each plate's settings are taken now
+    std::vector<Plate*> targets;
+    std::vector<ToneSettings> tones;
+    export_rows = 0;
+    for (size_t i = 0; i < plates.size(); i++)
+    {
+        targets.push_back(plates[i].get());
+        tones.push_back(plates[i]->tone);
+        export_rows += plates[i]->height;
+    }
+    export_progress.rows = 0;
+    export_progress.cancel = false;
+    export_running = true;
+    int threads = cpu_threads;
+    export_thread = std::thread([targets, tones, format, threads]() {
+        std::string status;
+        for (size_t i = 0; i < targets.size(); i++)
+        {
+            std::string path = "plate_" + std::to_string(i) + "." + export_extensions[format];
+            std::string error;
+            if (!export_plate(*targets[i], tones[i], path.c_str(), format, threads, error, &export_progress))
+            {
+                status = "Cannot export " + path + ": " + error;
+                break;
+            }
+            status = "Exported " + path;
+        }
+        std::lock_guard<std::mutex> lock(export_mutex);
+        export_status = status;
+        export_running = false;
+    });
+}
+
+static void StopExport()
+{
+    export_progress.cancel = true;
+    if (export_thread.joinable())
+        export_thread.join();
+}
+
+// Scenes are only swapped while nothing is sampling or exporting, the
+// plates being shared with those threads
+static void NewScene()
+{
+    RenderSettings defaults;
+    beams.clear();
+    plates.clear();
+    preview.reset();
+    item_current = defaults.model;
+    max_iterations = defaults.max_iterations;
+    escape_radius = (float)defaults.escape_radius;
+    for (int c = 0; c < 4; c++)
+        julia_c[c] = (float)defaults.julia_c[c];
+    scene_named = false;
+    scene_status.clear();
+}
+
+static void OpenScene()
+{
+    Scene scene;
+    std::string error;
+    if (!load_scene(scene_path, scene, error))
+    {
+        scene_status = error;
+        return;
+    }
+    beams.swap(scene.beams);
+    plates.swap(scene.plates);
+    preview.reset();
+    item_current = scene.settings.model;
+    max_iterations = scene.settings.max_iterations;
+    escape_radius = (float)scene.settings.escape_radius;
+    for (int c = 0; c < 4; c++)
+        julia_c[c] = (float)scene.settings.julia_c[c];
+    // A text scene is saved as a binary one next to it
+    scene_named = is_scene_file(scene_path);
+    scene_status = std::string("Opened ") + scene_path;
+}
+
+static void SaveScene()
+{
+    std::string error;
+    if (save_scene_file(scene_path, CurrentSettings(), beams, plates, error))
+    {
+        scene_named = true;
+        scene_status = std::string("Saved ") + scene_path;
+    }
+    else
+    {
+        scene_status = error;
+    }
+}
+
 static void ShowMainMenuBar()
 {
     if (ImGui::BeginMainMenuBar())
     {
         if (ImGui::BeginMenu("File"))
         {
-            if (ImGui::MenuItem("New scene", "CTRL+N"))
+            if (ImGui::MenuItem("New scene", "CTRL+N", false, !beams_on && !export_running))
             {
+                NewScene();
             }
-            if (ImGui::MenuItem("Open scene", "CTRL+O"))
+            if (ImGui::MenuItem("Open scene", "CTRL+O", false, !beams_on && !export_running))
             {
+                show_scene_modal = true;
+                scene_modal_saves = false;
             }
-            if (ImGui::MenuItem("Save scene", "CTRL+S"))
+            // Saved beams must match the counts, so not while sampling
+            if (ImGui::MenuItem("Save scene", "CTRL+S", false, !beams_on))
             {
+                if (scene_named)
+                    SaveScene();
+                else
+                {
+                    show_scene_modal = true;
+                    scene_modal_saves = true;
+                }
             }
-            if (ImGui::MenuItem("Save scene as...", "CTRL+SHIFT+S"))
+            if (ImGui::MenuItem("Save scene as...", "CTRL+SHIFT+S", false, !beams_on))
             {
+                show_scene_modal = true;
+                scene_modal_saves = true;
+            }
+            ImGui::Separator();
+            if (ImGui::BeginMenu("Export plates", !export_running && !plates.empty()))
+            {
+                for (int f = 0; f < EXPORT_FORMAT_COUNT; f++)
+                    if (ImGui::MenuItem(export_formats[f]))
+                        StartExport(f);
+                ImGui::EndMenu();
             }
             ImGui::Separator();
             if (ImGui::MenuItem("Exit", "ALT+F4"))
@@ -201,6 +401,8 @@ static void ShowMainMenuBar()
             ImGui::MenuItem("Beams", NULL, &show_beams_window);
             ImGui::MenuItem("Model", NULL, &show_model_window);
             ImGui::MenuItem("Plates", NULL, &show_plates_window);
+            ImGui::MenuItem("Preview", NULL, &show_preview_window);
+            ImGui::MenuItem("Telemetry", NULL, &show_telemetry_window);
             ImGui::EndMenu();
         }
         if (ImGui::BeginMenu("Help"))
@@ -219,6 +421,8 @@ static void ShowMainMenuBar()
             }
             ImGui::EndMenu();
         }
+        if (!scene_status.empty())
+            ImGui::TextDisabled("%s", scene_status.c_str());
         ImGui::EndMainMenuBar();
     }
 }
@@ -277,6 +481,10 @@ int main(int, char**)
     SDL_GLContext gl_context = SDL_GL_CreateContext(window);
     SDL_GL_MakeCurrent(window, gl_context);
     SDL_GL_SetSwapInterval(1); // Enable vsync
+    GLint max_texture_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+    if (max_texture_size > 0)
+        preview_max_side = std::min(preview_max_side, (int)max_texture_size);
 
     // Setup Dear ImGui context
     IMGUI_CHECKVERSION();
@@ -333,6 +541,13 @@ int main(int, char**)
         ImGui::NewFrame();
         ShowMainMenuBar();
 
+        // Join the workers once every beam has reached its sample budget
+        if (beams_on && engine.finished())
+            StopBeams();
+        // Bring the plates up to date with the node copies, if any
+        if (beams_on)
+            engine.reduce(REDUCE_TILES_PER_FRAME);
+
         // Enable docking
         ImGui::DockSpaceOverViewport(0, ImGui::GetMainViewport());
 
@@ -352,10 +567,24 @@ int main(int, char**)
                 {
                     ImGui::Text("Mu:    %f + %f i + %f j + %f k", mpfr_get_d(beams[i]->mu.r, MPFR_RNDN), mpfr_get_d(beams[i]->mu.i, MPFR_RNDN), mpfr_get_d(beams[i]->mu.j, MPFR_RNDN), mpfr_get_d(beams[i]->mu.k, MPFR_RNDN));
                     ImGui::Text("Sigma: %f + %f i + %f j + %f k", mpfr_get_d(beams[i]->sigma.r, MPFR_RNDN), mpfr_get_d(beams[i]->sigma.i, MPFR_RNDN), mpfr_get_d(beams[i]->sigma.j, MPFR_RNDN), mpfr_get_d(beams[i]->sigma.k, MPFR_RNDN));
-                    ImGui::Text("N: %d / %d", beams[i]->samples_current, beams[i]->samples_total);
-                    ImGui::ProgressBar(beams[i]->samples_total ? (float)beams[i]->samples_current / (float)beams[i]->samples_total : 0);
+                    int64_t samples_current = beams[i]->samples_current.load();
+                    ImGui::Text("N: %lld / %lld", (long long)samples_current, (long long)beams[i]->samples_total);
+                    ImGui::ProgressBar(beams[i]->samples_total ? (float)samples_current / (float)beams[i]->samples_total : 0);
                     ImGui::Text("Seed: %s", beams[i]->seed_start.c_str());
+                    ImGui::Text("Precision: %s (%ld bits)", precision_tiers[beams[i]->precision.tier], (long)beams[i]->precision.bits);
+                    ImGui::Text("Sampling: %s", sampling_modes[beams[i]->mode]);
+                    if (beams[i]->images > 1)
+                        ImGui::Text("Symmetry: %d samples per orbit", beams[i]->images);
+                    if (beams[i]->mode == SAMPLING_METROPOLIS)
+                    {
+                        double elapsed = engine.elapsed_seconds();
+                        double effective = beams[i]->effective_samples();
+                        ImGui::Text("Acceptance: %.1f%%", 100.0 * beams[i]->acceptance_rate());
+                        ImGui::Text("Effective samples: %.0f (%.0f/s)", effective, elapsed > 0.0 ? effective / elapsed : 0.0);
+                    }
 
+                    // Beams are shared with the workers while sampling
+                    ImGui::BeginDisabled(beams_on);
                     // create string for label ("Edit" + i):
                     std::string edit_label = "Edit##beam_" + std::to_string(i);
                     if (ImGui::Button(edit_label.c_str()))
@@ -371,6 +600,7 @@ int main(int, char**)
                     {
                         to_delete = i;
                     }
+                    ImGui::EndDisabled();
                 }
             }
             if (to_delete != -1)
@@ -379,11 +609,30 @@ int main(int, char**)
                 to_delete = -1;
             }
             ImGui::EndChild();
+            ImGui::BeginDisabled(beams_on);
             if (ImGui::Button("Add Beam"))
             {
                 show_beam_modal = true;
                 edit_beam_index = -1; // New beam
             }
+            ImGui::InputInt("CPU threads", &cpu_threads);
+            if (cpu_threads < 1)
+                cpu_threads = 1;
+            ImGui::EndDisabled();
+            if (!beams_on)
+            {
+                if (ImGui::Button("Start"))
+                    StartBeams();
+            }
+            else
+            {
+                if (ImGui::Button("Stop"))
+                    StopBeams();
+            }
+            // Samples that were never splatted, by how they were caught
+            RejectStats rejects = engine.rejects();
+            ImGui::Text("Bounded: cardioid %lld, bulb %lld, cycle %lld, max iterations %lld",
+                        (long long)rejects.cardioid, (long long)rejects.bulb, (long long)rejects.cycle, (long long)rejects.max_iterations);
             ImGui::End();
         }
 
@@ -402,7 +651,7 @@ int main(int, char**)
         }
         if(ImGui::BeginPopupModal(beam_modal_name.c_str(), NULL, ImGuiWindowFlags_AlwaysAutoResize))
         {
-            static int samples_total = 0;
+            static int64_t samples_total = 0;
             static char seed_start[128] = "";
             static char mu_r[128] = "0.0";
             static char mu_i[128] = "0.0";
@@ -412,6 +661,9 @@ int main(int, char**)
             static char sigma_i[128] = "0.0";
             static char sigma_j[128] = "0.0";
             static char sigma_k[128] = "0.0";
+            static int mode = SAMPLING_GAUSSIAN;
+            static double mh_large_step = 0.1;
+            static double mh_mutation = 0.05;
 
             static bool preload_variables_from_vector = true;
 
@@ -423,10 +675,13 @@ int main(int, char**)
                 strcpy(seed_start, beam->seed_start.c_str());
                 beam->mu.get(mu_r, mu_i, mu_j, mu_k);
                 beam->sigma.get(sigma_r, sigma_i, sigma_j, sigma_k);
+                mode = beam->mode;
+                mh_large_step = beam->mh_large_step;
+                mh_mutation = beam->mh_mutation;
                 preload_variables_from_vector = false;
             }
 
-            ImGui::InputInt("Total Samples", &samples_total);
+            ImGui::InputScalar("Total Samples", ImGuiDataType_S64, &samples_total);
             ImGui::InputText("Seed Start", seed_start, IM_ARRAYSIZE(seed_start));
             ImGui::InputText("Mu r", mu_r, IM_ARRAYSIZE(mu_r));
             ImGui::InputText("Mu i", mu_i, IM_ARRAYSIZE(mu_i));
@@ -436,15 +691,25 @@ int main(int, char**)
             ImGui::InputText("Sigma i", sigma_i, IM_ARRAYSIZE(sigma_i));
             ImGui::InputText("Sigma j", sigma_j, IM_ARRAYSIZE(sigma_j));
             ImGui::InputText("Sigma k", sigma_k, IM_ARRAYSIZE(sigma_k));
+            ImGui::Combo("Sampling", &mode, sampling_modes, IM_ARRAYSIZE(sampling_modes));
+            if (mode == SAMPLING_METROPOLIS)
+            {
+                ImGui::InputDouble("Large step probability", &mh_large_step, 0.01, 0.1, "%.3f");
+                ImGui::InputDouble("Mutation size", &mh_mutation, 0.01, 0.1, "%.4f");
+                if (mh_large_step < 0.0)
+                    mh_large_step = 0.0;
+                if (mh_large_step > 1.0)
+                    mh_large_step = 1.0;
+                if (mh_mutation < 0.0)
+                    mh_mutation = 0.0;
+            }
 
             if (ImGui::Button("OK", ImVec2(120, 0))) 
             {
                 preload_variables_from_vector = true;
-                printf("Saving beam data: %d %s %s %s %s %s %s %s %s %s\n", samples_total, seed_start, mu_r, mu_i, mu_j, mu_k, sigma_r, sigma_i, sigma_j, sigma_k);
                 if (edit_beam_index == -1)
                 {
                     // Creating a new beam
-                    printf("Creating new beam\n");
                     std::unique_ptr<Beam> new_beam = make_unique<Beam>();
                     beams.push_back(std::move(new_beam));
                     edit_beam_index = beams.size() - 1; // Set the new index
@@ -456,6 +721,9 @@ int main(int, char**)
                 beam->seed_start = seed_start;
                 beam->mu.set(mu_r, mu_i, mu_j, mu_k);
                 beam->sigma.set(sigma_r, sigma_i, sigma_j, sigma_k);
+                beam->mode = (SamplingMode)mode;
+                beam->mh_large_step = mh_large_step;
+                beam->mh_mutation = mh_mutation;
 
                 
                 ImGui::CloseCurrentPopup();
@@ -479,12 +747,18 @@ int main(int, char**)
         if (show_model_window)
         {
             ImGui::Begin("Model", &show_model_window);
+            ImGui::BeginDisabled(beams_on);
             // Drop down for model
             ImGui::Combo("Model", &item_current, models, IM_ARRAYSIZE(models));
+            if (!model_supported(item_current))
+                ImGui::TextDisabled("This model cannot be sampled yet");
+            if (item_current == MODEL_JULIA)
+                ImGui::InputFloat4("Julia c", julia_c);
             // Max Iterations
             ImGui::InputInt("Max Iterations", &max_iterations);
             // Escape Radius
             ImGui::InputFloat("Escape Radius", &escape_radius);
+            ImGui::EndDisabled();
             
             ImGui::End();
         }
@@ -503,8 +777,20 @@ int main(int, char**)
                 {
                     ImGui::Text("Width: %d", plates[i]->width);
                     ImGui::Text("Height: %d", plates[i]->height);
+                    ImGui::Text("Memory: %.1f MB%s", plates[i]->memory() / 1048576.0, plates[i]->sparse ? " (sparse)" : "");
+
+                    // Tone settings only change how the plate is shown, so they stay live while rendering
+                    ToneSettings& tone = plates[i]->tone;
+                    std::string colormap_label = "Colormap##plate_" + std::to_string(i);
+                    ImGui::Combo(colormap_label.c_str(), &tone.colormap, colormaps, COLORMAP_COUNT);
+                    std::string curve_label = "Curve##plate_" + std::to_string(i);
+                    ImGui::Combo(curve_label.c_str(), &tone.curve, tone_curves, TONE_CURVE_COUNT);
+                    std::string percentile_label = "Percentile##plate_" + std::to_string(i);
+                    ImGui::SliderFloat(percentile_label.c_str(), &tone.percentile, 90.0f, 100.0f, "%.2f");
 
                     // create string for label ("Edit" + i):
+                    // An export reads the plates until it is done
+                    ImGui::BeginDisabled(beams_on || export_running);
                     std::string edit_label = "Edit##plate_" + std::to_string(i);
                     if (ImGui::Button(edit_label.c_str()))
                     {
@@ -519,6 +805,7 @@ int main(int, char**)
                     {
                         to_delete = i;
                     }
+                    ImGui::EndDisabled();
                 }
             }
             if (to_delete != -1)
@@ -527,11 +814,52 @@ int main(int, char**)
                 to_delete = -1;
             }
             ImGui::EndChild();
+            ImGui::BeginDisabled(beams_on);
             if (ImGui::Button("Add Plate"))
             {
                 show_plate_modal = true;
                 edit_plate_index = -1; // New plate
             }
+            ImGui::EndDisabled();
+            if (export_running)
+            {
+                float done = export_rows ? (float)export_progress.rows.load() / export_rows : 0.0f;
+                ImGui::ProgressBar(done, ImVec2(-80, 0), "Exporting");
+                ImGui::SameLine();
+                if (ImGui::Button("Cancel##export"))
+                    export_progress.cancel = true;
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(export_mutex);
+                if (!export_status.empty())
+                    ImGui::TextUnformatted(export_status.c_str());
+            }
+            ImGui::End();
+        }
+
+        // Preview window
+        if (show_preview_window)
+        {
+            ImGui::Begin("Preview", &show_preview_window);
+            if (plates.empty())
+            {
+                ImGui::Text("No plates");
+            }
+            else
+            {
+                if (preview_plate >= (int)plates.size())
+                    preview_plate = 0;
+                ImGui::SliderInt("Plate", &preview_plate, 0, (int)plates.size() - 1);
+                Plate& plate = *plates[preview_plate];
+                if (preview.update(plate, preview_max_side))
+                    UploadPreview();
+                // Fit the plate into the window, keeping its aspect
+                ImVec2 avail = ImGui::GetContentRegionAvail();
+                float scale = std::min(avail.x / plate.width, avail.y / plate.height);
+                if (scale > 0.0f)
+                    ImGui::Image((ImTextureID)(intptr_t)preview_texture, ImVec2(plate.width * scale, plate.height * scale));
+            }
             ImGui::End();
         }
 
@@ -548,6 +876,7 @@ int main(int, char**)
         {
             static int width = 1024;
             static int height = 1024;
+            static bool sparse = false;
 
             static bool preload_variables_from_vector = true;
 
@@ -557,29 +886,32 @@ int main(int, char**)
                 Plate* plate = plates[edit_plate_index].get();
                 width = plate->width;
                 height = plate->height;
+                sparse = plate->sparse;
                 preload_variables_from_vector = false;
             }
 
             ImGui::InputInt("Width", &width);
             ImGui::InputInt("Height", &height);
+            ImGui::Checkbox("Sparse", &sparse);
 
             if (ImGui::Button("OK", ImVec2(120, 0))) 
             {
                 preload_variables_from_vector = true;
-                printf("Saving plate data: %d %d\n", width, height);
                 if (edit_plate_index == -1)
                 {
                     // Creating a new plate
-                    printf("Creating new plate\n");
-                    std::unique_ptr<Plate> new_plate = make_unique<Plate>(width, height);
+                    std::unique_ptr<Plate> new_plate = make_unique<Plate>(width, height, false, sparse);
                     plates.push_back(std::move(new_plate));
                     edit_plate_index = plates.size() - 1; // Set the new index
                 }
 
                 // Set the plate data based on user input
                 Plate* plate = plates[edit_plate_index].get();
-                plate->width = width;
-                plate->height = height;
+                if (plate->width != width || plate->height != height || plate->sparse != sparse)
+                {
+                    plate->sparse = sparse;
+                    plate->resize(width, height);
+                }
 
                 
                 ImGui::CloseCurrentPopup();
@@ -598,6 +930,117 @@ int main(int, char**)
             ImGui::EndPopup();
         }
 
+        // Modal for the path of a scene to open or save
+        const char* scene_modal_name = scene_modal_saves ? "Save Scene" : "Open Scene";
+        if (show_scene_modal)
+        {
+            if (!ImGui::IsPopupOpen(scene_modal_name)){
+                ImGui::OpenPopup(scene_modal_name);
+            }
+        }
+        if (ImGui::BeginPopupModal(scene_modal_name, NULL, ImGuiWindowFlags_AlwaysAutoResize))
+        {
+            ImGui::InputText("Path", scene_path, IM_ARRAYSIZE(scene_path));
+            if (scene_modal_saves)
+                ImGui::TextDisabled("Plates go to %s and so on", scene_plate_path(scene_path, 0).c_str());
+
+            if (ImGui::Button("OK", ImVec2(120, 0)))
+            {
+                if (scene_modal_saves)
+                    SaveScene();
+                else
+                    OpenScene();
+                ImGui::CloseCurrentPopup();
+                show_scene_modal = false;
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Cancel", ImVec2(120, 0)))
+            {
+                ImGui::CloseCurrentPopup();
+                show_scene_modal = false;
+            }
+
+            ImGui::EndPopup();
+        }
+
+        // Telemetry window
+        UpdateTelemetry();
+        if (show_telemetry_window)
+        {
+            ImGui::Begin("Telemetry", &show_telemetry_window);
+            PlotTelemetry("Samples/s", telemetry_samples, "%.3g");
+            PlotTelemetry("Iterations/s", telemetry_iterations, "%.3g");
+            PlotTelemetry("Hits/s", telemetry_hits, "%.3g");
+            PlotTelemetry("Idle %", telemetry_idle, "%.1f");
+            // Per thread, over the last period
+            double span = telemetry_last.seconds - telemetry_prev.seconds;
+            if (span > 0.0 && ImGui::BeginTable("threads", 8, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+            {
+                ImGui::TableSetupColumn("Thread");
+                ImGui::TableSetupColumn("Samples/s");
+                ImGui::TableSetupColumn("Iterations/s");
+                ImGui::TableSetupColumn("Escaped");
+                ImGui::TableSetupColumn("Interior");
+                ImGui::TableSetupColumn("Hits/s");
+                ImGui::TableSetupColumn("Merge ms");
+                ImGui::TableSetupColumn("Idle");
+                ImGui::TableHeadersRow();
+                for (size_t t = 0; t < telemetry_last.workers.size(); t++)
+                {
+                    TelemetryRates r(telemetry_prev.workers[t], telemetry_last.workers[t], span);
+                    ImGui::TableNextRow();
+                    ImGui::TableNextColumn(); ImGui::Text("%d", (int)t);
+                    ImGui::TableNextColumn(); ImGui::Text("%.3g", r.samples_per_s);
+                    ImGui::TableNextColumn(); ImGui::Text("%.3g", r.iterations_per_s);
+                    ImGui::TableNextColumn(); ImGui::Text("%.1f%%", 100.0 * r.escape_ratio);
+                    ImGui::TableNextColumn(); ImGui::Text("%.1f%%", 100.0 * r.interior_ratio);
+                    ImGui::TableNextColumn(); ImGui::Text("%.3g", r.hits_per_s);
+                    ImGui::TableNextColumn(); ImGui::Text("%.2f", r.merge_ms);
+                    ImGui::TableNextColumn(); ImGui::Text("%.1f%%", 100.0 * r.idle);
+                }
+                ImGui::EndTable();
+            }
+            ImGui::End();
+        }
+
+        // Preferences window
+        if (show_preferences_window)
+        {
+            ImGui::Begin("Preferences", &show_preferences_window);
+            ImGui::BeginDisabled(beams_on);
+            ImGui::InputInt("Merge batch (hits)", &merge_batch);
+            if (merge_batch < 1)
+                merge_batch = 1;
+            ImGui::InputInt("Merge interval (ms)", &merge_interval_ms);
+            if (merge_interval_ms < 1)
+                merge_interval_ms = 1;
+            ImGui::Checkbox("Pin workers to CPUs", &pin_threads);
+            ImGui::Checkbox("Plate copy per NUMA node", &node_replicas);
+            ImGui::EndDisabled();
+            ImGui::Separator();
+            ImGui::Text("Double precision kernel: %s, %d lanes", escape_kernel().name, escape_kernel().lanes);
+            const NumaTopology& topology = numa_topology();
+            ImGui::Text("NUMA nodes: %d, %d CPUs%s", (int)topology.nodes.size(), topology.cpus(), topology.from_sys ? "" : " (no topology in /sys)");
+            if (ImGui::BeginTable("numa", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+            {
+                ImGui::TableSetupColumn("Node");
+                ImGui::TableSetupColumn("CPUs");
+                ImGui::TableSetupColumn("Memory");
+                ImGui::TableHeadersRow();
+                for (size_t n = 0; n < topology.nodes.size(); n++)
+                {
+                    ImGui::TableNextRow();
+                    ImGui::TableNextColumn(); ImGui::Text("%d", topology.nodes[n].id);
+                    ImGui::TableNextColumn(); ImGui::TextUnformatted(format_cpulist(topology.nodes[n].cpus).c_str());
+                    ImGui::TableNextColumn(); ImGui::Text("%.1f GB", topology.nodes[n].memory / 1073741824.0);
+                }
+                ImGui::EndTable();
+            }
+            if (engine.replica_memory())
+                ImGui::Text("Plate copies: %.1f MB", engine.replica_memory() / 1048576.0);
+            ImGui::End();
+        }
+
         if (show_imgui_demo)
         {
             ImGui::ShowDemoWindow(&show_imgui_demo);
@@ -613,6 +1056,10 @@ int main(int, char**)
     }
 
     // Cleanup
+    StopExport();
+    StopBeams();
+    if (preview_texture)
+        glDeleteTextures(1, &preview_texture);
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -0,0 +1,91 @@
+// Merges the plate shards of a sharded render (rainbrot9-cli -S) into one
+// plate file, checking they all come from the same scene, and optionally
+// exports the result as an image.
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "shard.hpp"
+#include "export.hpp"
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] -o OUT.plate SHARD.plate...\n"
+            "Sums the N shards of one plate, as written by rainbrot9-cli -S I/N,\n"
+            "into OUT.plate.\n"
+            "  -t N     threads (default: all cores)\n"
+            "  -e FMT   also export the result as OUT.png, .tif or .raw, with the\n"
+            "           default tone settings; FMT is png, tiff or raw\n",
+            argv0);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+int main(int argc, char** argv) {
+    int threads = (int)std::thread::hardware_concurrency();
+    std::string output;
+    int export_format = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:o:e:h")) != -1) {
+        switch (opt) {
+        case 't': threads = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        case 'e':
+            for (int f = 0; f < EXPORT_FORMAT_COUNT; f++)
+                if (strcasecmp(optarg, export_formats[f]) == 0 || strcasecmp(optarg, export_extensions[f]) == 0)
+                    export_format = f;
+            if (export_format < 0) {
+                fprintf(stderr, "Unknown image format %s\n", optarg);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (output.empty() || optind == argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    threads = threads > 0 ? threads : 1;
+
+    std::vector<std::string> inputs(argv + optind, argv + argc);
+    std::string error;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    if (!merge_shards(inputs, output.c_str(), threads, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    double seconds = seconds_since(started);
+    Plate plate(1, 1);
+    if (!plate.open_file(output.c_str(), error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    double mb = inputs.size() * (double)plate.memory() / 1048576.0;
+    fprintf(stderr, "Merged %zu shards of %dx%d into %s in %.1fs (%.0f MB/s read)\n",
+            inputs.size(), plate.width, plate.height, output.c_str(), seconds, seconds > 0.0 ? mb / seconds : 0.0);
+
+    if (export_format >= 0) {
+        std::string path = output;
+        size_t dot = path.find_last_of('.');
+        if (dot != std::string::npos && path.find('/', dot) == std::string::npos)
+            path.erase(dot);
+        path += std::string(".") + export_extensions[export_format];
+        started = std::chrono::steady_clock::now();
+        if (!export_plate(plate, plate.tone, path.c_str(), export_format, threads, error)) {
+            fprintf(stderr, "Cannot export %s: %s\n", path.c_str(), error.c_str());
+            return 1;
+        }
+        fprintf(stderr, "Exported %s in %.1fs\n", path.c_str(), seconds_since(started));
+    }
+    return 0;
+}
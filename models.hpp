@@ -0,0 +1,338 @@
+#ifndef MODELS_HPP
+#define MODELS_HPP
+
+#include <mpfr.h>
+
+#include "quaternion.hpp"
+
+// Iteration formulas, indexed like the Model combo box
+static const char* models[] = { "Mandelbrot", "Julia", "Burning Ship", "Tricorn", "Mandelbar", "Phoenix", "Newton", "Halley", "Householder", "Laguerre", "Secant", "Inverse", "Quartic", "Quintic", "Sextic", "Heptic", "Octic", "Nonic", "Decic", "Cubic", "Quadratic", "Linear", "Identity", "Zero", "One", "Two", "Three", "Four", "Five", "Six", "Seven", "Eight", "Nine", "Ten" };
+
+enum ModelId {
+    MODEL_MANDELBROT = 0,
+    MODEL_JULIA,
+    MODEL_BURNING_SHIP,
+    MODEL_TRICORN,
+    MODEL_MANDELBAR,
+    MODEL_PHOENIX,
+    MODEL_NEWTON,
+    MODEL_HALLEY,
+    MODEL_HOUSEHOLDER,
+    MODEL_LAGUERRE,
+    MODEL_SECANT,
+    MODEL_INVERSE,
+    MODEL_QUARTIC,
+    MODEL_QUINTIC,
+    MODEL_SEXTIC,
+    MODEL_HEPTIC,
+    MODEL_OCTIC,
+    MODEL_NONIC,
+    MODEL_DECIC,
+    MODEL_CUBIC,
+    MODEL_QUADRATIC,
+    MODEL_LINEAR,
+    MODEL_COUNT = sizeof(models) / sizeof(models[0])
+};
+
+// Phoenix coupling to the previous iterate (Ushiki's p)
+static const double PHOENIX_P = -0.5;
+
+// Per-worker state for the iteration over scalar backend B
+template <typename B>
+struct ModelScratch {
+    QuaternionT<B> julia_c;          // Constant for the Julia model
+    QuaternionT<B> prev;             // z[n-1], used by Phoenix
+    QuaternionT<B> a, b;             // Temporaries
+    typename B::value t, u, p;       // p holds PHOENIX_P
+
+    // Everything is pooled in `arena`, which must outlive the scratch
+    ModelScratch(mpfr_prec_t prec, MpfrArena& arena) : julia_c(prec, arena), prev(prec, arena), a(prec, arena), b(prec, arena) {
+        B::init_pooled(t, prec, arena);
+        B::init_pooled(u, prec, arena);
+        B::init_pooled(p, prec, arena);
+        B::set_d(p, PHOENIX_P);
+    }
+
+private:
+    ModelScratch(const ModelScratch&);
+    ModelScratch& operator=(const ModelScratch&);
+};
+
+// out = z^N by square-and-multiply, unrolled at compile time. Powers of one
+// quaternion commute, so squaring partial powers is exact algebra. `out`
+// must not alias `z`; s.b is clobbered.
+template <int N>
+struct PowerChain {
+    template <typename B>
+    static void apply(QuaternionT<B>& out, const QuaternionT<B>& z, ModelScratch<B>& s) {
+        if (N % 2 == 0) {
+            PowerChain<N / 2>::apply(out, z, s);
+            quaternion_sqr(out, out, s.t, s.u);
+        } else {
+            PowerChain<N - 1>::apply(out, z, s);
+            quaternion_mul(s.b, out, z);
+            quaternion_swap(out, s.b);
+        }
+    }
+};
+
+template <>
+struct PowerChain<2> {
+    template <typename B>
+    static void apply(QuaternionT<B>& out, const QuaternionT<B>& z, ModelScratch<B>& s) {
+        quaternion_sqr(out, z, s.t, s.u);
+    }
+};
+
+template <>
+struct PowerChain<1> {
+    template <typename B>
+    static void apply(QuaternionT<B>& out, const QuaternionT<B>& z, ModelScratch<B>&) {
+        quaternion_set(out, z);
+    }
+};
+
+// Where a sample was found to be bounded without iterating it
+enum InteriorRegion {
+    INTERIOR_NONE = 0,
+    INTERIOR_CARDIOID,               // Main cardioid
+    INTERIOR_BULB                    // Period-2 bulb
+};
+
+// Model kernels. Each one is a functor with its power and escape test fixed
+// at compile time; the engine instantiates a whole sampling loop per model,
+// so nothing in the loop depends on the model index.
+//   begin(z, c, s)  start the orbit of sample c
+//   step(z, c, s)   one iteration z <- f(z, c)
+//   escaped(norm2, r2)  whether |z|^2 = norm2 has left the escape radius
+//   interior(c, s)  analytic test for samples known never to escape
+//   mirror_axes(julia_c)  components of a sample whose sign can be
+//                   flipped, bit c for component c of (r, i, j, k): the
+//                   orbit of the flipped sample is the orbit flipped alike
+// plain_square marks z <- z^2 + c from z = 0, which the SIMD kernels run.
+// cycle_ulps is the distance, in units of the working precision, at which
+// a revisited point counts as a periodic orbit; 0 turns the check off.
+
+// Bits of mirror_axes
+static const unsigned MIRROR_IMAGINARY = 0xE;   // i, j and k
+static const unsigned MIRROR_ALL = 0xF;
+
+struct ModelBase {
+    static constexpr bool plain_square = false;
+    static constexpr double cycle_ulps = 64.0;
+
+    // Squaring only sees the real part and the length of the imaginary
+    // one, so any imaginary sign flip commutes with it
+    static unsigned mirror_axes(const double*) {
+        return MIRROR_IMAGINARY;
+    }
+
+    template <typename B>
+    static InteriorRegion interior(const QuaternionT<B>&, ModelScratch<B>&) {
+        return INTERIOR_NONE;
+    }
+
+    template <typename B>
+    static void begin(QuaternionT<B>& z, const QuaternionT<B>&, ModelScratch<B>& s) {
+        quaternion_set_zero(z);
+        quaternion_set_zero(s.prev);
+    }
+
+    template <typename B>
+    static bool escaped(const typename B::value& norm2, double r2) {
+        return B::greater_d(norm2, r2);
+    }
+};
+
+// z^N + c
+template <int N>
+struct PowerModel : ModelBase {
+    static constexpr int power = N;
+    static constexpr bool plain_square = N == 2;
+
+    // Odd powers also commute with negating the whole sample, and so with
+    // flipping its real part alone
+    static unsigned mirror_axes(const double*) {
+        return N % 2 ? MIRROR_ALL : MIRROR_IMAGINARY;
+    }
+
+    template <typename B>
+    static void step(QuaternionT<B>& z, const QuaternionT<B>& c, ModelScratch<B>& s) {
+        PowerChain<N>::apply(s.a, z, s);
+        quaternion_add(z, s.a, c);
+    }
+
+    // The orbit of z^2 + c from 0 stays in the complex plane spanned by 1 and
+    // the imaginary part of c, so with x = r and y^2 = i^2 + j^2 + k^2 the
+    // usual complex tests apply: q (q + x - 1/4) <= y^2 / 4 with
+    // q = (x - 1/4)^2 + y^2 for the cardioid, (x + 1)^2 + y^2 <= 1/16 for
+    // the bulb. Boundary points count as outside.
+    template <typename B>
+    static InteriorRegion interior(const QuaternionT<B>& c, ModelScratch<B>& s) {
+        if (N != 2)
+            return INTERIOR_NONE;
+        typename B::value& y2 = s.a.i;
+        typename B::value& xq = s.a.r;
+        typename B::value& q = s.a.j;
+        B::sqr(y2, c.i);
+        B::fma(y2, c.j, c.j, y2);
+        B::fma(y2, c.k, c.k, y2);
+
+        // Bulb first, it is the cheaper test
+        B::set_d(s.t, 1.0);
+        B::add(s.t, c.r, s.t);
+        B::fma(s.t, s.t, s.t, y2);
+        B::set_d(s.u, 0.0625);
+        B::sub(s.t, s.u, s.t);
+        if (B::greater_d(s.t, 0.0))
+            return INTERIOR_BULB;
+
+        B::set_d(s.t, -0.25);
+        B::add(xq, c.r, s.t);
+        B::fma(q, xq, xq, y2);
+        B::add(s.t, q, xq);
+        B::mul(s.t, q, s.t);
+        B::mul_2si(s.u, y2, -2);
+        B::sub(s.t, s.u, s.t);
+        if (B::greater_d(s.t, 0.0))
+            return INTERIOR_CARDIOID;
+        return INTERIOR_NONE;
+    }
+};
+
+typedef PowerModel<2> MandelbrotModel;
+
+// z^2 + k for a fixed k, iterated from the sample itself
+struct JuliaModel : ModelBase {
+    static constexpr int power = 2;
+
+    // Only where k has no component to flip
+    static unsigned mirror_axes(const double* julia_c) {
+        unsigned axes = 0;
+        for (int c = 1; c < 4; c++)
+            if (julia_c[c] == 0.0)
+                axes |= 1u << c;
+        return axes;
+    }
+
+    template <typename B>
+    static void begin(QuaternionT<B>& z, const QuaternionT<B>& c, ModelScratch<B>& s) {
+        quaternion_set(z, c);
+        quaternion_set_zero(s.prev);
+    }
+
+    template <typename B>
+    static void step(QuaternionT<B>& z, const QuaternionT<B>&, ModelScratch<B>& s) {
+        quaternion_sqr(z, z, s.t, s.u);
+        quaternion_add(z, z, s.julia_c);
+    }
+};
+
+// (|r| + |i| + |j| + |k|)^2 + c, componentwise absolute values
+struct BurningShipModel : ModelBase {
+    static constexpr int power = 2;
+
+    // The absolute values undo a flip of z, but not of c
+    static unsigned mirror_axes(const double*) {
+        return 0;
+    }
+
+    template <typename B>
+    static void step(QuaternionT<B>& z, const QuaternionT<B>& c, ModelScratch<B>& s) {
+        B::abs(z.r, z.r);
+        B::abs(z.i, z.i);
+        B::abs(z.j, z.j);
+        B::abs(z.k, z.k);
+        quaternion_sqr(z, z, s.t, s.u);
+        quaternion_add(z, z, c);
+    }
+};
+
+// conj(z)^2 + c
+struct TricornModel : ModelBase {
+    static constexpr int power = 2;
+
+    template <typename B>
+    static void step(QuaternionT<B>& z, const QuaternionT<B>& c, ModelScratch<B>& s) {
+        B::neg(z.i, z.i);
+        B::neg(z.j, z.j);
+        B::neg(z.k, z.k);
+        quaternion_sqr(z, z, s.t, s.u);
+        quaternion_add(z, z, c);
+    }
+};
+
+// Complex conjugation of the i axis only, j and k are kept
+struct MandelbarModel : ModelBase {
+    static constexpr int power = 2;
+
+    template <typename B>
+    static void step(QuaternionT<B>& z, const QuaternionT<B>& c, ModelScratch<B>& s) {
+        B::neg(z.i, z.i);
+        quaternion_sqr(z, z, s.t, s.u);
+        quaternion_add(z, z, c);
+    }
+};
+
+// z[n+1] = z[n]^2 + c + p * z[n-1]
+struct PhoenixModel : ModelBase {
+    static constexpr int power = 2;
+    // A cycle of z alone says nothing while z[n-1] still moves
+    static constexpr double cycle_ulps = 0.0;
+
+    template <typename B>
+    static void step(QuaternionT<B>& z, const QuaternionT<B>& c, ModelScratch<B>& s) {
+        quaternion_sqr(s.a, z, s.t, s.u);
+        quaternion_add(s.a, s.a, c);
+        B::fma(s.a.r, s.prev.r, s.p, s.a.r);
+        B::fma(s.a.i, s.prev.i, s.p, s.a.i);
+        B::fma(s.a.j, s.prev.j, s.p, s.a.j);
+        B::fma(s.a.k, s.prev.k, s.p, s.a.k);
+        quaternion_swap(s.prev, z);
+        quaternion_swap(z, s.a);
+    }
+};
+
+// Call v.template run<M>() with the kernel of `model` and return true, or
+// return false if the model has no escape-time form. Root finders
+// (Newton..Inverse) converge instead of escaping and the entries after
+// Linear are placeholders.
+template <typename V>
+inline bool model_dispatch(int model, V& v) {
+    switch (model) {
+    case MODEL_MANDELBROT: v.template run<MandelbrotModel>(); return true;
+    case MODEL_QUADRATIC: v.template run<MandelbrotModel>(); return true;
+    case MODEL_JULIA: v.template run<JuliaModel>(); return true;
+    case MODEL_BURNING_SHIP: v.template run<BurningShipModel>(); return true;
+    case MODEL_TRICORN: v.template run<TricornModel>(); return true;
+    case MODEL_MANDELBAR: v.template run<MandelbarModel>(); return true;
+    case MODEL_PHOENIX: v.template run<PhoenixModel>(); return true;
+    case MODEL_LINEAR: v.template run<PowerModel<1> >(); return true;
+    case MODEL_CUBIC: v.template run<PowerModel<3> >(); return true;
+    case MODEL_QUARTIC: v.template run<PowerModel<4> >(); return true;
+    case MODEL_QUINTIC: v.template run<PowerModel<5> >(); return true;
+    case MODEL_SEXTIC: v.template run<PowerModel<6> >(); return true;
+    case MODEL_HEPTIC: v.template run<PowerModel<7> >(); return true;
+    case MODEL_OCTIC: v.template run<PowerModel<8> >(); return true;
+    case MODEL_NONIC: v.template run<PowerModel<9> >(); return true;
+    case MODEL_DECIC: v.template run<PowerModel<10> >(); return true;
+    default: return false;
+    }
+}
+
+struct ModelPowerVisitor {
+    int power;
+    template <typename M> void run() { power = M::power; }
+};
+
+// Exponent of z in z^n + c, or 0 if the model has no escape-time form
+inline int model_power(int model) {
+    ModelPowerVisitor v;
+    return model_dispatch(model, v) ? v.power : 0;
+}
+
+inline bool model_supported(int model) {
+    return model_power(model) > 0;
+}
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// NUMA topology as Linux describes it under /sys/devices/system/node:
+// the online nodes, each with its CPUs (cpulist) and memory (meminfo).
+// Only CPUs this process may run on are kept (taskset, numactl, cgroups),
+// and nodes left with none are dropped. Elsewhere, or without /sys, the
+// machine is one node holding every CPU.
+
+struct NumaNode {
+    int id;                          // Node number in /sys
+    std::vector<int> cpus;           // CPUs we may run on, ascending
+    int64_t memory;                  // Bytes, 0 if unknown
+};
+
+struct NumaTopology {
+    std::vector<NumaNode> nodes;
+    bool from_sys;                   // Read from /sys, not made up
+
+    NumaTopology() : from_sys(false) {}
+
+    int cpus() const {
+        int n = 0;
+        for (size_t i = 0; i < nodes.size(); i++)
+            n += (int)nodes[i].cpus.size();
+        return n;
+    }
+};
+
+// "0-3,8,10-11" into its numbers; false if malformed
+inline bool parse_cpulist(const char* s, std::vector<int>& out) {
+    out.clear();
+    while (*s && *s != '\n') {
+        char* end;
+        long a = strtol(s, &end, 10);
+        if (end == s || a < 0)
+            return false;
+        long b = a;
+        s = end;
+        if (*s == '-') {
+            b = strtol(s + 1, &end, 10);
+            if (end == s + 1 || b < a)
+                return false;
+            s = end;
+        }
+        for (long c = a; c <= b; c++)
+            out.push_back((int)c);
+        if (*s == ',')
+            s++;
+        else if (*s && *s != '\n')
+            return false;
+    }
+    return true;
+}
+
+// Ascending CPU numbers back into the "0-3,8" form
+inline std::string format_cpulist(const std::vector<int>& cpus) {
+    std::string s;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            j++;
+        if (!s.empty())
+            s += ",";
+        s += std::to_string(cpus[i]);
+        if (j > i)
+            s += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return s;
+}
+
+// First line of a small file, without the newline; empty if unreadable
+inline std::string numa_read_line(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        return std::string();
+    char line[4096];
+    std::string s = fgets(line, sizeof(line), f) ? line : "";
+    fclose(f);
+    if (!s.empty() && s[s.size() - 1] == '\n')
+        s.erase(s.size() - 1);
+    return s;
+}
+
+// CPUs this process may run on, ascending
+inline std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &set))
+                cpus.push_back(c);
+#endif
+    if (cpus.empty()) {
+        int n = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int c = 0; c < n; c++)
+            cpus.push_back(c);
+    }
+    return cpus;
+}
+
+// The topology under `root`, the nodes directory of sysfs, restricted
+// to `allowed`
+inline NumaTopology read_numa_topology(const std::string& root, const std::vector<int>& allowed) {
+    NumaTopology t;
+    std::vector<int> ids;
+    if (parse_cpulist(numa_read_line(root + "/online").c_str(), ids)) {
+        for (size_t i = 0; i < ids.size(); i++) {
+            std::string dir = root + "/node" + std::to_string(ids[i]);
+            std::vector<int> cpus;
+            if (!parse_cpulist(numa_read_line(dir + "/cpulist").c_str(), cpus))
+                continue;
+            NumaNode node;
+            node.id = ids[i];
+            node.memory = 0;
+            for (size_t c = 0; c < cpus.size(); c++)
+                if (std::binary_search(allowed.begin(), allowed.end(), cpus[c]))
+                    node.cpus.push_back(cpus[c]);
+            if (node.cpus.empty())
+                continue;
+            // "Node 0 MemTotal:       32768000 kB"
+            FILE* f = fopen((dir + "/meminfo").c_str(), "r");
+            if (f) {
+                char line[256];
+                long long kb;
+                while (fgets(line, sizeof(line), f))
+                    if (sscanf(line, "Node %*d MemTotal: %lld kB", &kb) == 1)
+                        node.memory = kb * 1024;
+                fclose(f);
+            }
+            t.nodes.push_back(node);
+        }
+    }
+    t.from_sys = !t.nodes.empty();
+    if (!t.from_sys) {
+        NumaNode node;
+        node.id = 0;
+        node.cpus = allowed;
+        node.memory = 0;
+        t.nodes.push_back(node);
+    }
+    return t;
+}
+
+// This machine's topology, read once
+inline const NumaTopology& numa_topology() {
+    static const NumaTopology t = read_numa_topology("/sys/devices/system/node", allowed_cpus());
+    return t;
+}
+
+// Keep the calling thread on `cpus`; false where that is not supported
+inline bool pin_thread(const std::vector<int>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t c = 0; c < cpus.size(); c++)
+        if (cpus[c] >= 0 && cpus[c] < CPU_SETSIZE)
+            CPU_SET(cpus[c], &set);
+    return !cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef PERTURBATION_HPP
+#define PERTURBATION_HPP
+
+#include <mutex>
+#include <vector>
+#include <gmp.h>
+#include <mpfr.h>
+
+#include "quaternion.hpp"
+
+// Perturbation for deep beams of z^2 + c. One reference orbit Z of the
+// beam's mu is iterated in MPFR; a sample c = mu + dc then only needs its
+// offset delta = z - Z, which stays tiny for as long as the orbits stay
+// close and is iterated in double:
+//
+//   delta <- Z delta + delta Z + delta^2 + dc
+//
+// In quaternions Z delta + delta Z = 2 (ab - u.v, a v + b u) for
+// Z = (a, u) and delta = (b, v): the cross products cancel, as z^2 + c
+// needs.
+//
+// When |z| drops below |delta| the offset has lost the digits that matter
+// (the sample has come close to 0, where the reference is not), and when
+// the reference ends (it escaped or ran out of iterations) there is
+// nothing left to follow. Either way the offset is rebased onto the start
+// of the reference: Z[0] = 0, so delta = z and following resumes at m = 0
+// (Zhuoran), with no second reference to compute.
+
+// Orbit of one beam's mu, kept rounded to double
+struct ReferenceOrbit {
+    std::vector<double> z;           // Z[0] .. Z[length], four components each
+    int length;                      // Escape iteration, or max_iterations
+    std::once_flag once;             // Computed by the first worker that needs it
+
+    ReferenceOrbit() : length(0) {}
+
+    // Iterate c at `bits` until it escapes or max_iterations
+    void compute(const Quaternion& c, mpfr_prec_t bits, int max_iterations, double r2) {
+        QuaternionT<MpfrBackend> cz(bits), zz(bits);
+        mpfr_t t, u, norm;
+        mpfr_init2(t, bits);
+        mpfr_init2(u, bits);
+        mpfr_init2(norm, bits);
+        quaternion_set(cz, c);
+        quaternion_set_zero(zz);
+        z.assign(4, 0.0);
+        z.reserve(4 * ((size_t)max_iterations + 1));
+        length = 0;
+        while (length < max_iterations) {
+            quaternion_sqr(zz, zz, t, u);
+            quaternion_add(zz, zz, cz);
+            z.push_back(mpfr_get_d(zz.r, MPFR_RNDN));
+            z.push_back(mpfr_get_d(zz.i, MPFR_RNDN));
+            z.push_back(mpfr_get_d(zz.j, MPFR_RNDN));
+            z.push_back(mpfr_get_d(zz.k, MPFR_RNDN));
+            length++;
+            quaternion_norm2(norm, zz);
+            if (mpfr_cmp_d(norm, r2) > 0)
+                break;
+        }
+        mpfr_clear(t);
+        mpfr_clear(u);
+        mpfr_clear(norm);
+    }
+
+    const double* at(int m) const {
+        return &z[4 * (size_t)m];
+    }
+};
+
+// delta <- Z delta + delta Z + delta^2 + dc, written out for Z = (a, u)
+// and delta = (b, v): real part b (2a + b) - v.(2u + v), vector part
+// 2 ((a + b) v + b u)
+inline void perturbed_step(double d[4], const double Z[4], const double dc[4]) {
+    double a = Z[0], b = d[0];
+    double r = b * (2.0 * a + b) - (d[1] * (2.0 * Z[1] + d[1]) + d[2] * (2.0 * Z[2] + d[2]) + d[3] * (2.0 * Z[3] + d[3]));
+    double s = 2.0 * (a + b);
+    double i = s * d[1] + 2.0 * b * Z[1];
+    double j = s * d[2] + 2.0 * b * Z[2];
+    double k = s * d[3] + 2.0 * b * Z[3];
+    d[0] = r + dc[0];
+    d[1] = i + dc[1];
+    d[2] = j + dc[2];
+    d[3] = k + dc[3];
+}
+
+#endif
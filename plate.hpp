@@ -0,0 +1,1043 @@
+#ifndef PLATE_HPP
+#define PLATE_HPP
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <string>
+#include <type_traits>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <mpfr.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "quaternion.hpp"
+#include "colormap.hpp"
+#include "alloc.hpp"
+
+// Side of the square tiles plates are stored and merged in
+static const int PLATE_TILE = 64;
+static const int PLATE_TILE_CELLS = PLATE_TILE * PLATE_TILE;
+
+// Readers of the per-tile dirty flags (Plate::take_dirty()), one bit each;
+// writers set them all
+static const uint8_t PLATE_DIRTY_PREVIEW = 1;
+static const uint8_t PLATE_DIRTY_CHECKPOINT = 2; // Checkpoint generation 0; shifted left by 1 for generation 1
+static const uint8_t PLATE_DIRTY_ALL = 7;
+
+// Header of a plate file, padded to PLATE_FILE_HEADER bytes.
+// The tiles follow in storage order, PLATE_TILE_CELLS int64 counts each,
+// in host byte order.
+static const size_t PLATE_FILE_HEADER = 4096;
+struct PlateFileHeader {
+    char magic[8];                   // "RB9TILES"
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t tile;                   // PLATE_TILE
+    uint32_t morton;
+    uint32_t reserved;
+    uint64_t tiles;
+    uint64_t scene_hash;             // The rest is the ShardStamp, zero unless sharded
+    uint32_t plate, shard, shards;
+    uint32_t reserved2;
+};
+
+// Which part of a sharded render a plate file holds: plate `plate` of the
+// scene with hash `scene_hash` (see shard.hpp), sampled from slice `shard`
+// of `shards` of every beam. All zero for a whole render.
+struct ShardStamp {
+    uint64_t scene_hash;
+    uint32_t plate, shard, shards;
+    ShardStamp() : scene_hash(0), plate(0), shard(0), shards(0) {}
+};
+
+// Interleave the bits of x and y (x in the even bits)
+inline uint64_t morton2(uint32_t x, uint32_t y) {
+    uint64_t m = 0;
+    for (int b = 0; b < 32; b++) {
+        m |= (uint64_t)((x >> b) & 1) << (2 * b);
+        m |= (uint64_t)((y >> b) & 1) << (2 * b + 1);
+    }
+    return m;
+}
+
+// A tile of a sparse plate, allocated on its first hit. Counts start at
+// 32 bits and the whole tile moves to 64 bits when one would overflow;
+// `narrow` is then stale but kept, since readers may still be looking.
+struct SparseTile {
+    uint32_t narrow[PLATE_TILE_CELLS];
+    int64_t* wide;                   // The counts once promoted
+    uint8_t lock;                    // Held by writers only
+};
+
+// Per-worker MPFR temporaries used while projecting orbit points.
+// Kept outside of Plate so several workers can project onto one plate at once.
+struct ProjectionScratch {
+    Quaternion point;                // Point converted from another backend
+    mpfr_t h3[4];                    // Homogeneous 3D point
+    mpfr_t h2[3];                    // Homogeneous 2D point
+    mpfr_t t;
+
+    // Everything is pooled in `arena`, which must outlive the scratch
+    ProjectionScratch(mpfr_prec_t prec, MpfrArena& arena) : point(prec, arena) {
+        for (int i = 0; i < 4; i++) arena.init(h3[i], prec);
+        for (int i = 0; i < 3; i++) arena.init(h2[i], prec);
+        arena.init(t, prec);
+    }
+
+private:
+    ProjectionScratch(const ProjectionScratch&);
+    ProjectionScratch& operator=(const ProjectionScratch&);
+};
+
+// A plate's two projections and its viewport folded into one 5 x 3 matrix:
+// (r, i, j, k, 1) * m = (X, Y, W) and the point lands on pixel (X / W,
+// Y / W). When W is the same for every point, as in all but perspective
+// views, it is divided out and `affine` is set.
+struct PixelTransform {
+    mpfr_t m[5][3];
+    bool affine;
+    int width, height;
+
+    explicit PixelTransform(mpfr_prec_t prec) : affine(true), width(0), height(0) {
+        for (int r = 0; r < 5; r++)
+            for (int c = 0; c < 3; c++)
+                mpfr_init2(m[r][c], prec);
+    }
+
+    ~PixelTransform() {
+        for (int r = 0; r < 5; r++)
+            for (int c = 0; c < 3; c++)
+                mpfr_clear(m[r][c]);
+    }
+
+private:
+    PixelTransform(const PixelTransform&);
+    PixelTransform& operator=(const PixelTransform&);
+};
+
+// Plate class
+// Points are row vectors: (r, i, j, k, 1) * projection4 gives a homogeneous
+// 3D point, which * projection3 gives a homogeneous 2D point (u, v, w).
+// (u/w, v/w) in [-1, 1] x [-1, 1] covers the whole plate, v pointing up.
+//
+// Counts live in one 64-byte aligned block of PLATE_TILE x PLATE_TILE tiles,
+// each tile row-major, so a splat touches one tile and a tile is a few
+// pages. Tiles are laid out row by row, or along a Morton curve when
+// `morton` is set so that neighbouring tiles in both directions stay close.
+//
+// The counts may instead be mapped copy-on-write from a plate file
+// (open_file()), so opening a saved scene or resuming a checkpoint reads
+// nothing up front; hits still go to private memory. Checkpoints write
+// back only the tiles merged into since (write_tiles()).
+//
+// A `sparse` plate allocates nothing but a directory of tile pointers up
+// front; each tile is allocated when first hit, so memory follows the
+// region the orbits actually cover. Writers to a sparse tile take its
+// lock, one per merge in place of an atomic add per cell.
+class Plate {
+public:
+    /* 4D to 3D projection matrix */
+    mpfr_t projection4[5][4];        // Projection matrix
+    /*  3D to 2D projection matrix */
+    mpfr_t projection3[4][3];        // Projection matrix
+    ToneSettings tone;               // How the preview and exports colour the counts
+    int width, height;               // Dimensions
+    bool morton;                     // Tile order
+    bool sparse;                     // Tiles allocated on first hit; set before resize()
+    ShardStamp stamp;                // Written into plate files
+    int64_t* data;                   // tile_count() tiles of PLATE_TILE_CELLS counts; NULL when sparse
+
+    Plate(int w, int h, bool morton_order = false, bool sparse_plate = false) : width(w), height(h), morton(morton_order), sparse(sparse_plate), data(NULL),
+        sparse_tiles(0), wide_tiles(0), map_base(NULL), map_bytes(0) {
+        // Initialize MPFR variables
+        for (int i = 0; i < 5; i++)
+            for (int j = 0; j < 4; j++)
+                mpfr_init(projection4[i][j]);
+
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 3; j++)
+                mpfr_init(projection3[i][j]);
+
+        reset_projection();
+
+        // One allocation for the whole histogram; tiles replace row locks
+        allocate();
+    }
+
+    ~Plate() {
+        // Clear MPFR variables
+        for (int i = 0; i < 5; i++)
+            for (int j = 0; j < 4; j++)
+                mpfr_clear(projection4[i][j]);
+
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 3; j++)
+                mpfr_clear(projection3[i][j]);
+
+        release();
+    }
+
+    // Default view: the (r, i) plane, [-2, 2] x [-2, 2] fills the plate
+    void reset_projection() {
+        for (int i = 0; i < 5; i++)
+            for (int j = 0; j < 4; j++)
+                mpfr_set_d(projection4[i][j], 0.0, MPFR_RNDN);
+        mpfr_set_d(projection4[0][0], 1.0, MPFR_RNDN);
+        mpfr_set_d(projection4[1][1], 1.0, MPFR_RNDN);
+        mpfr_set_d(projection4[2][2], 1.0, MPFR_RNDN);
+        mpfr_set_d(projection4[4][3], 1.0, MPFR_RNDN);
+
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 3; j++)
+                mpfr_set_d(projection3[i][j], 0.0, MPFR_RNDN);
+        mpfr_set_d(projection3[0][0], 0.5, MPFR_RNDN);
+        mpfr_set_d(projection3[1][1], 0.5, MPFR_RNDN);
+        mpfr_set_d(projection3[3][2], 1.0, MPFR_RNDN);
+    }
+
+    // Reallocate the histogram in memory; all counts are lost
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        allocate();
+    }
+
+    // A sparse plate gives its tiles back, so not while workers run
+    void clear() {
+        if (sparse)
+            free_tiles();
+        else
+            memset(data, 0, tile_count() * PLATE_TILE_CELLS * sizeof(int64_t));
+        mark_all_dirty();
+    }
+
+    int tiles_x() const { return (width + PLATE_TILE - 1) / PLATE_TILE; }
+    int tiles_y() const { return (height + PLATE_TILE - 1) / PLATE_TILE; }
+    size_t tile_count() const { return (size_t)tiles_x() * tiles_y(); }
+
+    // Bytes held for the counts
+    size_t memory() const {
+        if (!sparse)
+            return tile_count() * PLATE_TILE_CELLS * sizeof(int64_t);
+        return directory.size() * sizeof(SparseTile*) + __atomic_load_n(&sparse_tiles, __ATOMIC_RELAXED) * sizeof(SparseTile) +
+               __atomic_load_n(&wide_tiles, __ATOMIC_RELAXED) * PLATE_TILE_CELLS * sizeof(int64_t);
+    }
+
+    // Counts of tile (tx, ty), PLATE_TILE_CELLS values, row-major. Cells
+    // past the right or bottom edge of the plate stay zero. Dense plates
+    // only; read_tile() works for both.
+    int64_t* tile(int tx, int ty) {
+        return data + tile_slot[(size_t)ty * tiles_x() + tx] * PLATE_TILE_CELLS;
+    }
+    const int64_t* tile(int tx, int ty) const {
+        return data + tile_slot[(size_t)ty * tiles_x() + tx] * PLATE_TILE_CELLS;
+    }
+
+    int64_t& at(int x, int y) {
+        return tile(x / PLATE_TILE, y / PLATE_TILE)[(y % PLATE_TILE) * PLATE_TILE + x % PLATE_TILE];
+    }
+
+    // Relaxed read, safe while workers are merging
+    int64_t get(int x, int y) const {
+        int i = (y % PLATE_TILE) * PLATE_TILE + x % PLATE_TILE;
+        if (sparse) {
+            const SparseTile* t = find_tile(x / PLATE_TILE, y / PLATE_TILE);
+            return t ? read_cell(t, i) : 0;
+        }
+        return __atomic_load_n(&tile(x / PLATE_TILE, y / PLATE_TILE)[i], __ATOMIC_RELAXED);
+    }
+
+    // Copy row y (width counts) into out
+    void read_row(int y, int64_t* out) const {
+        read_span(y, 0, width, out);
+    }
+
+    // Copy the n counts of row y from column x0 on into out
+    void read_span(int y, int x0, int n, int64_t* out) const {
+        int ty = y / PLATE_TILE;
+        int r = y % PLATE_TILE;
+        for (int x = x0; x < x0 + n;) {
+            int tx = x / PLATE_TILE, c0 = x % PLATE_TILE;
+            int m = std::min(PLATE_TILE - c0, x0 + n - x);
+            int64_t* dst = out + (x - x0);
+            if (sparse) {
+                read_cells(find_tile(tx, ty), r * PLATE_TILE + c0, m, dst);
+            } else {
+                const int64_t* src = tile(tx, ty) + r * PLATE_TILE + c0;
+                for (int c = 0; c < m; c++)
+                    dst[c] = __atomic_load_n(&src[c], __ATOMIC_RELAXED);
+            }
+            x += m;
+        }
+    }
+
+    // Whether tile (tx, ty) holds counts: all do but sparse tiles never hit
+    bool has_tile(int tx, int ty) const {
+        return !sparse || find_tile(tx, ty) != NULL;
+    }
+
+    // Copy tile (tx, ty) into out (PLATE_TILE_CELLS counts, row-major).
+    // Returns false, with out zeroed, for a sparse tile never hit.
+    bool read_tile(int tx, int ty, int64_t* out) const {
+        if (sparse) {
+            const SparseTile* t = find_tile(tx, ty);
+            read_cells(t, 0, PLATE_TILE_CELLS, out);
+            return t != NULL;
+        }
+        const int64_t* src = tile(tx, ty);
+        for (int c = 0; c < PLATE_TILE_CELLS; c++)
+            out[c] = __atomic_load_n(&src[c], __ATOMIC_RELAXED);
+        return true;
+    }
+
+    // Whether tile (tx, ty) changed since the last call by `reader` (a
+    // PLATE_DIRTY_ bit), for readers that keep a copy. Counts merged before
+    // the tile was marked are visible once this returns true; later ones
+    // mark it again.
+    bool take_dirty(int tx, int ty, uint8_t reader = PLATE_DIRTY_PREVIEW) {
+        uint8_t& d = tile_dirty[(size_t)ty * tiles_x() + tx];
+        return (__atomic_load_n(&d, __ATOMIC_RELAXED) & reader) && (__atomic_fetch_and(&d, (uint8_t)~reader, __ATOMIC_ACQUIRE) & reader);
+    }
+
+    void mark_all_dirty(uint8_t readers = PLATE_DIRTY_ALL) {
+        for (size_t t = 0; t < tile_dirty.size(); t++)
+            __atomic_fetch_or(&tile_dirty[t], readers, __ATOMIC_RELEASE);
+    }
+
+    // Call f(tx, ty, cells) for every tile in storage order; for a sparse
+    // plate, for every tile hit so far, row by row
+    template <typename F>
+    void for_each_tile(F f) const {
+        if (sparse) {
+            std::vector<int64_t> cells(PLATE_TILE_CELLS);
+            for (size_t t = 0; t < directory.size(); t++)
+                if (read_tile((int)(t % tiles_x()), (int)(t / tiles_x()), &cells[0]))
+                    f((int)(t % tiles_x()), (int)(t / tiles_x()), (const int64_t*)&cells[0]);
+            return;
+        }
+        for (size_t s = 0; s < tile_count(); s++)
+            f(tile_x[s], tile_y[s], (const int64_t*)(data + s * PLATE_TILE_CELLS));
+    }
+
+    // Project q to pixel coordinates. Returns false if it misses the plate.
+    bool project(const Quaternion& q, ProjectionScratch& s, int& x, int& y) const {
+        for (int c = 0; c < 4; c++) {
+            mpfr_set(s.h3[c], projection4[4][c], MPFR_RNDN);
+            mpfr_fma(s.h3[c], q.r, projection4[0][c], s.h3[c], MPFR_RNDN);
+            mpfr_fma(s.h3[c], q.i, projection4[1][c], s.h3[c], MPFR_RNDN);
+            mpfr_fma(s.h3[c], q.j, projection4[2][c], s.h3[c], MPFR_RNDN);
+            mpfr_fma(s.h3[c], q.k, projection4[3][c], s.h3[c], MPFR_RNDN);
+        }
+        for (int c = 0; c < 3; c++) {
+            mpfr_mul(s.h2[c], s.h3[0], projection3[0][c], MPFR_RNDN);
+            for (int row = 1; row < 4; row++)
+                mpfr_fma(s.h2[c], s.h3[row], projection3[row][c], s.h2[c], MPFR_RNDN);
+        }
+        if (mpfr_zero_p(s.h2[2]))
+            return false;
+        mpfr_div(s.t, s.h2[0], s.h2[2], MPFR_RNDN);
+        double u = mpfr_get_d(s.t, MPFR_RNDN);
+        mpfr_div(s.t, s.h2[1], s.h2[2], MPFR_RNDN);
+        double v = mpfr_get_d(s.t, MPFR_RNDN);
+
+        double fx = (u + 1.0) * 0.5 * width;
+        double fy = (1.0 - v) * 0.5 * height;
+        if (!(fx >= 0.0 && fx < width && fy >= 0.0 && fy < height))
+            return false;
+        x = (int)fx;
+        y = (int)fy;
+        return true;
+    }
+
+    // Compose projection4, projection3 and the viewport into t, at t's
+    // precision. Done once per run; the matrices must not change meanwhile.
+    void pixel_transform(PixelTransform& t) const {
+        for (int r = 0; r < 5; r++) {
+            for (int c = 0; c < 3; c++) {
+                mpfr_set_zero(t.m[r][c], 1);
+                for (int k = 0; k < 4; k++)
+                    mpfr_fma(t.m[r][c], projection4[r][k], projection3[k][c], t.m[r][c], MPFR_RNDN);
+            }
+            // x = (u / w + 1) * width / 2, y = (1 - v / w) * height / 2
+            mpfr_add(t.m[r][0], t.m[r][0], t.m[r][2], MPFR_RNDN);
+            mpfr_mul_d(t.m[r][0], t.m[r][0], 0.5 * width, MPFR_RNDN);
+            mpfr_sub(t.m[r][1], t.m[r][2], t.m[r][1], MPFR_RNDN);
+            mpfr_mul_d(t.m[r][1], t.m[r][1], 0.5 * height, MPFR_RNDN);
+        }
+        t.width = width;
+        t.height = height;
+        t.affine = !mpfr_zero_p(t.m[4][2]);
+        for (int r = 0; r < 4; r++)
+            t.affine = t.affine && mpfr_zero_p(t.m[r][2]);
+        if (t.affine) {
+            for (int r = 0; r < 5; r++) {
+                mpfr_div(t.m[r][0], t.m[r][0], t.m[4][2], MPFR_RNDN);
+                mpfr_div(t.m[r][1], t.m[r][1], t.m[4][2], MPFR_RNDN);
+            }
+            for (int r = 0; r < 5; r++)
+                mpfr_set_d(t.m[r][2], r == 4 ? 1.0 : 0.0, MPFR_RNDN);
+        }
+    }
+
+    // Same for a point held by another backend; s must be at least as
+    // precise as q
+    template <typename B>
+    bool project(const QuaternionT<B>& q, ProjectionScratch& s, int& x, int& y) const {
+        s.point.set(q, s.t);
+        return project(s.point, s, x, y);
+    }
+
+    // log2 of the size of one pixel in sample space, for an affine view
+    mpfr_exp_t pixel_exp() const {
+        mpfr_t g, t, w;
+        mpfr_init2(g, 64);
+        mpfr_init2(t, 64);
+        mpfr_init2(w, 64);
+        // Largest gain from a sample coordinate to u or v, and the constant w
+        mpfr_set_zero(g, 1);
+        for (int c = 0; c < 3; c++) {
+            for (int row = 0; row < 5; row++) {
+                mpfr_set_zero(t, 1);
+                for (int k = 0; k < 4; k++)
+                    mpfr_fma(t, projection4[row][k], projection3[k][c], t, MPFR_RNDN);
+                if (c == 2 && row == 4)
+                    mpfr_abs(w, t, MPFR_RNDN);
+                else if (c < 2 && row < 4 && mpfr_cmpabs(t, g) > 0)
+                    mpfr_abs(g, t, MPFR_RNDN);
+            }
+        }
+        mpfr_exp_t e = 0;
+        if (mpfr_regular_p(g) && mpfr_regular_p(w)) {
+            // pixel = 2 w / (g * max(width, height))
+            mpfr_mul_2ui(t, w, 1, MPFR_RNDN);
+            mpfr_div(t, t, g, MPFR_RNDN);
+            mpfr_div_ui(t, t, (unsigned long)std::max(width, height), MPFR_RNDN);
+            e = mpfr_get_exp(t);
+        }
+        mpfr_clear(g);
+        mpfr_clear(t);
+        mpfr_clear(w);
+        return e;
+    }
+
+    // Safe to call from several sampling threads at once
+    void deposit(int x, int y, int64_t n = 1) {
+        if (sparse) {
+            SparseTile* t = hit_tile(x / PLATE_TILE, y / PLATE_TILE);
+            lock(t);
+            add_cell(t, (y % PLATE_TILE) * PLATE_TILE + x % PLATE_TILE, n);
+            unlock(t);
+        } else {
+            __atomic_fetch_add(&at(x, y), n, __ATOMIC_RELAXED);
+        }
+        uint8_t& d = tile_dirty[(size_t)(y / PLATE_TILE) * tiles_x() + x / PLATE_TILE];
+        if (__atomic_load_n(&d, __ATOMIC_RELAXED) != PLATE_DIRTY_ALL)
+            __atomic_store_n(&d, PLATE_DIRTY_ALL, __ATOMIC_RELEASE);
+    }
+
+    // Add a PLATE_TILE x PLATE_TILE block of counts (row-major) to tile
+    // (tx, ty). Bit r of row_mask says row r has nonzero counts; the merged
+    // cells are zeroed so the caller can reuse the block.
+    void merge_tile(int tx, int ty, uint32_t* cells, uint64_t row_mask) {
+        if (sparse) {
+            merge_sparse(hit_tile(tx, ty), cells, row_mask);
+            __atomic_store_n(&tile_dirty[(size_t)ty * tiles_x() + tx], PLATE_DIRTY_ALL, __ATOMIC_RELEASE);
+            return;
+        }
+        int64_t* dst = tile(tx, ty);
+        while (row_mask) {
+            int r = __builtin_ctzll(row_mask);
+            row_mask &= row_mask - 1;
+            uint32_t* row = cells + r * PLATE_TILE;
+            int64_t* out = dst + r * PLATE_TILE;
+            for (int c = 0; c < PLATE_TILE; c++) {
+                if (row[c]) {
+                    __atomic_fetch_add(&out[c], (int64_t)row[c], __ATOMIC_RELAXED);
+                    row[c] = 0;
+                }
+            }
+        }
+        __atomic_store_n(&tile_dirty[(size_t)ty * tiles_x() + tx], PLATE_DIRTY_ALL, __ATOMIC_RELEASE);
+    }
+
+    // Move the counts of tile (tx, ty) of `replica`, a dense plate of the
+    // same size, into this dense plate, leaving the replica's at zero.
+    // Safe while workers merge into either: each cell is swapped out and
+    // added on atomically. Returns true if anything moved.
+    bool absorb_tile(Plate& replica, int tx, int ty) {
+        int64_t* src = replica.tile(tx, ty);
+        int64_t* dst = tile(tx, ty);
+        bool any = false;
+        for (int c = 0; c < PLATE_TILE_CELLS; c++) {
+            if (__atomic_load_n(&src[c], __ATOMIC_RELAXED)) {
+                __atomic_fetch_add(&dst[c], __atomic_exchange_n(&src[c], (int64_t)0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+                any = true;
+            }
+        }
+        if (any)
+            __atomic_store_n(&tile_dirty[(size_t)ty * tiles_x() + tx], PLATE_DIRTY_ALL, __ATOMIC_RELEASE);
+        return any;
+    }
+
+    // Write the counts as "RB9PLATE", uint32 width and height, then
+    // width * height int64 counts row by row, all in host byte order. The
+    // file is written next to `path` and renamed over it, so a reader never
+    // sees half a plate. Safe while workers are merging.
+    bool save(const char* path) const {
+        std::string tmp = std::string(path) + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            return false;
+        uint32_t size[2] = { (uint32_t)width, (uint32_t)height };
+        bool ok = fwrite("RB9PLATE", 1, 8, f) == 8 && fwrite(size, sizeof(size), 1, f) == 1;
+        std::vector<int64_t> row(width);
+        for (int y = 0; ok && y < height; y++) {
+            read_row(y, &row[0]);
+            ok = fwrite(&row[0], sizeof(int64_t), width, f) == (size_t)width;
+        }
+        ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+        remove(path);
+#endif
+        if (ok)
+            ok = rename(tmp.c_str(), path) == 0;
+        if (!ok)
+            remove(tmp.c_str());
+        return ok;
+    }
+
+    // Write the counts as a plate file for open_file() to take back. Tiles that are all zero, and those a
+    // sparse plate never allocated, are left as holes in the file; a
+    // sparse plate's tiles go in row-major order. The file is written next
+    // to `path` and renamed over it. Safe while workers are merging.
+    bool save_tiles(const char* path, std::string& error) const {
+#ifdef _WIN32
+        (void)path;
+        error = "plate files need a POSIX system";
+        return false;
+#else
+        PlateFileHeader h = file_header();
+        size_t bytes = PLATE_FILE_HEADER + tile_count() * PLATE_TILE_CELLS * sizeof(int64_t);
+        std::string tmp = std::string(path) + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error = tmp + ": " + strerror(errno);
+            return false;
+        }
+        bool ok = ftruncate(fd, (off_t)bytes) == 0 && pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+        std::vector<int64_t> cells(PLATE_TILE_CELLS);
+        for (size_t s = 0; ok && s < tile_count(); s++) {
+            int tx = sparse ? (int)(s % tiles_x()) : tile_x[s];
+            int ty = sparse ? (int)(s / tiles_x()) : tile_y[s];
+            if (!read_tile(tx, ty, &cells[0]))
+                continue;
+            bool zero = true;
+            for (int c = 0; zero && c < PLATE_TILE_CELLS; c++)
+                zero = cells[c] == 0;
+            if (!zero) {
+                size_t n = PLATE_TILE_CELLS * sizeof(int64_t);
+                ok = pwrite(fd, &cells[0], n, (off_t)(PLATE_FILE_HEADER + s * n)) == (ssize_t)n;
+            }
+        }
+        if (!ok)
+            error = tmp + ": " + strerror(errno);
+        ok = close(fd) == 0 && ok;
+        if (ok && rename(tmp.c_str(), path) != 0) {
+            error = std::string(path) + ": " + strerror(errno);
+            ok = false;
+        }
+        if (!ok)
+            remove(tmp.c_str());
+        return ok;
+#endif
+    }
+
+    // Bring the plate file at `path` up to date, for checkpoints that read
+    // the dirty flags as `reader`. With `update`, the file holds the counts
+    // as of the last call for `reader`, and only the tiles merged into
+    // since are written over; otherwise, or if it is not a plate file of
+    // this plate, it is written anew next to `path` and renamed over it,
+    // as save_tiles() does, holes and all. The file is fsynced. Not while workers are
+    // merging.
+    //
+    // A plate mapped from this very file by open_file() may be updated:
+    // its pages that were never written still match the file, and only
+    // tiles with written pages are written over. A new file is a new
+    // inode, so the mapping keeps the old one.
+    bool write_tiles(const char* path, uint8_t reader, bool update, std::string& error) {
+#ifdef _WIN32
+        (void)path; (void)reader; (void)update;
+        error = "plate files need a POSIX system";
+        return false;
+#else
+        PlateFileHeader h = file_header();
+        const size_t tile_bytes = PLATE_TILE_CELLS * sizeof(int64_t);
+        const size_t bytes = PLATE_FILE_HEADER + tile_count() * tile_bytes;
+        int fd = update ? open(path, O_RDWR) : -1;
+        if (fd >= 0) {
+            PlateFileHeader old;
+            struct stat st;
+            update = pread(fd, &old, sizeof(old), 0) == (ssize_t)sizeof(old) && fstat(fd, &st) == 0 &&
+                     memcmp(&old, &h, sizeof(h)) == 0 && (size_t)st.st_size == bytes;
+            if (!update) {
+                close(fd);
+                fd = -1;
+            }
+        } else {
+            update = false;
+        }
+        std::string tmp = std::string(path) + ".tmp";
+        if (!update)
+            fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error = (update ? std::string(path) : tmp) + ": " + strerror(errno);
+            return false;
+        }
+        // New files start as holes, which read as zeros
+        bool ok = update || (ftruncate(fd, (off_t)bytes) == 0 && pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h));
+        std::vector<int64_t> cells(PLATE_TILE_CELLS);
+        for (size_t s = 0; ok && s < tile_count(); s++) {
+            int tx = sparse ? (int)(s % tiles_x()) : tile_x[s];
+            int ty = sparse ? (int)(s / tiles_x()) : tile_y[s];
+            if (!take_dirty(tx, ty, reader) && update)
+                continue;
+            // A sparse tile never hit is a hole in a new file
+            if (!read_tile(tx, ty, &cells[0]) && !update)
+                continue;
+            bool zero = !update;
+            for (int c = 0; zero && c < PLATE_TILE_CELLS; c++)
+                zero = cells[c] == 0;
+            if (!zero)
+                ok = pwrite(fd, &cells[0], tile_bytes, (off_t)(PLATE_FILE_HEADER + s * tile_bytes)) == (ssize_t)tile_bytes;
+        }
+        ok = ok && fsync(fd) == 0;
+        if (!ok)
+            error = (update ? std::string(path) : tmp) + ": " + strerror(errno);
+        ok = close(fd) == 0 && ok;
+        if (!update && ok && rename(tmp.c_str(), path) != 0) {
+            error = std::string(path) + ": " + strerror(errno);
+            ok = false;
+        }
+        if (!update && !ok)
+            remove(tmp.c_str());
+        return ok;
+#endif
+    }
+
+    // Take the counts, size and tile order from the plate file at `path`.
+    // A dense plate maps it copy-on-write: nothing is read up front, pages
+    // come in as they are touched, and later hits stay in memory, leaving
+    // the file as it was. A sparse plate reads only the tiles the file
+    // holds data for, which must be in row-major order.
+    bool open_file(const char* path, std::string& error) {
+#ifdef _WIN32
+        (void)path;
+        error = "plate files need a POSIX system";
+        return false;
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            error = std::string(path) + ": " + strerror(errno);
+            return false;
+        }
+        PlateFileHeader h;
+        struct stat st;
+        bool ok = pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && fstat(fd, &st) == 0 &&
+                  memcmp(h.magic, "RB9TILES", 8) == 0 && h.version == 1 && h.tile == PLATE_TILE &&
+                  h.width >= 1 && h.width <= INT32_MAX && h.height >= 1 && h.height <= INT32_MAX;
+        size_t tiles = ok ? (size_t)((h.width + PLATE_TILE - 1) / PLATE_TILE) * ((h.height + PLATE_TILE - 1) / PLATE_TILE) : 0;
+        size_t tile_bytes = PLATE_TILE_CELLS * sizeof(int64_t);
+        size_t bytes = PLATE_FILE_HEADER + tiles * tile_bytes;
+        ok = ok && h.tiles == tiles && (size_t)st.st_size == bytes && !(sparse && h.morton);
+        if (!ok) {
+            close(fd);
+            error = std::string(path) + ": not a plate file" + (sparse ? " in row-major tile order" : "");
+            return false;
+        }
+        if (sparse) {
+            // Read into a plate of the file's size, so this one is left as
+            // it was if a read fails
+            Plate loaded((int)h.width, (int)h.height, false, true);
+            std::vector<int64_t> cells(PLATE_TILE_CELLS);
+            size_t t = 0;
+            while (ok && t < tiles) {
+                off_t at = (off_t)(PLATE_FILE_HEADER + t * tile_bytes);
+#ifdef SEEK_DATA
+                // Skip the holes save_tiles() left; past the last data is
+                // the only error that ends the file
+                at = lseek(fd, at, SEEK_DATA);
+                if (at < 0) {
+                    ok = errno == ENXIO;
+                    break;
+                }
+                t = ((size_t)at - PLATE_FILE_HEADER) / tile_bytes;
+                at = (off_t)(PLATE_FILE_HEADER + t * tile_bytes);
+#endif
+                ok = pread(fd, &cells[0], tile_bytes, at) == (ssize_t)tile_bytes;
+                SparseTile* s = NULL;
+                for (int c = 0; ok && c < PLATE_TILE_CELLS; c++) {
+                    if (cells[c]) {
+                        if (!s)
+                            s = loaded.hit_tile((int)(t % loaded.tiles_x()), (int)(t / loaded.tiles_x()));
+                        loaded.add_cell(s, c, cells[c]);
+                    }
+                }
+                t++;
+            }
+            close(fd);
+            if (!ok) {
+                error = std::string(path) + ": cannot read";
+                return false;
+            }
+            release();
+            width = loaded.width;
+            height = loaded.height;
+            morton = false;
+            directory.swap(loaded.directory);
+            std::swap(sparse_tiles, loaded.sparse_tiles);
+            std::swap(wide_tiles, loaded.wide_tiles);
+            layout();
+            set_stamp(h);
+            return true;
+        }
+        void* base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            error = std::string(path) + ": " + strerror(errno);
+            return false;
+        }
+        release();
+        width = (int)h.width;
+        height = (int)h.height;
+        morton = h.morton != 0;
+        map_base = base;
+        map_bytes = bytes;
+        data = (int64_t*)((char*)base + PLATE_FILE_HEADER);
+        layout();
+        set_stamp(h);
+        return true;
+#endif
+    }
+
+    // Methods for loading, receiving a quaternion, etc.
+    // void loadFromFile(const std::string& filename);
+    bool receiveQuaternion(const Quaternion& q, ProjectionScratch& s) {
+        int x, y;
+        if (!project(q, s, x, y))
+            return false;
+        deposit(x, y);
+        return true;
+    }
+    // std::vector<std::vector<uint8_t>> getScaledData() const;
+
+private:
+    std::vector<uint32_t> tile_slot; // Storage slot of tile ty * tiles_x() + tx
+    std::vector<int> tile_x, tile_y; // Tile coordinates of each storage slot
+    std::vector<uint8_t> tile_dirty; // Per tile ty * tiles_x() + tx: merged into since take_dirty()
+    std::vector<SparseTile*> directory; // Per tile ty * tiles_x() + tx when sparse; NULL until hit
+    size_t sparse_tiles, wide_tiles; // Tiles allocated, and of those promoted
+
+    void* map_base;                  // Copy-on-write mapping of a plate file, if any
+    size_t map_bytes;
+
+    PlateFileHeader file_header() const {
+        PlateFileHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "RB9TILES", 8);
+        h.version = 1;
+        h.width = (uint32_t)width;
+        h.height = (uint32_t)height;
+        h.tile = PLATE_TILE;
+        h.morton = morton && !sparse ? 1 : 0;
+        h.tiles = tile_count();
+        h.scene_hash = stamp.scene_hash;
+        h.plate = stamp.plate;
+        h.shard = stamp.shard;
+        h.shards = stamp.shards;
+        return h;
+    }
+
+    void set_stamp(const PlateFileHeader& h) {
+        stamp.scene_hash = h.scene_hash;
+        stamp.plate = h.plate;
+        stamp.shard = h.shard;
+        stamp.shards = h.shards;
+    }
+
+    const SparseTile* find_tile(int tx, int ty) const {
+        return __atomic_load_n(&directory[(size_t)ty * tiles_x() + tx], __ATOMIC_ACQUIRE);
+    }
+
+    // The tile at (tx, ty), allocated if this is its first hit. Racing
+    // writers both allocate; the one that loses frees its copy.
+    SparseTile* hit_tile(int tx, int ty) {
+        SparseTile*& slot = directory[(size_t)ty * tiles_x() + tx];
+        SparseTile* t = __atomic_load_n(&slot, __ATOMIC_ACQUIRE);
+        if (t)
+            return t;
+        SparseTile* fresh = (SparseTile*)aligned_malloc(sizeof(SparseTile), CACHE_LINE);
+        memset(fresh, 0, sizeof(SparseTile));
+        if (__atomic_compare_exchange_n(&slot, &t, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&sparse_tiles, (size_t)1, __ATOMIC_RELAXED);
+            return fresh;
+        }
+        aligned_free(fresh);
+        return t;
+    }
+
+    static void lock(SparseTile* t) {
+        while (__atomic_exchange_n(&t->lock, (uint8_t)1, __ATOMIC_ACQUIRE))
+            while (__atomic_load_n(&t->lock, __ATOMIC_RELAXED)) {}
+    }
+
+    static void unlock(SparseTile* t) {
+        __atomic_store_n(&t->lock, (uint8_t)0, __ATOMIC_RELEASE);
+    }
+
+    static int64_t read_cell(const SparseTile* t, int i) {
+        const int64_t* wide = __atomic_load_n(&t->wide, __ATOMIC_ACQUIRE);
+        return wide ? __atomic_load_n(&wide[i], __ATOMIC_RELAXED) : (int64_t)__atomic_load_n(&t->narrow[i], __ATOMIC_RELAXED);
+    }
+
+    // Copy n counts from cell i on; zeros if the tile was never hit
+    static void read_cells(const SparseTile* t, int i, int n, int64_t* out) {
+        if (!t) {
+            std::fill(out, out + n, (int64_t)0);
+            return;
+        }
+        const int64_t* wide = __atomic_load_n(&t->wide, __ATOMIC_ACQUIRE);
+        if (wide) {
+            for (int c = 0; c < n; c++)
+                out[c] = __atomic_load_n(&wide[i + c], __ATOMIC_RELAXED);
+        } else {
+            for (int c = 0; c < n; c++)
+                out[c] = __atomic_load_n(&t->narrow[i + c], __ATOMIC_RELAXED);
+        }
+    }
+
+    // Add n to cell i; the caller holds the lock. Stores stay atomic for
+    // the readers.
+    void add_cell(SparseTile* t, int i, int64_t n) {
+        int64_t* wide = __atomic_load_n(&t->wide, __ATOMIC_RELAXED);
+        if (!wide) {
+            uint64_t v = (uint64_t)__atomic_load_n(&t->narrow[i], __ATOMIC_RELAXED) + (uint64_t)n;
+            if (v <= UINT32_MAX) {
+                __atomic_store_n(&t->narrow[i], (uint32_t)v, __ATOMIC_RELAXED);
+                return;
+            }
+            wide = promote(t);
+        }
+        __atomic_store_n(&wide[i], __atomic_load_n(&wide[i], __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+
+    // Move tile t to 64-bit counts; the caller holds the lock
+    int64_t* promote(SparseTile* t) {
+        int64_t* wide = (int64_t*)aligned_malloc(PLATE_TILE_CELLS * sizeof(int64_t), CACHE_LINE);
+        for (int c = 0; c < PLATE_TILE_CELLS; c++)
+            wide[c] = t->narrow[c];
+        __atomic_store_n(&t->wide, wide, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&wide_tiles, (size_t)1, __ATOMIC_RELAXED);
+        return wide;
+    }
+
+    // merge_tile() for a sparse tile
+    void merge_sparse(SparseTile* t, uint32_t* cells, uint64_t row_mask) {
+        lock(t);
+        while (row_mask) {
+            int r = __builtin_ctzll(row_mask);
+            row_mask &= row_mask - 1;
+            uint32_t* row = cells + r * PLATE_TILE;
+            for (int c = 0; c < PLATE_TILE; c++) {
+                if (row[c]) {
+                    add_cell(t, r * PLATE_TILE + c, row[c]);
+                    row[c] = 0;
+                }
+            }
+        }
+        unlock(t);
+    }
+
+    void free_tiles() {
+        for (size_t t = 0; t < directory.size(); t++) {
+            if (directory[t]) {
+                aligned_free(directory[t]->wide);
+                aligned_free(directory[t]);
+                directory[t] = NULL;
+            }
+        }
+        sparse_tiles = 0;
+        wide_tiles = 0;
+    }
+
+    void release() {
+        free_tiles();
+        directory.clear();
+#ifndef _WIN32
+        if (map_base)
+            munmap(map_base, map_bytes);
+        else
+#endif
+            aligned_free(data);
+        map_base = NULL;
+        map_bytes = 0;
+        data = NULL;
+    }
+
+    void allocate() {
+        release();
+        if (sparse)
+            directory.assign(tile_count(), NULL);
+        else
+            data = (int64_t*)aligned_malloc(tile_count() * PLATE_TILE_CELLS * sizeof(int64_t), CACHE_LINE);
+        layout();
+        clear();
+    }
+
+    // Storage order of the tiles; sparse tiles each have their own
+    void layout() {
+        size_t n = tile_count();
+        tile_dirty.assign(n, PLATE_DIRTY_ALL);
+        if (sparse) {
+            tile_slot.clear();
+            tile_x.clear();
+            tile_y.clear();
+            return;
+        }
+        // (curve position, row-major tile index), sorted into storage order
+        std::vector<std::pair<uint64_t, size_t> > order(n);
+        for (size_t t = 0; t < n; t++) {
+            uint32_t tx = (uint32_t)(t % tiles_x()), ty = (uint32_t)(t / tiles_x());
+            order[t] = std::make_pair(morton ? morton2(tx, ty) : (uint64_t)t, t);
+        }
+        std::sort(order.begin(), order.end());
+        tile_slot.resize(n);
+        tile_x.resize(n);
+        tile_y.resize(n);
+        for (size_t s = 0; s < n; s++) {
+            size_t t = order[s].second;
+            tile_slot[t] = (uint32_t)s;
+            tile_x[s] = (int)(t % tiles_x());
+            tile_y[s] = (int)(t / tiles_x());
+        }
+    }
+
+    Plate(const Plate&);
+    Plate& operator=(const Plate&);
+};
+
+// Every plate's PixelTransform rounded to backend B, for one worker. A point
+// is projected onto all plates in one pass: each affine plate first gets a
+// bound on the pixel from the point in doubles, and only points that may
+// land on it are projected in B. In double the bound is the projection.
+template <typename B>
+class PlateProjections {
+public:
+    // Values are pooled in `arena`, which must outlive this
+    PlateProjections(const std::vector<const PixelTransform*>& views, mpfr_prec_t prec, MpfrArena& arena) : targets(views.size()) {
+        for (size_t p = 0; p < views.size(); p++) {
+            Target& t = targets[p];
+            t.affine = views[p]->affine;
+            t.width = views[p]->width;
+            t.height = views[p]->height;
+            t.sees = 0;
+            for (int r = 0; r < 5; r++) {
+                for (int c = 0; c < 3; c++) {
+                    B::init_pooled(t.m[r][c], prec, arena);
+                    B::set_mpfr(t.m[r][c], views[p]->m[r][c]);
+                    t.d[r][c] = mpfr_get_d(views[p]->m[r][c], MPFR_RNDN);
+                    if (r < 4 && !mpfr_zero_p(views[p]->m[r][c]))
+                        t.sees |= 1u << r;
+                }
+            }
+        }
+        B::init_pooled(x, prec, arena);
+        B::init_pooled(y, prec, arena);
+        B::init_pooled(w, prec, arena);
+    }
+
+    size_t size() const {
+        return targets.size();
+    }
+
+    // Call hit(plate, x, y) for every plate q lands on. With `axes`, only
+    // plates that see some of them (`seeing`) or none of them are tried.
+    template <typename F>
+    void project(const QuaternionT<B>& q, F hit, unsigned axes = 0, bool seeing = true) {
+        const bool in_double = std::is_same<B, DoubleBackend>::value;
+        // Rounding q and the matrix to double and summing five products is
+        // off by a few ulps of the sum of magnitudes
+        const double slack = in_double ? 0.0 : 16.0 * 1.1102230246251565e-16;
+        double qd[4] = { B::get_d(q.r), B::get_d(q.i), B::get_d(q.j), B::get_d(q.k) };
+        for (size_t p = 0; p < targets.size(); p++) {
+            Target& t = targets[p];
+            if (axes && ((t.sees & axes) != 0) != seeing)
+                continue;
+            double px, py;
+            if (t.affine) {
+                px = t.d[4][0];
+                py = t.d[4][1];
+                double ax = fabs(px), ay = fabs(py);
+                for (int c = 0; c < 4; c++) {
+                    px += qd[c] * t.d[c][0];
+                    py += qd[c] * t.d[c][1];
+                    ax += fabs(qd[c] * t.d[c][0]);
+                    ay += fabs(qd[c] * t.d[c][1]);
+                }
+                double ex = slack * ax, ey = slack * ay;
+                if (px + ex < 0.0 || px - ex >= t.width || py + ey < 0.0 || py - ey >= t.height)
+                    continue;
+                if (!in_double) {
+                    dot(x, q, t, 0);
+                    dot(y, q, t, 1);
+                    px = B::get_d(x);
+                    py = B::get_d(y);
+                }
+            } else {
+                // X, Y and W are well conditioned once summed in B
+                dot(x, q, t, 0);
+                dot(y, q, t, 1);
+                dot(w, q, t, 2);
+                double wd = B::get_d(w);
+                if (wd == 0.0)
+                    continue;
+                px = B::get_d(x) / wd;
+                py = B::get_d(y) / wd;
+            }
+            if (!(px >= 0.0 && px < t.width && py >= 0.0 && py < t.height))
+                continue;
+            hit((uint32_t)p, (int)px, (int)py);
+        }
+    }
+
+private:
+    struct Target {
+        typename B::value m[5][3];
+        double d[5][3];              // m rounded to double, for the bound
+        unsigned sees;               // Components that move a point on it, bit c for (r, i, j, k)[c]
+        bool affine;
+        int width, height;
+    };
+    std::vector<Target> targets;
+    typename B::value x, y, w;
+
+    static void dot(typename B::value& out, const QuaternionT<B>& q, const Target& t, int c) {
+        B::fma(out, q.r, t.m[0][c], t.m[4][c]);
+        B::fma(out, q.i, t.m[1][c], out);
+        B::fma(out, q.j, t.m[2][c], out);
+        B::fma(out, q.k, t.m[3][c], out);
+    }
+
+    PlateProjections(const PlateProjections&);
+    PlateProjections& operator=(const PlateProjections&);
+};
+
+#endif
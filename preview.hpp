@@ -0,0 +1,223 @@
+#ifndef PREVIEW_HPP
+#define PREVIEW_HPP
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "plate.hpp"
+#include "colormap.hpp"
+
+// Display copy of one plate, kept by the GUI thread. Whatever the size of
+// the plate the copy stays within max_side texels a side: each texel holds
+// the sum of a `cell` x `cell` block of counts, `cell` the smallest power
+// of two that fits. Each update() takes the tiles the workers merged into
+// since the last one (Plate::take_dirty), folds only those into their
+// texels and tonemaps those into `rgba`; the caller uploads the rectangles
+// in `updated`, or all of `rgba` when `full` is set. Sparse tiles never
+// hit are not read, so a huge sparse plate costs what it holds. Nothing is
+// locked: a tile read while a worker merges into it has been marked dirty
+// again and is redone on a later frame.
+
+static const int PREVIEW_TILES_PER_FRAME = 64; // Bounds the work of one frame
+static const int PREVIEW_MAX_SIDE = 2048;      // Texels on the longer side, at most
+
+// Texels redone, in texel coordinates
+struct PreviewRect {
+    int x, y, w, h;
+};
+
+class PlatePreview {
+public:
+    int width, height;               // Texels
+    int cell;                        // Plate pixels per texel, across and down
+    std::vector<uint32_t> rgba;      // width x height, row-major, R in the low byte
+    std::vector<PreviewRect> updated; // Texels redone by the last update()
+    bool full;                       // The last update() redid every texel
+
+    PlatePreview() : width(0), height(0), cell(1), full(false), source(NULL), plate_width(0), plate_height(0), plate_sparse(false), side(0),
+        cursor(0), counts_max(0), stats_max(0), threads(std::max(1, (int)std::thread::hardware_concurrency())) {}
+
+    // Start over, e.g. after the plate was cleared behind our back
+    void reset() {
+        source = NULL;
+    }
+
+    // Bring the copy up to date with `plate`, at most `max_side` texels a
+    // side, taking at most `max_tiles` dirty tiles; the rest stay dirty for
+    // the next frames. Returns true if any texel changed.
+    bool update(Plate& plate, int max_side = PREVIEW_MAX_SIDE, int max_tiles = PREVIEW_TILES_PER_FRAME) {
+        updated.clear();
+        full = false;
+        max_side = std::max(1, max_side);
+        if (source != &plate || plate_width != plate.width || plate_height != plate.height || plate_sparse != plate.sparse ||
+            side != max_side) {
+            source = &plate;
+            plate_width = plate.width;
+            plate_height = plate.height;
+            plate_sparse = plate.sparse;
+            side = max_side;
+            cell = 1;
+            while ((plate.width + cell - 1) / cell > max_side || (plate.height + cell - 1) / cell > max_side)
+                cell *= 2;
+            width = (plate.width + cell - 1) / cell;
+            height = (plate.height + cell - 1) / cell;
+            rgba.assign((size_t)width * height, 0xFF000000u);
+            counts.assign((size_t)width * height, 0);
+            tile_sums.assign(cell > PLATE_TILE ? plate.tile_count() : 0, 0);
+            shown.assign(plate.sparse ? plate.tile_count() : 0, 0);
+            cursor = 0;
+            counts_max = 0;
+            stats_max = 0;
+            full = true;
+            plate.mark_all_dirty(PLATE_DIRTY_PREVIEW);
+        }
+
+        // Round robin from where the last frame stopped, so no tile starves
+        const int tiles_x = plate.tiles_x();
+        const size_t n = plate.tile_count();
+        cells.resize(PLATE_TILE_CELLS);
+        bool shrunk = false;
+        size_t k = 0;
+        for (; k < n && (int)updated.size() < max_tiles; k++) {
+            size_t t = (cursor + k) % n;
+            int tx = (int)(t % tiles_x), ty = (int)(t / tiles_x);
+            if (!plate.take_dirty(tx, ty))
+                continue;
+            if (!shown.empty()) {
+                // A sparse tile never hit has nothing to show, unless a
+                // clear gave back one that was shown
+                bool hit = plate.has_tile(tx, ty);
+                if (!hit && !shown[t])
+                    continue;
+                shown[t] = hit;
+            }
+            plate.read_tile(tx, ty, &cells[0]);
+            updated.push_back(fold(tx, ty, tiles_x, shrunk));
+        }
+        cursor = (cursor + k) % std::max<size_t>(n, 1);
+        // Counts only grow, unless the plate was cleared
+        if (shrunk)
+            counts_max = counts.empty() ? 0 : *std::max_element(counts.begin(), counts.end());
+
+        // The statistics are taken again when the curve or percentile
+        // changes or the brightest texel has grown by a quarter or dropped
+        // by half (a clear); a new colormap only needs the tables rebuilt
+        // from the ones kept. Either way every texel is redone.
+        const ToneSettings& was = tone.current();
+        if (full || plate.tone.curve != was.curve || plate.tone.percentile != was.percentile ||
+            counts_max > stats_max + stats_max / 4 || counts_max < stats_max / 2) {
+            tone_stats(&counts[0], counts.size(), threads, stats);
+            tone.prepare(plate.tone, stats);
+            stats_max = counts_max;
+            full = true;
+        } else if (plate.tone.colormap != was.colormap) {
+            tone.prepare(plate.tone, stats);
+            full = true;
+        }
+        if (full) {
+            tone_parallel((size_t)height, std::min(threads, height), [this](int, size_t begin, size_t end) {
+                for (size_t y = begin; y < end; y++)
+                    tone.map(&counts[y * width], &rgba[y * width], width);
+            });
+        } else {
+            for (size_t u = 0; u < updated.size(); u++)
+                for (int r = 0; r < updated[u].h; r++) {
+                    size_t at = (size_t)(updated[u].y + r) * width + updated[u].x;
+                    tone.map(&counts[at], &rgba[at], updated[u].w);
+                }
+        }
+        return full || !updated.empty();
+    }
+
+private:
+    const Plate* source;             // What the copy is of
+    int plate_width, plate_height;   // Its size when the copy was laid out
+    bool plate_sparse;
+    int side;                        // max_side then
+    std::vector<int64_t> counts;     // width x height texel sums, as last taken
+    std::vector<int64_t> tile_sums;  // Per tile ty * tiles_x + tx, when a texel spans tiles
+    std::vector<uint8_t> shown;      // Per tile of a sparse plate: folded in with counts
+    std::vector<int64_t> cells;      // The tile being folded
+    size_t cursor;                   // First tile to look at next time
+    int64_t counts_max;              // Brightest texel
+    int64_t stats_max;               // Brightest texel when the statistics were taken
+    ToneStats stats;                 // Of `counts`, as last taken
+    int threads;
+    ToneMap tone;
+
+    void set(size_t at, int64_t v, bool& shrunk) {
+        shrunk = shrunk || v < counts[at];
+        counts[at] = v;
+        counts_max = std::max(counts_max, v);
+    }
+
+    // Fold tile (tx, ty), read into `cells`, into its texels; returns them
+    PreviewRect fold(int tx, int ty, int tiles_x, bool& shrunk) {
+        if (cell <= PLATE_TILE) {
+            const int per = PLATE_TILE / cell;
+            PreviewRect rect = { tx * per, ty * per, std::min(per, width - tx * per), std::min(per, height - ty * per) };
+            for (int r = 0; r < rect.h; r++) {
+                for (int c = 0; c < rect.w; c++) {
+                    int64_t sum = 0;
+                    for (int y = r * cell; y < (r + 1) * cell; y++)
+                        for (int x = c * cell; x < (c + 1) * cell; x++)
+                            sum += cells[y * PLATE_TILE + x];
+                    set((size_t)(rect.y + r) * width + rect.x + c, sum, shrunk);
+                }
+            }
+            return rect;
+        }
+        // A texel spans per x per tiles: keep this tile's sum and add up
+        // the texel's
+        const int per = cell / PLATE_TILE, tiles_y = (plate_height + PLATE_TILE - 1) / PLATE_TILE;
+        int64_t sum = 0;
+        for (int c = 0; c < PLATE_TILE_CELLS; c++)
+            sum += cells[c];
+        tile_sums[(size_t)ty * tiles_x + tx] = sum;
+        PreviewRect rect = { tx / per, ty / per, 1, 1 };
+        sum = 0;
+        for (int y = rect.y * per; y < std::min((rect.y + 1) * per, tiles_y); y++)
+            for (int x = rect.x * per; x < std::min((rect.x + 1) * per, tiles_x); x++)
+                sum += tile_sums[(size_t)y * tiles_x + x];
+        set((size_t)rect.y * width + rect.x, sum, shrunk);
+        return rect;
+    }
+};
+
+// ToneStats of a whole plate on `threads` threads, tile by tile, skipping
+// the ones a sparse plate never allocated. Safe while workers are merging.
+inline void plate_tone_stats(const Plate& plate, int threads, ToneStats& stats) {
+    threads = std::max(1, std::min(threads, (int)plate.tile_count()));
+    std::vector<ToneStats> part(threads);
+    tone_parallel(plate.tile_count(), threads, [&plate, &part](int t, size_t begin, size_t end) {
+        std::vector<int64_t> cells(PLATE_TILE_CELLS);
+        for (size_t i = begin; i < end; i++)
+            if (plate.read_tile((int)(i % plate.tiles_x()), (int)(i / plate.tiles_x()), &cells[0]))
+                part[t].add(&cells[0], PLATE_TILE_CELLS);
+    });
+    stats = ToneStats();
+    for (int t = 0; t < threads; t++)
+        stats.add(part[t]);
+}
+
+// Colour a whole plate at once on `threads` threads; for plates too big
+// to hold as RGBA, see export.hpp
+inline void tonemap_plate(const Plate& plate, std::vector<uint32_t>& rgba, int threads) {
+    threads = std::max(1, std::min(threads, plate.height));
+    ToneStats stats;
+    plate_tone_stats(plate, threads, stats);
+    ToneMap tone;
+    tone.prepare(plate.tone, stats);
+    rgba.resize((size_t)plate.width * plate.height);
+    tone_parallel((size_t)plate.height, threads, [&plate, &rgba, &tone](int, size_t begin, size_t end) {
+        std::vector<int64_t> row(plate.width);
+        for (size_t y = begin; y < end; y++) {
+            plate.read_row((int)y, &row[0]);
+            tone.map(&row[0], &rgba[y * plate.width], plate.width);
+        }
+    });
+}
+
+#endif
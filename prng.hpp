@@ -0,0 +1,98 @@
+#ifndef PRNG_HPP
+#define PRNG_HPP
+
+#include <string>
+#include <math.h>
+#include <stdint.h>
+
+// Counter-based random numbers: Philox4x32-10 (Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3", SC11). Every draw is a pure function
+// of a key and a counter, so there is no generator state to share or hand
+// between threads: sample N of a beam can be drawn by any worker, in any
+// order, and comes out the same.
+
+// Independent sequences under the same key and index
+enum RngStream {
+    RNG_STREAM_SAMPLE = 0,           // Gaussian draws of a sample
+    RNG_STREAM_CHAIN                 // Everything one Metropolis step draws
+};
+
+// 64-bit key for a seed string. FNV-1a with a splitmix64 finaliser, so it
+// is the same on every platform, unlike std::hash.
+inline uint64_t prng_key(const std::string& seed) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t c = 0; c < seed.size(); c++) {
+        h ^= (unsigned char)seed[c];
+        h *= 0x100000001B3ULL;
+    }
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+// One Philox4x32-10 block: ten rounds over ctr, in place
+inline void philox4x32_10(uint32_t ctr[4], uint32_t k0, uint32_t k1) {
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)0xD2511F53u * ctr[0];
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * ctr[2];
+        uint32_t c0 = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k0;
+        uint32_t c2 = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[0] = c0;
+        ctr[1] = (uint32_t)p1;
+        ctr[2] = c2;
+        ctr[3] = (uint32_t)p0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+}
+
+// The draws of one (key, index, stream): a cheap value to make on the spot
+// for every sample. The counter is (index, stream, block).
+class CounterRng {
+public:
+    CounterRng(uint64_t key_in, uint64_t index_in, uint32_t stream_in = RNG_STREAM_SAMPLE)
+        : key(key_in), index(index_in), stream(stream_in), block(0), used(4), spare(0.0), has_spare(false) {}
+
+    uint32_t next_u32() {
+        if (used == 4) {
+            out[0] = (uint32_t)index;
+            out[1] = (uint32_t)(index >> 32);
+            out[2] = stream;
+            out[3] = block++;
+            philox4x32_10(out, (uint32_t)key, (uint32_t)(key >> 32));
+            used = 0;
+        }
+        return out[used++];
+    }
+
+    // Uniform in [0, 1) with 53 random bits
+    double uniform() {
+        uint32_t a = next_u32() >> 5, b = next_u32() >> 6;
+        return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+    }
+
+    // Standard normal, Box-Muller; draws come in pairs
+    double normal() {
+        if (has_spare) {
+            has_spare = false;
+            return spare;
+        }
+        double u = 1.0 - uniform();  // (0, 1], so the log is finite
+        double v = uniform();
+        double r = sqrt(-2.0 * log(u));
+        double a = 6.283185307179586 * v;
+        spare = r * sin(a);
+        has_spare = true;
+        return r * cos(a);
+    }
+
+private:
+    uint64_t key, index;
+    uint32_t stream, block;
+    uint32_t out[4];
+    int used;                        // Words of `out` already handed out
+    double spare;
+    bool has_spare;
+};
+
+#endif
@@ -1,97 +1,430 @@
 #ifndef QUATERNION_HPP
 #define QUATERNION_HPP
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <mpfr.h>
 
-struct Quaternion {
-    mpfr_t r, i, j, k;  // Real and imaginary components
-
-    Quaternion() {
-        printf("Entering Quaternion constructor\n");
-        mpfr_init(r); printf("Initialized r. Address: %p\n", r);
-        mpfr_init(i); printf("Initialized i. Address: %p\n", i);
-        mpfr_init(j); printf("Initialized j. Address: %p\n", j);
-        mpfr_init(k); printf("Initialized k. Address: %p\n", k);
-        
-    }
-
-    Quaternion(const char* r_str, const char* i_str, const char* j_str, const char* k_str, int base = 10) {
-        printf("Entering Quaternion constructor with 4 strings\n");
-        mpfr_init_set_str(r, r_str, base, MPFR_RNDN);
-        mpfr_init_set_str(i, i_str, base, MPFR_RNDN);
-        mpfr_init_set_str(j, j_str, base, MPFR_RNDN);
-        mpfr_init_set_str(k, k_str, base, MPFR_RNDN);
-    }
-
-    Quaternion(double r_d, double i_d, double j_d, double k_d) {
-        printf("Entering Quaternion constructor with 4 doubles: %f %f %f %f\n", r_d, i_d, j_d, k_d);
-        mpfr_init_set_d(r, r_d, MPFR_RNDN);
-        mpfr_init_set_d(i, i_d, MPFR_RNDN);
-        mpfr_init_set_d(j, j_d, MPFR_RNDN);
-        mpfr_init_set_d(k, k_d, MPFR_RNDN);
-    }
-
-    ~Quaternion() {
-        printf("Entering Quaternion destructor\n");
-        mpfr_clear(r); printf("Cleared r. Address: %p\n", r);
-        mpfr_clear(i); printf("Cleared i. Address: %p\n", i);
-        mpfr_clear(j); printf("Cleared j. Address: %p\n", j);
-        mpfr_clear(k); printf("Cleared k. Address: %p\n", k);
-    }
-
-    Quaternion(const Quaternion& q) {
-        printf("Entering Quaternion copy constructor\n");
-        mpfr_init_set(r, q.r, MPFR_RNDN);
-        mpfr_init_set(i, q.i, MPFR_RNDN);
-        mpfr_init_set(j, q.j, MPFR_RNDN);
-        mpfr_init_set(k, q.k, MPFR_RNDN);
-        fprintf(stderr, "WARNING: Quaternion copy constructor called. Create new quaternions explicitly.\n");
-    }
-
-    Quaternion& operator=(const Quaternion& q) {
-        printf("Entering Quaternion assignment operator\n");
-        mpfr_set(r, q.r, MPFR_RNDN);
-        mpfr_set(i, q.i, MPFR_RNDN);
-        mpfr_set(j, q.j, MPFR_RNDN);
-        mpfr_set(k, q.k, MPFR_RNDN);
+#include "ddouble.hpp"
+#include "arena.hpp"
+
+// Scalar backends. Each one names its value type and provides the same set
+// of three-address operations, so QuaternionT and the iteration kernels can
+// be written once. Destination may alias any source. init_pooled takes
+// MPFR limbs from an arena; such values are never cleared or resized.
+
+// Hardware double, 53 bits
+struct DoubleBackend {
+    typedef double value;
+    static const char* name() { return "double"; }
+
+    static void init(value& a) { a = 0.0; }
+    static void init2(value& a, mpfr_prec_t) { a = 0.0; }
+    static void init_pooled(value& a, mpfr_prec_t, MpfrArena&) { a = 0.0; }
+    static void clear(value&) {}
+    static void set_prec(value&, mpfr_prec_t) {}
+    static mpfr_prec_t get_prec(const value&) { return 53; }
+    static void steal(value& d, value& s) { d = s; }
+    static void swap(value& a, value& b) { value t = a; a = b; b = t; }
+
+    static void set(value& d, const value& a) { d = a; }
+    static void set_d(value& d, double x) { d = x; }
+    static void set_zero(value& d) { d = 0.0; }
+    static void set_str(value& d, const char* s, int base, bool = true) {
+        d = base == 10 ? strtod(s, NULL) : (double)strtoll(s, NULL, base);
+    }
+    static void set_mpfr(value& d, mpfr_srcptr x) { d = mpfr_get_d(x, MPFR_RNDN); }
+    static void get_mpfr(mpfr_ptr d, const value& a) { mpfr_set_d(d, a, MPFR_RNDN); }
+    static double get_d(const value& a) { return a; }
+    static void get_str(char* s, const value& a, int digits) { sprintf(s, "%.*f", digits, a); }
+
+    static void add(value& d, const value& a, const value& b) { d = a + b; }
+    static void sub(value& d, const value& a, const value& b) { d = a - b; }
+    static void mul(value& d, const value& a, const value& b) { d = a * b; }
+    static void sqr(value& d, const value& a) { d = a * a; }
+    static void fma(value& d, const value& a, const value& b, const value& c) { d = a * b + c; }
+    static void fnma(value& d, const value& a, const value& b, const value& c) { d = c - a * b; }
+    static void mul_d(value& d, const value& a, double x) { d = a * x; }
+    static void mul_2(value& d, const value& a) { d = a + a; }
+    static void mul_2si(value& d, const value& a, long e) { d = ldexp(a, (int)e); }
+    static void neg(value& d, const value& a) { d = -a; }
+    static void abs(value& d, const value& a) { d = a < 0.0 ? -a : a; }
+    static bool greater_d(const value& a, double x) { return a > x; }
+};
+
+// Double-double, about 106 bits
+struct DoubleDoubleBackend {
+    typedef dd_real value;
+    static const char* name() { return "double-double"; }
+
+    static void init(value& a) { a = dd_make(0.0); }
+    static void init2(value& a, mpfr_prec_t) { a = dd_make(0.0); }
+    static void init_pooled(value& a, mpfr_prec_t, MpfrArena&) { a = dd_make(0.0); }
+    static void clear(value&) {}
+    static void set_prec(value&, mpfr_prec_t) {}
+    static mpfr_prec_t get_prec(const value&) { return 106; }
+    static void steal(value& d, value& s) { d = s; }
+    static void swap(value& a, value& b) { value t = a; a = b; b = t; }
+
+    static void set(value& d, const value& a) { d = a; }
+    static void set_d(value& d, double x) { d = dd_make(x); }
+    static void set_zero(value& d) { d = dd_make(0.0); }
+    static void set_str(value& d, const char* s, int base, bool = true) {
+        mpfr_t t;
+        mpfr_init2(t, 128);
+        mpfr_set_str(t, s, base, MPFR_RNDN);
+        set_mpfr(d, t);
+        mpfr_clear(t);
+    }
+    // Runs once per sample, so the remainder lives on the stack: x - hi
+    // rounded to 53 bits is already the nearest double to it
+    static void set_mpfr(value& d, mpfr_srcptr x) {
+        mp_limb_t limbs[(53 + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS];
+        mpfr_t t;
+        mpfr_custom_init(limbs, 53);
+        mpfr_custom_init_set(t, MPFR_ZERO_KIND, 0, 53, limbs);
+        d.hi = mpfr_get_d(x, MPFR_RNDN);
+        mpfr_sub_d(t, x, d.hi, MPFR_RNDN);
+        d.lo = mpfr_get_d(t, MPFR_RNDN);
+    }
+    // Exact when d has at least 107 bits
+    static void get_mpfr(mpfr_ptr d, const value& a) {
+        mpfr_set_d(d, a.hi, MPFR_RNDN);
+        mpfr_add_d(d, d, a.lo, MPFR_RNDN);
+    }
+    static double get_d(const value& a) { return a.hi; }
+    static void get_str(char* s, const value& a, int digits) {
+        mpfr_t t;
+        mpfr_init2(t, 128);
+        get_mpfr(t, a);
+        mpfr_sprintf(s, "%.*Rf", digits, t);
+        mpfr_clear(t);
+    }
+
+    static void add(value& d, const value& a, const value& b) { d = dd_add(a, b); }
+    static void sub(value& d, const value& a, const value& b) { d = dd_sub(a, b); }
+    static void mul(value& d, const value& a, const value& b) { d = dd_mul(a, b); }
+    static void sqr(value& d, const value& a) { d = dd_sqr(a); }
+    static void fma(value& d, const value& a, const value& b, const value& c) { d = dd_add(dd_mul(a, b), c); }
+    static void fnma(value& d, const value& a, const value& b, const value& c) { d = dd_sub(c, dd_mul(a, b)); }
+    static void mul_d(value& d, const value& a, double x) { d = dd_mul(a, dd_make(x)); }
+    static void mul_2(value& d, const value& a) { d = dd_ldexp(a, 1); }
+    static void mul_2si(value& d, const value& a, long e) { d = dd_ldexp(a, (int)e); }
+    static void neg(value& d, const value& a) { d = dd_neg(a); }
+    static void abs(value& d, const value& a) { d = dd_abs(a); }
+    static bool greater_d(const value& a, double x) { return dd_greater(a, x); }
+};
+
+// MPFR at any precision
+struct MpfrBackend {
+    typedef mpfr_t value;
+    static const char* name() { return "MPFR"; }
+
+    static void init(value& a) { mpfr_init(a); }
+    static void init2(value& a, mpfr_prec_t prec) { mpfr_init2(a, prec); }
+    static void init_pooled(value& a, mpfr_prec_t prec, MpfrArena& arena) { arena.init(a, prec); }
+    static void clear(value& a) { mpfr_clear(a); }
+    // Like mpfr_set_prec, the value is lost
+    static void set_prec(value& a, mpfr_prec_t prec) { mpfr_set_prec(a, prec); }
+    static mpfr_prec_t get_prec(const value& a) { return mpfr_get_prec(a); }
+    // Take over the limbs of s, which must not be cleared afterwards
+    static void steal(value& d, value& s) { d[0] = s[0]; }
+    static void swap(value& a, value& b) { mpfr_swap(a, b); }
+
+    static void set(value& d, const value& a) { mpfr_set(d, a, MPFR_RNDN); }
+    static void set_d(value& d, double x) { mpfr_set_d(d, x, MPFR_RNDN); }
+    static void set_zero(value& d) { mpfr_set_zero(d, 1); }
+    // Widen d first, if allowed, so that every digit typed by the user is kept
+    static void set_str(value& d, const char* s, int base, bool widen = true) {
+        mpfr_prec_t need = (mpfr_prec_t)(strlen(s) * 3.33) + 16;
+        if (widen && base == 10 && need > mpfr_get_prec(d))
+            mpfr_set_prec(d, need);
+        mpfr_set_str(d, s, base, MPFR_RNDN);
+    }
+    static void set_mpfr(value& d, mpfr_srcptr x) { mpfr_set(d, x, MPFR_RNDN); }
+    static void get_mpfr(mpfr_ptr d, const value& a) { mpfr_set(d, a, MPFR_RNDN); }
+    static double get_d(const value& a) { return mpfr_get_d(a, MPFR_RNDN); }
+    static void get_str(char* s, const value& a, int digits) { mpfr_sprintf(s, "%.*Rf", digits, a); }
+
+    static void add(value& d, const value& a, const value& b) { mpfr_add(d, a, b, MPFR_RNDN); }
+    static void sub(value& d, const value& a, const value& b) { mpfr_sub(d, a, b, MPFR_RNDN); }
+    static void mul(value& d, const value& a, const value& b) { mpfr_mul(d, a, b, MPFR_RNDN); }
+    static void sqr(value& d, const value& a) { mpfr_sqr(d, a, MPFR_RNDN); }
+    // The exact product followed by one rounding gives the same result as
+    // mpfr_fma, which allocates its product on the heap at high precision
+    static void fma(value& d, const value& a, const value& b, const value& c) {
+        mpfr_ptr p = product(a, b);
+        mpfr_add(d, p, c, MPFR_RNDN);
+    }
+    static void fnma(value& d, const value& a, const value& b, const value& c) {
+        mpfr_ptr p = product(a, b);
+        mpfr_sub(d, c, p, MPFR_RNDN);
+    }
+    static void mul_d(value& d, const value& a, double x) { mpfr_mul_d(d, a, x, MPFR_RNDN); }
+    static void mul_2(value& d, const value& a) { mpfr_mul_2ui(d, a, 1, MPFR_RNDN); }
+    static void mul_2si(value& d, const value& a, long e) { mpfr_mul_2si(d, a, e, MPFR_RNDN); }
+    static void neg(value& d, const value& a) { mpfr_neg(d, a, MPFR_RNDN); }
+    static void abs(value& d, const value& a) { mpfr_abs(d, a, MPFR_RNDN); }
+    static bool greater_d(const value& a, double x) { return mpfr_cmp_d(a, x) > 0; }
+
+private:
+    // Per-thread home of exact products; only grows, so it stops
+    // allocating once it has seen the widest operands
+    struct Product {
+        mpfr_t p;
+        Product() { mpfr_init2(p, 128); }
+        ~Product() { mpfr_clear(p); }
+    };
+
+    static mpfr_ptr product(const value& a, const value& b) {
+        static thread_local Product t;
+        mpfr_prec_t need = mpfr_get_prec(a) + mpfr_get_prec(b);
+        if (mpfr_get_prec(t.p) < need)
+            mpfr_set_prec(t.p, need);
+        mpfr_mul(t.p, a, b, MPFR_RNDN);
+        return t.p;
+    }
+};
+
+// Quaternion over a scalar backend
+// Constructor can take either 4 strings or 4 doubles, or nothing for all zeros.
+// Copy constructor and assignment operator are defined; moves only hand the
+// limbs over. A pooled quaternion takes its limbs from an MpfrArena, so the
+// sampling workers can build all their temporaries without touching the
+// heap. Its precision is fixed and it must not outlive the arena.
+template <typename B>
+struct QuaternionT {
+    typedef B backend;
+    typename B::value r, i, j, k;  // Real and imaginary components
+    bool owns_limbs;               // False when pooled or moved from
+
+    QuaternionT() : owns_limbs(true) {
+        B::init(r);
+        B::init(i);
+        B::init(j);
+        B::init(k);
+    }
+
+    // All components at the given precision (ignored by fixed-size backends)
+    explicit QuaternionT(mpfr_prec_t prec) : owns_limbs(true) {
+        B::init2(r, prec);
+        B::init2(i, prec);
+        B::init2(j, prec);
+        B::init2(k, prec);
+    }
+
+    // Pooled, all components at the given precision
+    QuaternionT(mpfr_prec_t prec, MpfrArena& arena) : owns_limbs(false) {
+        B::init_pooled(r, prec, arena);
+        B::init_pooled(i, prec, arena);
+        B::init_pooled(j, prec, arena);
+        B::init_pooled(k, prec, arena);
+    }
+
+    QuaternionT(const char* r_str, const char* i_str, const char* j_str, const char* k_str, int base = 10) : owns_limbs(true) {
+        B::init(r);
+        B::init(i);
+        B::init(j);
+        B::init(k);
+        set(r_str, i_str, j_str, k_str, base);
+    }
+
+    QuaternionT(double r_d, double i_d, double j_d, double k_d) : owns_limbs(true) {
+        B::init(r);
+        B::init(i);
+        B::init(j);
+        B::init(k);
+        set(r_d, i_d, j_d, k_d);
+    }
+
+    ~QuaternionT() {
+        if (!owns_limbs)
+            return;
+        B::clear(r);
+        B::clear(i);
+        B::clear(j);
+        B::clear(k);
+    }
+
+    QuaternionT(const QuaternionT& q) : owns_limbs(true) {
+        B::init2(r, B::get_prec(q.r));
+        B::init2(i, B::get_prec(q.i));
+        B::init2(j, B::get_prec(q.j));
+        B::init2(k, B::get_prec(q.k));
+        B::set(r, q.r);
+        B::set(i, q.i);
+        B::set(j, q.j);
+        B::set(k, q.k);
+    }
+
+    // The moved-from quaternion may only be destroyed or move-assigned to
+    QuaternionT(QuaternionT&& q) noexcept : owns_limbs(q.owns_limbs) {
+        B::steal(r, q.r);
+        B::steal(i, q.i);
+        B::steal(j, q.j);
+        B::steal(k, q.k);
+        q.owns_limbs = false;
+    }
+
+    QuaternionT& operator=(const QuaternionT& q) {
+        B::set(r, q.r);
+        B::set(i, q.i);
+        B::set(j, q.j);
+        B::set(k, q.k);
+        return *this;
+    }
+
+    QuaternionT& operator=(QuaternionT&& q) noexcept {
+        swap(q);
         return *this;
     }
 
-    // Function that takes 4 strings and sets the values of the quaternion
+    // Exchange values and storage
+    void swap(QuaternionT& q) {
+        B::swap(r, q.r);
+        B::swap(i, q.i);
+        B::swap(j, q.j);
+        B::swap(k, q.k);
+        bool t = owns_limbs; owns_limbs = q.owns_limbs; q.owns_limbs = t;
+    }
+
+    // Function that takes 4 strings and sets the values of the quaternion.
+    // Widens the components to keep every digit unless pooled.
     void set(const char* r_str, const char* i_str, const char* j_str, const char* k_str, int base = 10) {
-        printf("Entering set with 4 strings: %s %s %s %s\n", r_str, i_str, j_str, k_str);
-        mpfr_set_str(r, r_str, base, MPFR_RNDN);
-        mpfr_set_str(i, i_str, base, MPFR_RNDN);
-        mpfr_set_str(j, j_str, base, MPFR_RNDN);
-        mpfr_set_str(k, k_str, base, MPFR_RNDN);
-        printf("Finished set with 4 strings: %s %s %s %s\n", r_str, i_str, j_str, k_str);
+        B::set_str(r, r_str, base, owns_limbs);
+        B::set_str(i, i_str, base, owns_limbs);
+        B::set_str(j, j_str, base, owns_limbs);
+        B::set_str(k, k_str, base, owns_limbs);
     }
 
     // Function that takes 4 doubles and sets the values of the quaternion
     void set(double r_d, double i_d, double j_d, double k_d) {
-        printf("Entering set with 4 doubles: %f %f %f %f\n", r_d, i_d, j_d, k_d);
-        mpfr_set_d(r, r_d, MPFR_RNDN);
-        mpfr_set_d(i, i_d, MPFR_RNDN);
-        mpfr_set_d(j, j_d, MPFR_RNDN);
-        mpfr_set_d(k, k_d, MPFR_RNDN);
+        B::set_d(r, r_d);
+        B::set_d(i, i_d);
+        B::set_d(j, j_d);
+        B::set_d(k, k_d);
+    }
+
+    // Set from a quaternion of another backend, rounding if needed
+    template <typename B2>
+    void set(const QuaternionT<B2>& q, mpfr_t t) {
+        B2::get_mpfr(t, q.r); B::set_mpfr(r, t);
+        B2::get_mpfr(t, q.i); B::set_mpfr(i, t);
+        B2::get_mpfr(t, q.j); B::set_mpfr(j, t);
+        B2::get_mpfr(t, q.k); B::set_mpfr(k, t);
+    }
+
+    // Not for pooled quaternions, whose precision is fixed
+    void set_prec(mpfr_prec_t prec) {
+        if (!owns_limbs)
+            return;
+        B::set_prec(r, prec);
+        B::set_prec(i, prec);
+        B::set_prec(j, prec);
+        B::set_prec(k, prec);
     }
 
     // Function that returns the values of the quaternion as strings
     void get(char* r_str, char* i_str, char* j_str, char* k_str, int precision = 10) {
-        printf("Entering get with precision %d\n", precision);
-        mpfr_sprintf(r_str, "%.*Rf", precision, r);
-        mpfr_sprintf(i_str, "%.*Rf", precision, i);
-        mpfr_sprintf(j_str, "%.*Rf", precision, j);
-        mpfr_sprintf(k_str, "%.*Rf", precision, k);
+        B::get_str(r_str, r, precision);
+        B::get_str(i_str, i, precision);
+        B::get_str(j_str, j, precision);
+        B::get_str(k_str, k, precision);
     }
 
     // Function that returns the values of the quaternion as doubles
     void get(double* r_d, double* i_d, double* j_d, double* k_d) {
-        *r_d = mpfr_get_d(r, MPFR_RNDN);
-        *i_d = mpfr_get_d(i, MPFR_RNDN);
-        *j_d = mpfr_get_d(j, MPFR_RNDN);
-        *k_d = mpfr_get_d(k, MPFR_RNDN);
+        *r_d = B::get_d(r);
+        *i_d = B::get_d(i);
+        *j_d = B::get_d(j);
+        *k_d = B::get_d(k);
     }
 };
 
+// Storage type for beams and plates: full MPFR
+typedef QuaternionT<MpfrBackend> Quaternion;
+
+// Arithmetic helpers for the sampling workers. They take caller-owned
+// temporaries so the inner loop never allocates.
+
+// out = a * b. `out` must not alias `a` or `b`.
+template <typename B>
+inline void quaternion_mul(QuaternionT<B>& out, const QuaternionT<B>& a, const QuaternionT<B>& b) {
+    B::mul(out.r, a.r, b.r);
+    B::fnma(out.r, a.i, b.i, out.r);
+    B::fnma(out.r, a.j, b.j, out.r);
+    B::fnma(out.r, a.k, b.k, out.r);
+
+    B::mul(out.i, a.r, b.i);
+    B::fma(out.i, a.i, b.r, out.i);
+    B::fma(out.i, a.j, b.k, out.i);
+    B::fnma(out.i, a.k, b.j, out.i);
+
+    B::mul(out.j, a.r, b.j);
+    B::fnma(out.j, a.i, b.k, out.j);
+    B::fma(out.j, a.j, b.r, out.j);
+    B::fma(out.j, a.k, b.i, out.j);
+
+    B::mul(out.k, a.r, b.k);
+    B::fma(out.k, a.i, b.j, out.k);
+    B::fnma(out.k, a.j, b.i, out.k);
+    B::fma(out.k, a.k, b.r, out.k);
+}
+
+// out = a * a. `out` may alias `a`.
+template <typename B>
+inline void quaternion_sqr(QuaternionT<B>& out, const QuaternionT<B>& a, typename B::value& t, typename B::value& u) {
+    B::sqr(t, a.i);
+    B::fma(t, a.j, a.j, t);
+    B::fma(t, a.k, a.k, t);
+    B::mul_2(u, a.r);
+    B::mul(out.i, u, a.i);
+    B::mul(out.j, u, a.j);
+    B::mul(out.k, u, a.k);
+    B::sqr(out.r, a.r);
+    B::sub(out.r, out.r, t);
+}
+
+// out = a + b. Any aliasing is allowed.
+template <typename B>
+inline void quaternion_add(QuaternionT<B>& out, const QuaternionT<B>& a, const QuaternionT<B>& b) {
+    B::add(out.r, a.r, b.r);
+    B::add(out.i, a.i, b.i);
+    B::add(out.j, a.j, b.j);
+    B::add(out.k, a.k, b.k);
+}
+
+// out = a
+template <typename B>
+inline void quaternion_set(QuaternionT<B>& out, const QuaternionT<B>& a) {
+    B::set(out.r, a.r);
+    B::set(out.i, a.i);
+    B::set(out.j, a.j);
+    B::set(out.k, a.k);
+}
+
+template <typename B>
+inline void quaternion_set_zero(QuaternionT<B>& a) {
+    B::set_zero(a.r);
+    B::set_zero(a.i);
+    B::set_zero(a.j);
+    B::set_zero(a.k);
+}
+
+// Exchange the values of a and b without copying limbs
+template <typename B>
+inline void quaternion_swap(QuaternionT<B>& a, QuaternionT<B>& b) {
+    a.swap(b);
+}
+
+// out = |a|^2
+template <typename B>
+inline void quaternion_norm2(typename B::value& out, const QuaternionT<B>& a) {
+    B::sqr(out, a.r);
+    B::fma(out, a.i, a.i, out);
+    B::fma(out, a.j, a.j, out);
+    B::fma(out, a.k, a.k, out);
+}
+
 #endif
\ No newline at end of file
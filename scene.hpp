@@ -0,0 +1,613 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "beam.hpp"
+#include "plate.hpp"
+#include "models.hpp"
+#include "engine.hpp"
+
+// Everything a render needs: settings, beams and plates
+struct Scene {
+    RenderSettings settings;
+    std::vector<std::unique_ptr<Beam> > beams;
+    std::vector<std::unique_ptr<Plate> > plates;
+};
+
+// Text scene description, one `key value...` per line, # starts a comment.
+// Keys before the first section are render settings; `beam` and `plate`
+// each start a new section whose keys follow. Numbers that end up in MPFR
+// are kept as typed, so deep zooms lose no digits.
+//
+//   model Mandelbrot               # name from models[] or its index
+//   max_iterations 1000
+//   escape_radius 64
+//   julia_c -0.8 0.156 0 0
+//   beam
+//   samples 1000000
+//   seed abc
+//   mu -0.5 0 0 0
+//   sigma 1 1 0 0
+//   mode gaussian                  # or metropolis
+//   mh_large_step 0.1
+//   mh_mutation 0.05
+//   plate
+//   size 1024 1024
+//   morton 1
+//   sparse 1                       # allocate tiles on first hit
+//   projection4 <20 numbers, row by row>
+//   projection3 <12 numbers, row by row>
+//   colormap Viridis               # name from colormaps[] or its index
+//   tone log                       # linear, log, sqrt or equalize
+//   percentile 99.9                # count that gets the top colour
+//
+// Returns false and fills `error` with "file:line: what" on bad input.
+class SceneReader {
+public:
+    bool load(const char* path, Scene& scene, std::string& error) {
+        FILE* f = fopen(path, "r");
+        if (!f) {
+            error = std::string(path) + ": cannot open";
+            return false;
+        }
+        bool ok = true;
+        char line[8192];
+        int number = 0;
+        section = SECTION_SETTINGS;
+        while (ok && fgets(line, sizeof(line), f)) {
+            number++;
+            char* hash = strchr(line, '#');
+            if (hash)
+                *hash = '\0';
+            split(line);
+            if (words.empty())
+                continue;
+            std::string what;
+            if (!apply(scene, what)) {
+                char where[32];
+                snprintf(where, sizeof(where), ":%d: ", number);
+                error = std::string(path) + where + what;
+                ok = false;
+            }
+        }
+        fclose(f);
+        finish_plate(scene);
+        return ok;
+    }
+
+private:
+    enum Section { SECTION_SETTINGS, SECTION_BEAM, SECTION_PLATE };
+    Section section;
+    std::vector<std::string> words;
+
+    void split(char* line) {
+        words.clear();
+        for (char* w = strtok(line, " \t\r\n"); w; w = strtok(NULL, " \t\r\n"))
+            words.push_back(w);
+    }
+
+    // Check that the key has exactly n values
+    bool count(size_t n, std::string& what) {
+        if (words.size() == n + 1)
+            return true;
+        what = words[0] + " takes " + std::to_string(n) + (n == 1 ? " value" : " values");
+        return false;
+    }
+
+    const char* w(size_t i) const { return words[i].c_str(); }
+
+    // Value i as a name from `names` (any case) or its index; -1 if neither
+    int lookup(size_t i, const char* const* names, int n) const {
+        char* end;
+        long k = strtol(w(i), &end, 10);
+        if (*end != '\0') {
+            k = -1;
+            for (int j = 0; j < n; j++)
+                if (strcasecmp(w(i), names[j]) == 0)
+                    k = j;
+        }
+        return k >= 0 && k < n ? (int)k : -1;
+    }
+
+    bool apply(Scene& scene, std::string& what) {
+        const std::string& key = words[0];
+        if (key == "beam" || key == "plate") {
+            if (!count(0, what))
+                return false;
+            finish_plate(scene);
+            if (key == "beam") {
+                scene.beams.push_back(std::unique_ptr<Beam>(new Beam()));
+                section = SECTION_BEAM;
+            } else {
+                scene.plates.push_back(std::unique_ptr<Plate>(new Plate(1024, 1024)));
+                section = SECTION_PLATE;
+            }
+            return true;
+        }
+        if (section == SECTION_SETTINGS)
+            return apply_settings(scene.settings, what);
+        if (section == SECTION_BEAM)
+            return apply_beam(*scene.beams.back(), what);
+        return apply_plate(*scene.plates.back(), what);
+    }
+
+    bool apply_settings(RenderSettings& s, std::string& what) {
+        const std::string& key = words[0];
+        if (key == "model") {
+            if (!count(1, what))
+                return false;
+            int m = lookup(1, models, MODEL_COUNT);
+            if (m < 0) {
+                what = "unknown model " + words[1];
+                return false;
+            }
+            s.model = m;
+        } else if (key == "max_iterations") {
+            if (!count(1, what))
+                return false;
+            s.max_iterations = atoi(w(1));
+        } else if (key == "escape_radius") {
+            if (!count(1, what))
+                return false;
+            s.escape_radius = atof(w(1));
+        } else if (key == "julia_c") {
+            if (!count(4, what))
+                return false;
+            for (int c = 0; c < 4; c++)
+                s.julia_c[c] = atof(w(1 + c));
+        } else {
+            what = "unknown setting " + key;
+            return false;
+        }
+        return true;
+    }
+
+    bool apply_beam(Beam& b, std::string& what) {
+        const std::string& key = words[0];
+        if (key == "samples") {
+            if (!count(1, what))
+                return false;
+            b.samples_total = strtoll(w(1), NULL, 10);
+        } else if (key == "seed") {
+            if (!count(1, what))
+                return false;
+            b.seed_start = words[1];
+        } else if (key == "mu") {
+            if (!count(4, what))
+                return false;
+            b.mu.set(w(1), w(2), w(3), w(4));
+        } else if (key == "sigma") {
+            if (!count(4, what))
+                return false;
+            b.sigma.set(w(1), w(2), w(3), w(4));
+        } else if (key == "mode") {
+            if (!count(1, what))
+                return false;
+            if (words[1] == "gaussian")
+                b.mode = SAMPLING_GAUSSIAN;
+            else if (words[1] == "metropolis")
+                b.mode = SAMPLING_METROPOLIS;
+            else {
+                what = "unknown sampling mode " + words[1];
+                return false;
+            }
+        } else if (key == "mh_large_step") {
+            if (!count(1, what))
+                return false;
+            b.mh_large_step = atof(w(1));
+        } else if (key == "mh_mutation") {
+            if (!count(1, what))
+                return false;
+            b.mh_mutation = atof(w(1));
+        } else {
+            what = "unknown beam key " + key;
+            return false;
+        }
+        return true;
+    }
+
+    // size, morton and sparse only set the shape; the counts are allocated
+    // once the section ends, so a huge sparse plate is never dense first
+    void finish_plate(Scene& scene) {
+        if (section == SECTION_PLATE) {
+            Plate& p = *scene.plates.back();
+            p.resize(p.width, p.height);
+        }
+    }
+
+    bool apply_plate(Plate& p, std::string& what) {
+        const std::string& key = words[0];
+        if (key == "size") {
+            if (!count(2, what))
+                return false;
+            int width = atoi(w(1)), height = atoi(w(2));
+            if (width < 1 || height < 1) {
+                what = "bad plate size";
+                return false;
+            }
+            p.width = width;
+            p.height = height;
+        } else if (key == "morton") {
+            if (!count(1, what))
+                return false;
+            p.morton = atoi(w(1)) != 0;
+        } else if (key == "sparse") {
+            if (!count(1, what))
+                return false;
+            p.sparse = atoi(w(1)) != 0;
+        } else if (key == "projection4") {
+            if (!count(20, what))
+                return false;
+            for (int r = 0; r < 5; r++)
+                for (int c = 0; c < 4; c++)
+                    MpfrBackend::set_str(p.projection4[r][c], w(1 + r * 4 + c), 10);
+        } else if (key == "projection3") {
+            if (!count(12, what))
+                return false;
+            for (int r = 0; r < 4; r++)
+                for (int c = 0; c < 3; c++)
+                    MpfrBackend::set_str(p.projection3[r][c], w(1 + r * 3 + c), 10);
+        } else if (key == "colormap") {
+            if (!count(1, what))
+                return false;
+            int m = lookup(1, colormaps, COLORMAP_COUNT);
+            if (m < 0) {
+                what = "unknown colormap " + words[1];
+                return false;
+            }
+            p.tone.colormap = m;
+        } else if (key == "tone") {
+            if (!count(1, what))
+                return false;
+            int c = lookup(1, tone_curves, TONE_CURVE_COUNT);
+            if (c < 0) {
+                what = "unknown tone curve " + words[1];
+                return false;
+            }
+            p.tone.curve = c;
+        } else if (key == "percentile") {
+            if (!count(1, what))
+                return false;
+            float pct = (float)atof(w(1));
+            if (!(pct > 0 && pct <= 100)) {
+                what = "percentile must be in (0, 100]";
+                return false;
+            }
+            p.tone.percentile = pct;
+        } else {
+            what = "unknown plate key " + key;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Binary scene file, for saving a scene as it stands, sampling progress
+// included, and opening it again without parsing anything: "RB9SCENE",
+// then in host byte order
+//
+//   uint32 version (SCENE_FILE_VERSION), beam count, plate count
+//   int32 model, max_iterations; double escape_radius, julia_c[4]
+//   per beam:  string seed; int64 samples_total, samples_current;
+//              uint32 mode; double mh_large_step, mh_mutation;
+//              int64 mh_proposals, mh_accepted, mh_large_steps, mh_large_hits;
+//              uint32 pending count, then int64 begin and end of each;
+//              mpfr mu r, i, j, k, sigma r, i, j, k
+//   per plate: uint32 width, height, morton, sparse;
+//              int32 colormap, curve; float percentile;
+//              mpfr projection4 and projection3, row by row;
+//              string plate file, relative to the scene's directory
+//
+// A string is a uint32 length and its bytes; an mpfr is its int64
+// precision and a string MPFR reads back exactly in base 16. The counts
+// are kept in plate files next to the scene (Plate::save_tiles), which
+// opening maps instead of reading, so a scene with huge plates opens in
+// about the time it takes to read the beams.
+static const uint32_t SCENE_FILE_VERSION = 1;
+
+class SceneFileWriter {
+public:
+    std::string out;
+
+    template <typename T>
+    void put(T v) {
+        out.append((const char*)&v, sizeof(v));
+    }
+
+    void put_string(const std::string& s) {
+        put((uint32_t)s.size());
+        out += s;
+    }
+
+    void put_mpfr(mpfr_srcptr x) {
+        put((int64_t)mpfr_get_prec(x));
+        if (mpfr_nan_p(x)) {
+            put_string("@NaN@");
+        } else if (mpfr_inf_p(x)) {
+            put_string(mpfr_sgn(x) < 0 ? "-@Inf@" : "@Inf@");
+        } else if (mpfr_zero_p(x)) {
+            put_string("0");
+        } else {
+            // 0.digits times 16^e, every bit of the mantissa
+            mpfr_exp_t e;
+            char* digits = mpfr_get_str(NULL, &e, 16, 0, x, MPFR_RNDN);
+            bool negative = digits[0] == '-';
+            put_string(std::string(negative ? "-0." : "0.") + (digits + negative) + "@" + std::to_string((long long)e));
+            mpfr_free_str(digits);
+        }
+    }
+};
+
+class SceneFileParser {
+public:
+    bool ok;
+
+    SceneFileParser(const std::string& in) : ok(true), at(in.data()), end(in.data() + in.size()) {}
+
+    template <typename T>
+    T get() {
+        T v;
+        memset(&v, 0, sizeof(v));
+        if ((size_t)(end - at) < sizeof(v)) {
+            ok = false;
+            return v;
+        }
+        memcpy(&v, at, sizeof(v));
+        at += sizeof(v);
+        return v;
+    }
+
+    std::string get_string() {
+        uint32_t n = get<uint32_t>();
+        if (!ok || (size_t)(end - at) < n) {
+            ok = false;
+            return std::string();
+        }
+        std::string s(at, n);
+        at += n;
+        return s;
+    }
+
+    void get_mpfr(mpfr_ptr x) {
+        int64_t prec = get<int64_t>();
+        std::string s = get_string();
+        if (!ok || prec < MPFR_PREC_MIN || prec > MPFR_PREC_MAX) {
+            ok = false;
+            return;
+        }
+        mpfr_set_prec(x, (mpfr_prec_t)prec);
+        if (mpfr_set_str(x, s.c_str(), 16, MPFR_RNDN) != 0)
+            ok = false;
+    }
+
+private:
+    const char* at;
+    const char* end;
+};
+
+// Where save_scene_file() keeps plate `index` of the scene at `path`:
+// the scene's name without its extension, then _index.plate
+inline std::string scene_plate_path(const std::string& path, size_t index) {
+    size_t slash = path.find_last_of('/');
+    size_t dot = path.find_last_of('.');
+    std::string stem = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? path.substr(0, dot) : path;
+    return stem + "_" + std::to_string(index) + ".plate";
+}
+
+inline bool is_scene_file(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+    char magic[8];
+    bool binary = fread(magic, 1, 8, f) == 8 && memcmp(magic, "RB9SCENE", 8) == 0;
+    fclose(f);
+    return binary;
+}
+
+// Write the plates' counts, then the scene file naming them, each next to
+// its path and renamed over it. The beams must not be sampling, or their
+// progress and the counts would not match.
+inline bool save_scene_file(const char* path, const RenderSettings& settings, const std::vector<std::unique_ptr<Beam> >& beams,
+                            const std::vector<std::unique_ptr<Plate> >& plates, std::string& error) {
+    SceneFileWriter w;
+    w.out.append("RB9SCENE", 8);
+    w.put(SCENE_FILE_VERSION);
+    w.put((uint32_t)beams.size());
+    w.put((uint32_t)plates.size());
+    w.put((int32_t)settings.model);
+    w.put((int32_t)settings.max_iterations);
+    w.put(settings.escape_radius);
+    for (int c = 0; c < 4; c++)
+        w.put(settings.julia_c[c]);
+
+    for (size_t b = 0; b < beams.size(); b++) {
+        const Beam& beam = *beams[b];
+        w.put_string(beam.seed_start);
+        w.put((int64_t)beam.samples_total);
+        w.put((int64_t)beam.samples_current.load());
+        w.put((uint32_t)beam.mode);
+        w.put(beam.mh_large_step);
+        w.put(beam.mh_mutation);
+        w.put((int64_t)beam.mh_proposals.load());
+        w.put((int64_t)beam.mh_accepted.load());
+        w.put((int64_t)beam.mh_large_steps.load());
+        w.put((int64_t)beam.mh_large_hits.load());
+        w.put((uint32_t)beam.pending.size());
+        for (size_t r = 0; r < beam.pending.size(); r++) {
+            w.put((int64_t)beam.pending[r].begin);
+            w.put((int64_t)beam.pending[r].end);
+        }
+        mpfr_srcptr q[8] = { beam.mu.r, beam.mu.i, beam.mu.j, beam.mu.k, beam.sigma.r, beam.sigma.i, beam.sigma.j, beam.sigma.k };
+        for (int c = 0; c < 8; c++)
+            w.put_mpfr(q[c]);
+    }
+
+    for (size_t p = 0; p < plates.size(); p++) {
+        const Plate& plate = *plates[p];
+        std::string data = scene_plate_path(path, p);
+        if (!plate.save_tiles(data.c_str(), error))
+            return false;
+        w.put((uint32_t)plate.width);
+        w.put((uint32_t)plate.height);
+        w.put((uint32_t)plate.morton);
+        w.put((uint32_t)plate.sparse);
+        w.put((int32_t)plate.tone.colormap);
+        w.put((int32_t)plate.tone.curve);
+        w.put(plate.tone.percentile);
+        for (int r = 0; r < 5; r++)
+            for (int c = 0; c < 4; c++)
+                w.put_mpfr(plate.projection4[r][c]);
+        for (int r = 0; r < 4; r++)
+            for (int c = 0; c < 3; c++)
+                w.put_mpfr(plate.projection3[r][c]);
+        size_t slash = data.find_last_of('/');
+        w.put_string(slash == std::string::npos ? data : data.substr(slash + 1));
+    }
+
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        error = tmp + ": cannot create";
+        return false;
+    }
+    bool ok = fwrite(w.out.data(), 1, w.out.size(), f) == w.out.size();
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    remove(path);
+#endif
+    if (ok)
+        ok = rename(tmp.c_str(), path) == 0;
+    if (!ok) {
+        remove(tmp.c_str());
+        error = std::string(path) + ": cannot write";
+    }
+    return ok;
+}
+
+// Replace `scene` with the one save_scene_file() wrote; on failure it is
+// left as it was. The render settings that are not part of the scene
+// (threads, merging) keep their values.
+inline bool load_scene_file(const char* path, Scene& scene, std::string& error) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        error = std::string(path) + ": cannot open";
+        return false;
+    }
+    std::string in;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        in.append(buffer, n);
+    fclose(f);
+
+    SceneFileParser r(in);
+    Scene loaded;
+    loaded.settings = scene.settings;
+    char magic[8];
+    for (int c = 0; c < 8; c++)
+        magic[c] = r.get<char>();
+    uint32_t version = r.get<uint32_t>();
+    if (!r.ok || memcmp(magic, "RB9SCENE", 8) != 0 || version != SCENE_FILE_VERSION) {
+        error = std::string(path) + ": not a scene file of version " + std::to_string(SCENE_FILE_VERSION);
+        return false;
+    }
+    uint32_t beam_count = r.get<uint32_t>();
+    uint32_t plate_count = r.get<uint32_t>();
+    RenderSettings& s = loaded.settings;
+    s.model = r.get<int32_t>();
+    s.max_iterations = r.get<int32_t>();
+    s.escape_radius = r.get<double>();
+    for (int c = 0; c < 4; c++)
+        s.julia_c[c] = r.get<double>();
+    if (r.ok && (s.model < 0 || s.model >= MODEL_COUNT))
+        r.ok = false;
+
+    for (uint32_t b = 0; r.ok && b < beam_count; b++) {
+        loaded.beams.push_back(std::unique_ptr<Beam>(new Beam()));
+        Beam& beam = *loaded.beams.back();
+        beam.seed_start = r.get_string();
+        beam.samples_total = r.get<int64_t>();
+        beam.samples_current.store(r.get<int64_t>());
+        uint32_t mode = r.get<uint32_t>();
+        beam.mode = mode == SAMPLING_METROPOLIS ? SAMPLING_METROPOLIS : SAMPLING_GAUSSIAN;
+        beam.mh_large_step = r.get<double>();
+        beam.mh_mutation = r.get<double>();
+        beam.mh_proposals.store(r.get<int64_t>());
+        beam.mh_accepted.store(r.get<int64_t>());
+        beam.mh_large_steps.store(r.get<int64_t>());
+        beam.mh_large_hits.store(r.get<int64_t>());
+        uint32_t pending = r.get<uint32_t>();
+        for (uint32_t i = 0; r.ok && i < pending; i++) {
+            SampleRange range;
+            range.begin = r.get<int64_t>();
+            range.end = r.get<int64_t>();
+            r.ok = r.ok && range.end >= range.begin;
+            beam.pending.push_back(range);
+        }
+        mpfr_ptr q[8] = { beam.mu.r, beam.mu.i, beam.mu.j, beam.mu.k, beam.sigma.r, beam.sigma.i, beam.sigma.j, beam.sigma.k };
+        for (int c = 0; c < 8; c++)
+            r.get_mpfr(q[c]);
+        r.ok = r.ok && mode < 2;
+    }
+
+    size_t slash = std::string(path).find_last_of('/');
+    std::string dir = slash == std::string::npos ? std::string() : std::string(path).substr(0, slash + 1);
+    for (uint32_t p = 0; r.ok && p < plate_count; p++) {
+        int width = (int)r.get<uint32_t>();
+        int height = (int)r.get<uint32_t>();
+        bool morton = r.get<uint32_t>() != 0;
+        bool sparse = r.get<uint32_t>() != 0;
+        // Nothing is allocated until the counts are opened
+        loaded.plates.push_back(std::unique_ptr<Plate>(new Plate(1, 1, morton, sparse)));
+        Plate& plate = *loaded.plates.back();
+        plate.tone.colormap = r.get<int32_t>();
+        plate.tone.curve = r.get<int32_t>();
+        plate.tone.percentile = r.get<float>();
+        for (int i = 0; i < 5; i++)
+            for (int c = 0; c < 4; c++)
+                r.get_mpfr(plate.projection4[i][c]);
+        for (int i = 0; i < 4; i++)
+            for (int c = 0; c < 3; c++)
+                r.get_mpfr(plate.projection3[i][c]);
+        std::string data = r.get_string();
+        if (!r.ok || plate.tone.colormap < 0 || plate.tone.colormap >= COLORMAP_COUNT || plate.tone.curve < 0 ||
+            plate.tone.curve >= TONE_CURVE_COUNT || !(plate.tone.percentile > 0 && plate.tone.percentile <= 100)) {
+            r.ok = false;
+            break;
+        }
+        if (data.empty() || data[0] != '/')
+            data = dir + data;
+        if (!plate.open_file(data.c_str(), error))
+            return false;
+        if (plate.width != width || plate.height != height) {
+            error = data + ": plate file is " + std::to_string(plate.width) + "x" + std::to_string(plate.height) +
+                    ", the scene says " + std::to_string(width) + "x" + std::to_string(height);
+            return false;
+        }
+    }
+    if (!r.ok) {
+        error = std::string(path) + ": truncated or corrupt";
+        return false;
+    }
+    scene.settings = loaded.settings;
+    scene.beams.swap(loaded.beams);
+    scene.plates.swap(loaded.plates);
+    return true;
+}
+
+// A text scene, or a binary one from save_scene_file()
+inline bool load_scene(const char* path, Scene& scene, std::string& error) {
+    if (is_scene_file(path))
+        return load_scene_file(path, scene, error);
+    SceneReader reader;
+    return reader.load(path, scene, error);
+}
+
+#endif
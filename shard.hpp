@@ -0,0 +1,285 @@
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "scene.hpp"
+
+// Sharded rendering. Each of `shards` processes, on one host or on many
+// sharing a filesystem, runs the same scene with Beam::shard set, so it
+// samples its own slice of every beam's indices, and writes its plates
+// as plate files stamped with the scene hash (ShardStamp). Counts add
+// up, so the merged plate is exactly what one process would have drawn.
+// merge_shards() sums the files of one plate a block at a time on all
+// threads, reading every shard once from start to end.
+
+static const size_t MERGE_BLOCK_BYTES = 4 << 20; // Read from each shard at a time, per thread
+
+// Hash of what decides a render's counts: the model and its settings,
+// every beam's samples and distribution and every plate's size and
+// projection. Shards of one render must agree on it; tone settings, tile
+// order and progress may differ.
+inline uint64_t scene_hash(const RenderSettings& settings, const std::vector<std::unique_ptr<Beam> >& beams,
+                           const std::vector<std::unique_ptr<Plate> >& plates) {
+    SceneFileWriter w;
+    w.put(SCENE_FILE_VERSION);
+    w.put((int32_t)settings.model);
+    w.put((int32_t)settings.max_iterations);
+    w.put(settings.escape_radius);
+    for (int c = 0; c < 4; c++)
+        w.put(settings.julia_c[c]);
+    for (size_t b = 0; b < beams.size(); b++) {
+        const Beam& beam = *beams[b];
+        w.put_string(beam.seed_start);
+        w.put((int64_t)beam.samples_total);
+        w.put((uint32_t)beam.mode);
+        w.put(beam.mh_large_step);
+        w.put(beam.mh_mutation);
+        mpfr_srcptr q[8] = { beam.mu.r, beam.mu.i, beam.mu.j, beam.mu.k, beam.sigma.r, beam.sigma.i, beam.sigma.j, beam.sigma.k };
+        for (int c = 0; c < 8; c++)
+            w.put_mpfr(q[c]);
+    }
+    for (size_t p = 0; p < plates.size(); p++) {
+        const Plate& plate = *plates[p];
+        w.put((uint32_t)plate.width);
+        w.put((uint32_t)plate.height);
+        for (int r = 0; r < 5; r++)
+            for (int c = 0; c < 4; c++)
+                w.put_mpfr(plate.projection4[r][c]);
+        for (int r = 0; r < 4; r++)
+            for (int c = 0; c < 3; c++)
+                w.put_mpfr(plate.projection3[r][c]);
+    }
+    // Never 0, which marks a plate file that is not a shard
+    uint64_t h = prng_key(w.out);
+    return h ? h : 1;
+}
+
+// Make `scene` shard `shard` of `shards`: every beam samples only its
+// slice and every plate is stamped for its files. Call after the sample
+// counts are final, as they decide both the slices and the hash.
+inline void shard_scene(Scene& scene, int shard, int shards) {
+    uint64_t hash = scene_hash(scene.settings, scene.beams, scene.plates);
+    for (size_t b = 0; b < scene.beams.size(); b++) {
+        scene.beams[b]->shard = shard;
+        scene.beams[b]->shards = shards;
+    }
+    for (size_t p = 0; p < scene.plates.size(); p++) {
+        ShardStamp& s = scene.plates[p]->stamp;
+        s.scene_hash = hash;
+        s.plate = (uint32_t)p;
+        s.shard = (uint32_t)shard;
+        s.shards = (uint32_t)shards;
+    }
+}
+
+#ifndef _WIN32
+inline bool shard_read(int fd, void* buffer, size_t n, off_t at) {
+    char* p = (char*)buffer;
+    while (n) {
+        ssize_t got = pread(fd, p, n, at);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        p += got;
+        n -= (size_t)got;
+        at += got;
+    }
+    return true;
+}
+
+inline bool shard_write(int fd, const void* buffer, size_t n, off_t at) {
+    const char* p = (const char*)buffer;
+    while (n) {
+        ssize_t put = pwrite(fd, p, n, at);
+        if (put < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += put;
+        n -= (size_t)put;
+        at += put;
+    }
+    return true;
+}
+
+// Whether [at, at + n) of fd is a hole, which reads as zeros
+inline bool shard_hole(int fd, off_t at, size_t n) {
+#ifdef SEEK_DATA
+    off_t data = lseek(fd, at, SEEK_DATA);
+    return (data < 0 && errno == ENXIO) || (data >= 0 && data >= at + (off_t)n);
+#else
+    (void)fd; (void)at; (void)n;
+    return false;
+#endif
+}
+#endif
+
+// Sum the shard files of one plate, all shards of one render, into the
+// plate file `output`, stamped as the whole render (shard 0 of 1). The
+// inputs must agree on the scene hash, the plate, its size and tile
+// order, and hold every shard once. Blocks that are zero in every input
+// are left as holes. The output is written next to `output` and renamed
+// over it.
+inline bool merge_shards(const std::vector<std::string>& inputs, const char* output, int threads, std::string& error) {
+#ifdef _WIN32
+    (void)inputs; (void)output; (void)threads;
+    error = "merging shards needs a POSIX system";
+    return false;
+#else
+    if (inputs.empty()) {
+        error = "no shards to merge";
+        return false;
+    }
+    std::vector<int> fds;
+    std::vector<bool> seen(inputs.size(), false);
+    PlateFileHeader first;
+    memset(&first, 0, sizeof(first));
+    size_t bytes = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < inputs.size(); i++) {
+        const char* path = inputs[i].c_str();
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            error = inputs[i] + ": " + strerror(errno);
+            ok = false;
+            break;
+        }
+        fds.push_back(fd);
+        PlateFileHeader h;
+        struct stat st;
+        if (!shard_read(fd, &h, sizeof(h), 0) || fstat(fd, &st) != 0 || memcmp(h.magic, "RB9TILES", 8) != 0 ||
+            h.version != 1 || h.tile != PLATE_TILE ||
+            h.tiles != (uint64_t)((h.width + PLATE_TILE - 1) / PLATE_TILE) * ((h.height + PLATE_TILE - 1) / PLATE_TILE)) {
+            error = inputs[i] + ": not a plate file";
+            ok = false;
+        } else if (h.scene_hash == 0 || h.shards == 0 || h.shard >= h.shards) {
+            error = inputs[i] + ": not a shard";
+            ok = false;
+        } else if (i == 0) {
+            first = h;
+            bytes = PLATE_FILE_HEADER + (size_t)h.tiles * PLATE_TILE_CELLS * sizeof(int64_t);
+        } else if (h.scene_hash != first.scene_hash) {
+            error = inputs[i] + ": rendered from another scene than " + inputs[0];
+            ok = false;
+        } else if (h.plate != first.plate || h.width != first.width || h.height != first.height || h.morton != first.morton ||
+                   h.tiles != first.tiles || h.shards != first.shards) {
+            error = inputs[i] + ": another plate, tile order or shard count than " + inputs[0];
+            ok = false;
+        }
+        if (ok && (size_t)st.st_size != bytes) {
+            error = inputs[i] + ": truncated";
+            ok = false;
+        }
+        if (ok && h.shards != inputs.size()) {
+            error = inputs[i] + ": shard of " + std::to_string(h.shards) + ", but " + std::to_string(inputs.size()) + " files given";
+            ok = false;
+        }
+        if (ok && seen[h.shard]) {
+            error = inputs[i] + ": shard " + std::to_string(h.shard) + " given twice";
+            ok = false;
+        }
+        if (ok) {
+            seen[h.shard] = true;
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        }
+    }
+
+    std::string tmp = std::string(output) + ".tmp";
+    int out = -1;
+    if (ok) {
+        PlateFileHeader h = first;
+        h.shard = 0;
+        h.shards = 1;
+        out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = out >= 0 && ftruncate(out, (off_t)bytes) == 0 && shard_write(out, &h, sizeof(h), 0);
+        if (!ok)
+            error = tmp + ": " + strerror(errno);
+    }
+
+    if (ok) {
+        // Blocks go out in file order, so each shard is read front to back
+        const size_t data_bytes = bytes - PLATE_FILE_HEADER;
+        const size_t blocks = (data_bytes + MERGE_BLOCK_BYTES - 1) / MERGE_BLOCK_BYTES;
+        std::atomic<size_t> next(0);
+        std::atomic<bool> failed(false);
+        std::mutex error_mutex;
+        threads = std::max(1, std::min(threads, (int)std::min<size_t>(blocks, 1024)));
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++) {
+            pool.push_back(std::thread([&]() {
+                std::vector<int64_t> sum(MERGE_BLOCK_BYTES / sizeof(int64_t)), part(sum.size());
+                for (size_t k = next++; k < blocks && !failed.load(); k = next++) {
+                    off_t at = (off_t)(PLATE_FILE_HEADER + k * MERGE_BLOCK_BYTES);
+                    size_t n = std::min(MERGE_BLOCK_BYTES, data_bytes - k * MERGE_BLOCK_BYTES);
+                    size_t cells = n / sizeof(int64_t);
+                    bool any = false;
+                    for (size_t i = 0; i < fds.size(); i++) {
+                        if (shard_hole(fds[i], at, n))
+                            continue;
+                        if (!shard_read(fds[i], any ? &part[0] : &sum[0], n, at)) {
+                            std::lock_guard<std::mutex> lock(error_mutex);
+                            if (!failed.exchange(true))
+                                error = inputs[i] + ": " + strerror(errno ? errno : EIO);
+                            return;
+                        }
+                        if (any)
+                            for (size_t c = 0; c < cells; c++)
+                                sum[c] += part[c];
+                        any = true;
+                    }
+                    bool zero = true;
+                    for (size_t c = 0; any && zero && c < cells; c++)
+                        zero = sum[c] == 0;
+                    if (any && !zero && !shard_write(out, &sum[0], n, at)) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if (!failed.exchange(true))
+                            error = tmp + ": " + strerror(errno);
+                        return;
+                    }
+                }
+            }));
+        }
+        for (size_t t = 0; t < pool.size(); t++)
+            pool[t].join();
+        ok = !failed.load();
+    }
+
+    for (size_t i = 0; i < fds.size(); i++)
+        close(fds[i]);
+    if (out >= 0) {
+        if (close(out) != 0 && ok) {
+            error = tmp + ": " + strerror(errno);
+            ok = false;
+        }
+        if (ok && rename(tmp.c_str(), output) != 0) {
+            error = std::string(output) + ": " + strerror(errno);
+            ok = false;
+        }
+        if (!ok)
+            remove(tmp.c_str());
+    }
+    return ok;
+#endif
+}
+
+#endif
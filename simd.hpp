@@ -0,0 +1,219 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include <algorithm>
+#include <stdint.h>
+
+// Batched escape-time kernels for the double tier of the plain z^2 + c
+// models. Orbits are kept structure-of-arrays, one per vector lane; a lane
+// whose orbit escapes or runs out of iterations is refilled with the next
+// sample at once, and lanes left without work at the end of a batch are
+// masked off. The kernel only finds escape times; escaping orbits are
+// replayed by the scalar code to splat them.
+//
+// Lanes use the GCC/Clang vector extensions and are compiled once per
+// instruction set with a target attribute, so the build needs no -m flags;
+// the widest one the CPU supports is picked at run time. Other compilers
+// get the scalar loop. Lanes must round exactly like the scalar replay, so
+// the build turns off fused multiply-add contraction (-ffp-contract=off),
+// which AVX-512 would otherwise use.
+
+// out[s] = iteration at which |z|^2 > r2 for sample s, 0 if the orbit
+// stayed bounded for max_iter iterations, or ESCAPE_CYCLE if it came back
+// within cycle_tol of an earlier point (Brent: the point is saved at
+// iterations 1, 2, 4, 8, ...). cycle_tol = 0 turns the check off. Returns
+// the iterations run over all samples.
+static const int ESCAPE_CYCLE = -1;
+
+typedef int64_t (*EscapeKernelFn)(const double* cr, const double* ci, const double* cj, const double* ck,
+                               int count, int max_iter, double r2, double cycle_tol, int* out);
+
+struct EscapeKernel {
+    const char* name;
+    int lanes;
+    EscapeKernelFn run;
+};
+
+// Same arithmetic and order as quaternion_sqr + quaternion_add in
+// DoubleBackend, so that the replay sees the same orbit
+inline int64_t escape_kernel_scalar(const double* cr, const double* ci, const double* cj, const double* ck,
+                                    int count, int max_iter, double r2, double cycle_tol, int* out) {
+    const double tol2 = cycle_tol * cycle_tol;
+    int64_t iterations = 0;
+    for (int s = 0; s < count; s++) {
+        double zr = 0.0, zi = 0.0, zj = 0.0, zk = 0.0;
+        double sr = 0.0, si = 0.0, sj = 0.0, sk = 0.0;
+        int limit = 1;
+        int n;
+        out[s] = 0;
+        for (n = 1; n <= max_iter; n++) {
+            double t = zi * zi;
+            t = zj * zj + t;
+            t = zk * zk + t;
+            double u = zr + zr;
+            zi = u * zi + ci[s];
+            zj = u * zj + cj[s];
+            zk = u * zk + ck[s];
+            zr = zr * zr - t + cr[s];
+            double norm = zr * zr;
+            norm = zi * zi + norm;
+            norm = zj * zj + norm;
+            norm = zk * zk + norm;
+            if (norm > r2) {
+                out[s] = n;
+                break;
+            }
+            double dr = zr - sr, di = zi - si, dj = zj - sj, dk = zk - sk;
+            if (dr * dr + di * di + dj * dj + dk * dk < tol2) {
+                out[s] = ESCAPE_CYCLE;
+                break;
+            }
+            if (n == limit) {
+                sr = zr; si = zi; sj = zj; sk = zk;
+                limit *= 2;
+            }
+        }
+        iterations += std::min(n, max_iter);
+    }
+    return iterations;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+
+// V is a vector of W doubles, M the matching vector of 64-bit integers
+template <typename V, typename M, int W>
+__attribute__((always_inline)) inline int64_t escape_kernel_lanes(const double* cr, const double* ci, const double* cj, const double* ck,
+                                                                int count, int max_iter, double r2, double cycle_tol, int* out) {
+    // Idle lanes sit at z = c = 0 with a counter that never reaches max_iter
+    // and are kept out of the cycle test by `live_mask`
+    const int64_t idle = -((int64_t)1 << 62);
+    V zr, zi, zj, zk, vr, vi, vj, vk, sr, si, sj, sk, r2v, tol2v;
+    M n, maxv, limit, live_mask;
+    int index[W];
+    int next = 0, live = 0;
+    int64_t iterations = 0;
+    for (int l = 0; l < W; l++) {
+        zr[l] = zi[l] = zj[l] = zk[l] = 0.0;
+        sr[l] = si[l] = sj[l] = sk[l] = 0.0;
+        r2v[l] = r2;
+        tol2v[l] = cycle_tol * cycle_tol;
+        maxv[l] = max_iter;
+        limit[l] = 1;
+        if (next < count) {
+            index[l] = next;
+            vr[l] = cr[next]; vi[l] = ci[next]; vj[l] = cj[next]; vk[l] = ck[next];
+            n[l] = 0;
+            live_mask[l] = -1;
+            next++;
+            live++;
+        } else {
+            index[l] = -1;
+            vr[l] = vi[l] = vj[l] = vk[l] = 0.0;
+            n[l] = idle;
+            live_mask[l] = 0;
+        }
+    }
+
+    while (live > 0) {
+        V t = zi * zi;
+        t = zj * zj + t;
+        t = zk * zk + t;
+        V u = zr + zr;
+        zi = u * zi + vi;
+        zj = u * zj + vj;
+        zk = u * zk + vk;
+        zr = zr * zr - t + vr;
+        V norm = zr * zr;
+        norm = zi * zi + norm;
+        norm = zj * zj + norm;
+        norm = zk * zk + norm;
+        n = n + 1;
+
+        V dr = zr - sr, di = zi - si, dj = zj - sj, dk = zk - sk;
+        V dist = dr * dr + di * di + dj * dj + dk * dk;
+        M escaped = norm > r2v;
+        M cycled = (dist < tol2v) & live_mask & ~escaped;
+        M save = n == limit;
+        sr = save ? zr : sr;
+        si = save ? zi : si;
+        sj = save ? zj : sj;
+        sk = save ? zk : sk;
+        limit = save ? limit + limit : limit;
+
+        M done = escaped | cycled | (n >= maxv);
+        int64_t any = 0;
+        for (int l = 0; l < W; l++)
+            any |= done[l];
+        if (!any)
+            continue;
+
+        for (int l = 0; l < W; l++) {
+            if (!done[l])
+                continue;
+            out[index[l]] = escaped[l] ? (int)n[l] : cycled[l] ? ESCAPE_CYCLE : 0;
+            iterations += n[l];
+            zr[l] = zi[l] = zj[l] = zk[l] = 0.0;
+            sr[l] = si[l] = sj[l] = sk[l] = 0.0;
+            limit[l] = 1;
+            if (next < count) {
+                index[l] = next;
+                vr[l] = cr[next]; vi[l] = ci[next]; vj[l] = cj[next]; vk[l] = ck[next];
+                n[l] = 0;
+                next++;
+            } else {
+                index[l] = -1;
+                vr[l] = vi[l] = vj[l] = vk[l] = 0.0;
+                n[l] = idle;
+                live_mask[l] = 0;
+                live--;
+            }
+        }
+    }
+    return iterations;
+}
+
+typedef double simd_v2d __attribute__((vector_size(16)));
+typedef long long simd_v2l __attribute__((vector_size(16)));
+typedef double simd_v4d __attribute__((vector_size(32)));
+typedef long long simd_v4l __attribute__((vector_size(32)));
+typedef double simd_v8d __attribute__((vector_size(64)));
+typedef long long simd_v8l __attribute__((vector_size(64)));
+
+// Two SSE2 registers per operand, so four orbits are in flight
+__attribute__((target("sse2"))) inline int64_t escape_kernel_sse2(const double* cr, const double* ci, const double* cj, const double* ck,
+                                                                int count, int max_iter, double r2, double cycle_tol, int* out) {
+    return escape_kernel_lanes<simd_v4d, simd_v4l, 4>(cr, ci, cj, ck, count, max_iter, r2, cycle_tol, out);
+}
+
+__attribute__((target("avx2"))) inline int64_t escape_kernel_avx2(const double* cr, const double* ci, const double* cj, const double* ck,
+                                                                int count, int max_iter, double r2, double cycle_tol, int* out) {
+    return escape_kernel_lanes<simd_v4d, simd_v4l, 4>(cr, ci, cj, ck, count, max_iter, r2, cycle_tol, out);
+}
+
+__attribute__((target("avx512f"))) inline int64_t escape_kernel_avx512(const double* cr, const double* ci, const double* cj, const double* ck,
+                                                                     int count, int max_iter, double r2, double cycle_tol, int* out) {
+    return escape_kernel_lanes<simd_v8d, simd_v8l, 8>(cr, ci, cj, ck, count, max_iter, r2, cycle_tol, out);
+}
+#endif
+
+// Widest kernel this CPU runs, picked once
+inline const EscapeKernel& escape_kernel() {
+    static const EscapeKernel kernel = []() {
+        EscapeKernel k = { "scalar", 1, escape_kernel_scalar };
+#ifdef SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            k.name = "AVX-512"; k.lanes = 8; k.run = escape_kernel_avx512;
+        } else if (__builtin_cpu_supports("avx2")) {
+            k.name = "AVX2"; k.lanes = 4; k.run = escape_kernel_avx2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            k.name = "SSE2"; k.lanes = 4; k.run = escape_kernel_sse2;
+        }
+#endif
+        return k;
+    }();
+    return kernel;
+}
+
+#endif
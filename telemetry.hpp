@@ -0,0 +1,167 @@
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+// Render telemetry. Each worker counts into plain WorkerCounters of its own
+// and publishes them every TELEMETRY_PUBLISH_MS into its TelemetrySlot.
+// Readers copy a slot out under a sequence lock: the worker never waits,
+// and a reader only retries if it raced a publish.
+
+static const int TELEMETRY_PUBLISH_MS = 100;
+
+inline int64_t steady_ns() {
+    return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Running totals of one worker since the run started
+struct WorkerCounters {
+    int64_t samples;                 // Counted when their orbit is done
+    int64_t iterations;              // Escape passes and replays
+    int64_t escaped;                 // Samples whose orbit escaped
+    int64_t interior;                // Rejected by the cardioid and bulb tests
+    int64_t hits;                    // Orbit points deposited on the plates
+    int64_t merges;                  // Full tile cache flushes
+    int64_t merge_ns;                // Time spent in them
+    int64_t busy_ns;                 // Time spent on ranges, merges included
+
+    WorkerCounters() : samples(0), iterations(0), escaped(0), interior(0), hits(0), merges(0), merge_ns(0), busy_ns(0) {}
+
+    void add(const WorkerCounters& c) {
+        samples += c.samples;
+        iterations += c.iterations;
+        escaped += c.escaped;
+        interior += c.interior;
+        hits += c.hits;
+        merges += c.merges;
+        merge_ns += c.merge_ns;
+        busy_ns += c.busy_ns;
+    }
+};
+
+// Where one worker publishes its counters; written by that worker only
+class TelemetrySlot {
+public:
+    TelemetrySlot() : seq(0) {
+        publish(WorkerCounters());
+    }
+
+    void publish(const WorkerCounters& c) {
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        samples.store(c.samples, std::memory_order_relaxed);
+        iterations.store(c.iterations, std::memory_order_relaxed);
+        escaped.store(c.escaped, std::memory_order_relaxed);
+        interior.store(c.interior, std::memory_order_relaxed);
+        hits.store(c.hits, std::memory_order_relaxed);
+        merges.store(c.merges, std::memory_order_relaxed);
+        merge_ns.store(c.merge_ns, std::memory_order_relaxed);
+        busy_ns.store(c.busy_ns, std::memory_order_relaxed);
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    // The counters of one publish, never a mix of two
+    WorkerCounters read() const {
+        WorkerCounters c;
+        for (;;) {
+            uint32_t s = seq.load(std::memory_order_acquire);
+            if (s & 1)
+                continue;
+            c.samples = samples.load(std::memory_order_relaxed);
+            c.iterations = iterations.load(std::memory_order_relaxed);
+            c.escaped = escaped.load(std::memory_order_relaxed);
+            c.interior = interior.load(std::memory_order_relaxed);
+            c.hits = hits.load(std::memory_order_relaxed);
+            c.merges = merges.load(std::memory_order_relaxed);
+            c.merge_ns = merge_ns.load(std::memory_order_relaxed);
+            c.busy_ns = busy_ns.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == s)
+                return c;
+        }
+    }
+
+private:
+    std::atomic<uint32_t> seq;       // Odd while a publish is under way
+    std::atomic<int64_t> samples, iterations, escaped, interior, hits, merges, merge_ns, busy_ns;
+
+    TelemetrySlot(const TelemetrySlot&);
+    TelemetrySlot& operator=(const TelemetrySlot&);
+};
+
+// Every worker's counters as last published, and when they were read
+struct TelemetrySnapshot {
+    double seconds;                  // Since the run started
+    std::vector<WorkerCounters> workers;
+
+    TelemetrySnapshot() : seconds(0.0) {}
+
+    WorkerCounters total() const {
+        WorkerCounters t;
+        for (size_t w = 0; w < workers.size(); w++)
+            t.add(workers[w]);
+        return t;
+    }
+};
+
+// What happened between two readings of the same counters, `span` seconds
+// apart, over `threads` workers
+struct TelemetryRates {
+    double samples_per_s;
+    double iterations_per_s;
+    double hits_per_s;
+    double escape_ratio;             // Of the samples done
+    double interior_ratio;
+    double merge_ms;                 // Mean length of a merge
+    double idle;                     // Fraction of the workers' time not spent sampling
+
+    TelemetryRates(const WorkerCounters& a, const WorkerCounters& b, double span, int threads = 1) {
+        double s = span > 0.0 ? span : 1.0;
+        double samples = (double)(b.samples - a.samples);
+        double merges = (double)(b.merges - a.merges);
+        samples_per_s = samples / s;
+        iterations_per_s = (b.iterations - a.iterations) / s;
+        hits_per_s = (b.hits - a.hits) / s;
+        escape_ratio = samples > 0.0 ? (b.escaped - a.escaped) / samples : 0.0;
+        interior_ratio = samples > 0.0 ? (b.interior - a.interior) / samples : 0.0;
+        merge_ms = merges > 0.0 ? (b.merge_ns - a.merge_ns) * 1e-6 / merges : 0.0;
+        idle = span > 0.0 ? 1.0 - (b.busy_ns - a.busy_ns) * 1e-9 / (span * threads) : 0.0;
+        if (idle < 0.0)
+            idle = 0.0;
+    }
+};
+
+inline void telemetry_json_rates(FILE* f, const TelemetryRates& r) {
+    fprintf(f, "\"samples_per_s\":%.1f,\"iterations_per_s\":%.1f,\"hits_per_s\":%.1f,"
+            "\"escape_ratio\":%.4f,\"interior_ratio\":%.4f,\"merge_ms\":%.3f,\"idle\":%.4f",
+            r.samples_per_s, r.iterations_per_s, r.hits_per_s, r.escape_ratio, r.interior_ratio, r.merge_ms, r.idle);
+}
+
+// One JSON line with the rates from `before` to `now`, overall and per
+// worker, and the totals so far
+inline void telemetry_json(FILE* f, const TelemetrySnapshot& before, const TelemetrySnapshot& now) {
+    double span = now.seconds - before.seconds;
+    int threads = (int)now.workers.size();
+    // Readings of another run count from zero
+    bool same = before.workers.size() == now.workers.size();
+    WorkerCounters t = now.total();
+    WorkerCounters t0 = same ? before.total() : WorkerCounters();
+    fprintf(f, "{\"t\":%.3f,\"span\":%.3f,\"samples\":%lld,\"iterations\":%lld,\"hits\":%lld,",
+            now.seconds, span, (long long)t.samples, (long long)t.iterations, (long long)t.hits);
+    telemetry_json_rates(f, TelemetryRates(t0, t, span, threads));
+    fprintf(f, ",\"threads\":[");
+    for (int w = 0; w < threads; w++) {
+        WorkerCounters a = same ? before.workers[w] : WorkerCounters();
+        fprintf(f, "%s{", w ? "," : "");
+        telemetry_json_rates(f, TelemetryRates(a, now.workers[w], span));
+        fprintf(f, "}");
+    }
+    fprintf(f, "]}\n");
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef TILECACHE_HPP
+#define TILECACHE_HPP
+
+#include <chrono>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+#include "plate.hpp"
+
+// Private, per-worker histogram tiles in front of the shared plates.
+// Hits land in a worker-owned PLATE_TILE x PLATE_TILE block with plain
+// increments; blocks are merged into the plate (Plate::merge_tile) when
+// the slot is needed for another tile, after `batch` hits, or once
+// `interval` has passed. Only a sparse plate locks, one tile per merge,
+// and workers never write the same cache line of a plate except during a
+// merge.
+class TileCache {
+public:
+    TileCache(const std::vector<Plate*>& plates_in, int64_t batch_in, int interval_ms, size_t max_slots = 256)
+        : plates(plates_in), batch(batch_in), interval(std::chrono::milliseconds(interval_ms)), pending(0), polls(0),
+          deposited(0), merges(0), merge_time(0) {
+        if (batch < 1)
+            batch = 1;
+        // Counters are 32-bit; a full flush every `batch` hits keeps them safe
+        if (batch > INT32_MAX)
+            batch = INT32_MAX;
+
+        // One slot per tile if everything fits, so small plates never evict
+        size_t tiles = 0;
+        for (size_t p = 0; p < plates.size(); p++) {
+            tile_base.push_back(tiles);
+            tiles += (size_t)plates[p]->tiles_x() * plates[p]->tiles_y();
+        }
+        direct = tiles <= max_slots;
+        size_t n = 1;
+        while (n < tiles && n < max_slots)
+            n <<= 1;
+        slots.resize(direct ? tiles : n);
+        cells.assign(slots.size() * PLATE_TILE * PLATE_TILE, 0);
+        last_flush = std::chrono::steady_clock::now();
+    }
+
+    ~TileCache() {
+        flush_all();
+    }
+
+    void deposit(size_t plate, int x, int y, uint32_t n = 1) {
+        int tx = x / PLATE_TILE;
+        int ty = y / PLATE_TILE;
+        size_t index = slot_index(plate, tx, ty);
+        Slot& slot = slots[index];
+        if (slot.row_mask && (slot.plate != plate || slot.tx != tx || slot.ty != ty))
+            flush(index);
+        slot.plate = plate;
+        slot.tx = tx;
+        slot.ty = ty;
+        int r = y - ty * PLATE_TILE;
+        slot.row_mask |= 1ULL << r;
+        cells[index * PLATE_TILE * PLATE_TILE + r * PLATE_TILE + (x - tx * PLATE_TILE)] += n;
+        pending += n;
+        deposited += n;
+        if (pending >= batch)
+            flush_all();
+    }
+
+    // Cheap enough to call once per sample
+    void maybe_flush() {
+        if (pending == 0 || ++polls < 64)
+            return;
+        polls = 0;
+        if (std::chrono::steady_clock::now() - last_flush >= interval)
+            flush_all();
+    }
+
+    void flush_all() {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < slots.size(); i++)
+            if (slots[i].row_mask)
+                flush(i);
+        pending = 0;
+        last_flush = std::chrono::steady_clock::now();
+        merges++;
+        merge_time += last_flush - start;
+    }
+
+    // Hits taken in, full flushes and the time they took, since construction
+    int64_t hits() const { return deposited; }
+    int64_t flushes() const { return merges; }
+    int64_t flush_ns() const { return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(merge_time).count(); }
+
+private:
+    struct Slot {
+        size_t plate;
+        int tx, ty;
+        uint64_t row_mask;           // Rows of the block holding nonzero counts
+        Slot() : plate(0), tx(-1), ty(-1), row_mask(0) {}
+    };
+
+    std::vector<Plate*> plates;
+    std::vector<Slot> slots;
+    std::vector<size_t> tile_base;   // First slot of each plate when direct
+    bool direct;
+    std::vector<uint32_t> cells;     // slots.size() blocks, row-major
+    int64_t batch;
+    std::chrono::steady_clock::duration interval;
+    std::chrono::steady_clock::time_point last_flush;
+    int64_t pending;
+    int polls;
+    int64_t deposited, merges;
+    std::chrono::steady_clock::duration merge_time;
+
+    size_t slot_index(size_t plate, int tx, int ty) const {
+        if (direct)
+            return tile_base[plate] + (size_t)ty * plates[plate]->tiles_x() + tx;
+        uint64_t h = (uint64_t)tx * 0x9E3779B97F4A7C15ULL ^ (uint64_t)ty * 0xC2B2AE3D27D4EB4FULL ^ (uint64_t)plate * 0x165667B19E3779F9ULL;
+        return (size_t)(h >> 32) & (slots.size() - 1);
+    }
+
+    void flush(size_t index) {
+        Slot& slot = slots[index];
+        plates[slot.plate]->merge_tile(slot.tx, slot.ty, &cells[index * PLATE_TILE * PLATE_TILE], slot.row_mask);
+        slot.row_mask = 0;
+    }
+
+    TileCache(const TileCache&);
+    TileCache& operator=(const TileCache&);
+};
+
+#endif